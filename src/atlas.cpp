@@ -0,0 +1,209 @@
+#include "atlas.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <utility>
+
+#include "thread_pool.hpp"
+
+namespace
+{
+
+// The runs of consecutive i in [begin, end) where 'filled(i)' holds.
+template<typename Fn>
+std::vector<std::pair<unsigned, unsigned>> runs(unsigned begin, unsigned end, Fn const& filled)
+{
+    std::vector<std::pair<unsigned, unsigned>> result;
+    for(unsigned i = begin; i < end;)
+    {
+        if(!filled(i))
+        {
+            i += 1;
+            continue;
+        }
+
+        unsigned j = i + 1;
+        while(j < end && filled(j))
+            j += 1;
+        result.push_back({ i, j });
+        i = j;
+    }
+    return result;
+}
+
+std::uint8_t nearest_nes_color(rgb_t color)
+{
+    std::uint8_t best_color = 0;
+    float best_dist = INFINITY;
+    for(unsigned c = 0; c < 64; c += 1)
+    {
+        float const dist = distance(color, nes_colors[c]);
+        if(dist < best_dist)
+        {
+            best_dist = dist;
+            best_color = c;
+        }
+    }
+    return best_color;
+}
+
+} // namespace
+
+std::vector<atlas_rect_t> find_cells(wxImage const& sheet, rgb_t background, unsigned cell_w, unsigned cell_h)
+{
+    std::vector<atlas_rect_t> cells;
+    if(!sheet.IsOk())
+        return cells;
+
+    unsigned const sw = sheet.GetWidth();
+    unsigned const sh = sheet.GetHeight();
+    unsigned char const* const data = sheet.GetData();
+
+    auto const empty = [&](atlas_rect_t r) -> bool
+    {
+        for(unsigned y = r.y; y < r.y + r.h; y += 1)
+        for(unsigned x = r.x; x < r.x + r.w; x += 1)
+        {
+            unsigned const i = (x + y*sw) * 3;
+            if(rgb_t{ data[i+0], data[i+1], data[i+2] } != background)
+                return false;
+        }
+        return true;
+    };
+
+    if(cell_w && cell_h)
+    {
+        for(unsigned y = 0; y < sh; y += cell_h)
+        for(unsigned x = 0; x < sw; x += cell_w)
+        {
+            atlas_rect_t const cell = { x, y, std::min(cell_w, sw - x), std::min(cell_h, sh - y) };
+            if(!empty(cell))
+                cells.push_back(cell);
+        }
+        return cells;
+    }
+
+    // Cut into strips of rows, then each strip into columns:
+    for(auto [y0, y1] : runs(0, sh, [&](unsigned y) { return !empty({ 0, y, sw, 1 }); }))
+    for(auto [x0, x1] : runs(0, sw, [&](unsigned x) { return !empty({ x, y0, 1, y1 - y0 }); }))
+    {
+        // Only the strip's rows can still be empty:
+        unsigned top = y0;
+        unsigned bottom = y1;
+        while(empty({ x0, top, x1 - x0, 1 }))
+            top += 1;
+        while(empty({ x0, bottom - 1, x1 - x0, 1 }))
+            bottom -= 1;
+        cells.push_back({ x0, top, x1 - x0, bottom - top });
+    }
+
+    return cells;
+}
+
+atlas_t convert_atlas(settings_t const& settings, wxImage const& sheet, wxImage const& dither_image,
+                      unsigned cell_w, unsigned cell_h, unsigned colors, bool map,
+                      progress_fn_t const& progress)
+{
+    atlas_t atlas;
+    if(!sheet.IsOk() || settings.w <= 0 || settings.h <= 0)
+        return atlas;
+
+    unsigned const sw = sheet.GetWidth();
+    unsigned const sh = sheet.GetHeight();
+    unsigned char const* const data = sheet.GetData();
+
+    // Sprites get three colors plus the transparent background:
+    colors = std::clamp(colors, 1u, 3u);
+
+    rgb_t const background = { data[0], data[1], data[2] };
+    std::uint8_t const background_nes = nearest_nes_color(background);
+
+    atlas.w = settings.w;
+    atlas.h = settings.h;
+    atlas.nes.assign(atlas.w * atlas.h, background_nes);
+
+    std::vector<atlas_rect_t> const sources = find_cells(sheet, background, cell_w, cell_h);
+    atlas.cells.resize(sources.size());
+
+    std::atomic<unsigned> done = 0;
+    std::atomic<bool> cancel = false;
+
+    thread_pool_t::global().parallel_for(0, sources.size(), [&](unsigned i)
+    {
+        if(cancel)
+            return;
+
+        atlas_cell_t& cell = atlas.cells[i];
+        cell.source = sources[i];
+        cell.palette.fill(0xFF);
+        cell.palette[0] = background_nes;
+
+        // Each cell keeps its share of the whole sheet's output size:
+        unsigned const x0 = cell.source.x * atlas.w / sw;
+        unsigned const y0 = cell.source.y * atlas.h / sh;
+        unsigned const x1 = (cell.source.x + cell.source.w) * atlas.w / sw;
+        unsigned const y1 = (cell.source.y + cell.source.h) * atlas.h / sh;
+        cell.output = { x0, y0, x1 - x0, y1 - y0 };
+
+        if(cell.output.w && cell.output.h)
+        {
+            wxImage const image = sheet.GetSubImage(wxRect(cell.source.x, cell.source.y, cell.source.w, cell.source.h));
+
+            // The background is shared, so it stays out of the cell's own colors:
+            std::size_t const pixels = std::size_t(image.GetWidth()) * image.GetHeight();
+            color_histogram_t histogram = make_histogram(image.GetData(), pixels);
+            std::erase_if(histogram, [&](color_count_t const& c) { return c.color == background; });
+
+            settings_t cell_settings = settings;
+            cell_settings.w = cell.output.w;
+            cell_settings.h = cell.output.h;
+            cell_settings.nes_attributes = false;
+            cell_settings.tile_budget = 0;
+            cell_settings.rois.clear(); // They are placed for the main image.
+            cell_settings.auto_color(histogram, colors, map);
+
+            // Knob 0 becomes the background:
+            auto& knobs = cell_settings.color_knobs;
+            std::rotate(knobs.rbegin(), knobs.rbegin() + 1, knobs.rend());
+            knobs[0] = {};
+            knobs[0].nes_color = background_nes;
+            knobs[0].map_colors[0] = background;
+            knobs[0].map_enable[0] = true;
+
+            std::vector<std::uint8_t> nes;
+            std::vector<std::uint8_t> attributes;
+            cell_settings.convert(image, dither_image, nes, attributes);
+
+            for(unsigned y = 0; y < cell.output.h; y += 1)
+                std::copy_n(&nes[y * cell.output.w], cell.output.w, &atlas.nes[x0 + (y0 + y) * atlas.w]);
+
+            for(unsigned k = 1; k < cell.palette.size(); k += 1)
+                cell.palette[k] = knobs[k].nes_color;
+        }
+
+        if(progress && !progress(float(++done) / sources.size()))
+            cancel = true;
+    });
+
+    return atlas;
+}
+
+bool write_atlas_palettes(std::string const& path, atlas_t const& atlas)
+{
+    std::FILE* fp = std::fopen(path.c_str(), "w");
+    if(!fp)
+        return false;
+
+    std::fprintf(fp, "x,y,w,h,background,color1,color2,color3\n");
+    for(atlas_cell_t const& cell : atlas.cells)
+    {
+        std::fprintf(fp, "%u,%u,%u,%u", cell.output.x, cell.output.y, cell.output.w, cell.output.h);
+        for(std::uint8_t color : cell.palette)
+            std::fprintf(fp, ",%s", color_string(color).c_str());
+        std::fprintf(fp, "\n");
+    }
+
+    bool const ok = !std::ferror(fp);
+    return std::fclose(fp) == 0 && ok;
+}
@@ -0,0 +1,52 @@
+#ifndef ATLAS_HPP
+#define ATLAS_HPP
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <wx/wx.h>
+
+#include "image_io.hpp"
+#include "model.hpp"
+
+struct atlas_rect_t
+{
+    unsigned x, y, w, h;
+};
+
+struct atlas_cell_t
+{
+    atlas_rect_t source; // In sheet pixels.
+    atlas_rect_t output; // In output pixels.
+
+    // The background color first, then the cell's own colors. 0xFF is unused.
+    std::array<std::uint8_t, 4> palette;
+};
+
+struct atlas_t
+{
+    unsigned w = 0;
+    unsigned h = 0;
+    std::vector<std::uint8_t> nes; // NES color of each output pixel.
+    std::vector<atlas_cell_t> cells;
+};
+
+// Splits a sheet into cells. With a zero 'cell_w' or 'cell_h', cells are
+// found by cutting along rows and columns made entirely of 'background',
+// then trimmed to their contents. Cells holding only background are dropped.
+std::vector<atlas_rect_t> find_cells(wxImage const& sheet, rgb_t background, unsigned cell_w, unsigned cell_h);
+
+// Converts each cell of a sprite sheet on its own, with 'colors' automatic
+// colors picked per cell plus the shared background, which is the sheet's
+// top left pixel. Cells are solved in parallel on the global thread pool.
+// 'settings' gives the output size of the whole sheet and the dithering.
+atlas_t convert_atlas(settings_t const& settings, wxImage const& sheet, wxImage const& dither_image,
+                      unsigned cell_w, unsigned cell_h, unsigned colors, bool map,
+                      progress_fn_t const& progress = {});
+
+// Writes one line per cell: the output rectangle, then its palette.
+bool write_atlas_palettes(std::string const& path, atlas_t const& atlas);
+
+#endif
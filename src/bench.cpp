@@ -0,0 +1,806 @@
+// Headless benchmarks. Build and run with 'make bench'.
+//
+// Usage: pixeler-bench [--quick] [--csv PATH] [--json PATH] [--replay PATH] [SUITE...]
+//
+// Suites are 'resample', 'kernels' and 'pipeline', and all of them run by
+// default. The kernels suite times the hot parts of a conversion on their
+// own, while the pipeline suite converts a fixed set of generated images.
+// Both use generated inputs, so numbers can be compared between builds.
+// '--csv' and '--json' also write the pipeline results to files.
+// '--replay' converts each update of a session recorded with PIXELER_RECORD
+// in turn, the way the program would, and reports latency percentiles.
+// Only the suites named alongside it run.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <wx/wx.h>
+
+#include "cleanup.hpp"
+#include "diffusion.hpp"
+#include "histogram.hpp"
+#include "model.hpp"
+#include "resample.hpp"
+#include "session.hpp"
+
+namespace
+{
+
+// The fastest of 'runs' calls of 'fn', in milliseconds.
+template<typename Fn>
+double time_ms(unsigned runs, Fn const& fn)
+{
+    double best = INFINITY;
+    for(unsigned i = 0; i < runs; i += 1)
+    {
+        auto const start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+// How long repeated runs of something took, in milliseconds.
+struct stats_t
+{
+    double min;
+    double median;
+    double p99;
+};
+
+// Times 'runs' calls of 'fn', each after an untimed call of 'setup'.
+template<typename Setup, typename Fn>
+stats_t time_stats(unsigned runs, Setup const& setup, Fn const& fn)
+{
+    std::vector<double> samples(runs);
+    for(double& sample : samples)
+    {
+        setup();
+        auto const start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+        sample = elapsed.count();
+    }
+    std::sort(samples.begin(), samples.end());
+    return { samples.front(), samples[runs / 2], samples[std::min<unsigned>(runs - 1, runs * 99 / 100)] };
+}
+
+template<typename Fn>
+stats_t time_stats(unsigned runs, Fn const& fn)
+{
+    return time_stats(runs, []{}, fn);
+}
+
+// A photo-like test image: smooth gradients with some noise.
+wxImage make_source(unsigned w, unsigned h)
+{
+    wxImage image(w, h, false);
+    unsigned char* data = image.GetData();
+    unsigned noise = 1;
+    for(unsigned y = 0; y < h; y += 1)
+    for(unsigned x = 0; x < w; x += 1)
+    {
+        noise = noise * 1103515245 + 12345;
+        unsigned char* p = data + (x + y*w) * 3;
+        p[0] = (x * 255 / w + (noise >> 16) % 16) & 0xFF;
+        p[1] = (y * 255 / h + (noise >> 20) % 16) & 0xFF;
+        p[2] = ((x + y) * 127 / (w + h) + (noise >> 24) % 16) & 0xFF;
+    }
+    return image;
+}
+
+void bench_resample()
+{
+    struct case_t
+    {
+        unsigned sw, sh, dw, dh;
+        wxImageResizeQuality quality; // What update() used to pass to Rescale.
+        char const* name;
+    };
+
+    case_t const cases[] =
+    {
+        { 4000, 3000, 256, 240, wxIMAGE_QUALITY_BOX_AVERAGE, "base_bitmap" },
+        { 4000, 3000, 3840, 2880, wxIMAGE_QUALITY_NORMAL, "region source" },
+        { 1920, 1080, 256, 240, wxIMAGE_QUALITY_BOX_AVERAGE, "base_bitmap" },
+        { 1920, 1080, 1792, 960, wxIMAGE_QUALITY_NORMAL, "region source" },
+        { 512, 512, 256, 256, wxIMAGE_QUALITY_BOX_AVERAGE, "base_bitmap" },
+        { 200, 150, 256, 240, wxIMAGE_QUALITY_BOX_AVERAGE, "enlarge" },
+    };
+
+    std::printf("%-14s %-22s %12s %12s %8s\n", "use", "size", "Rescale ms", "resample ms", "speedup");
+    for(case_t const& c : cases)
+    {
+        wxImage const source = make_source(c.sw, c.sh);
+        std::vector<unsigned char> dst(std::size_t(c.dw) * c.dh * 3);
+
+        // Copy too, as update() had to:
+        double const wx_ms = time_ms(5, [&]
+        {
+            wxImage scaled = source.Copy();
+            scaled.Rescale(c.dw, c.dh, c.quality);
+        });
+
+        double const box_ms = time_ms(5, [&]
+        {
+            resample_box(source.GetData(), c.sw, c.sh, dst.data(), c.dw, c.dh);
+        });
+
+        char size[32];
+        std::snprintf(size, sizeof(size), "%ux%u -> %ux%u", c.sw, c.sh, c.dw, c.dh);
+        std::printf("%-14s %-22s %12.2f %12.2f %7.1fx\n", c.name, size, wx_ms, box_ms, wx_ms / box_ms);
+    }
+}
+
+enum image_kind_t
+{
+    IMAGE_GRADIENT,
+    IMAGE_NOISE,
+    IMAGE_PIXEL_ART,
+    IMAGE_PHOTO,
+    NUM_IMAGE_KINDS,
+};
+
+char const* const image_kind_names[NUM_IMAGE_KINDS] = { "gradient", "noise", "pixel_art", "photo" };
+
+char const* const dither_names[NUM_DITHER] =
+{
+    "none", "waves", "floyd", "horizontal", "van_gogh", "atkinson", "jjn",
+    "stucki", "sierra", "custom_diffusion", "z1", "cz2", "brix", "custom",
+};
+
+// A small deterministic generator, so every build sees the same images.
+struct rng_t
+{
+    std::uint32_t state;
+
+    std::uint32_t operator()()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+};
+
+// Smooth noise in [0, 1), interpolated from a lattice of random values
+// one unit apart.
+float value_noise(std::vector<float> const& lattice, unsigned lw, float x, float y)
+{
+    unsigned const x0 = unsigned(x);
+    unsigned const y0 = unsigned(y);
+    float const fx = x - x0;
+    float const fy = y - y0;
+    float const sx = fx * fx * (3.0f - 2.0f * fx);
+    float const sy = fy * fy * (3.0f - 2.0f * fy);
+    auto const at = [&](unsigned i, unsigned j) { return lattice[i + j * lw]; };
+    float const top = at(x0, y0) + (at(x0 + 1, y0) - at(x0, y0)) * sx;
+    float const bottom = at(x0, y0 + 1) + (at(x0 + 1, y0 + 1) - at(x0, y0 + 1)) * sx;
+    return top + (bottom - top) * sy;
+}
+
+wxImage make_image(image_kind_t kind, unsigned w, unsigned h, std::uint32_t seed)
+{
+    wxImage image(w, h, false);
+    unsigned char* data = image.GetData();
+    rng_t rng = { seed * 2654435761u + 1 };
+
+    switch(kind)
+    {
+    default:
+    case IMAGE_GRADIENT:
+        for(unsigned y = 0; y < h; y += 1)
+        for(unsigned x = 0; x < w; x += 1)
+        {
+            unsigned char* p = data + (x + y*w) * 3;
+            p[0] = x * 255 / (w - 1);
+            p[1] = y * 255 / (h - 1);
+            p[2] = 255 - (x + y) * 255 / (w + h - 2);
+        }
+        break;
+
+    case IMAGE_NOISE:
+        for(unsigned i = 0; i < w * h * 3; i += 1)
+            data[i] = rng() >> 24;
+        break;
+
+    case IMAGE_PIXEL_ART:
+        {
+            // Flat blocks of a few colors, like an upscaled sprite:
+            rgb_t palette[6];
+            for(rgb_t& color : palette)
+                color = { std::uint8_t(rng() >> 24), std::uint8_t(rng() >> 24), std::uint8_t(rng() >> 24) };
+            unsigned const block = std::max(1u, w / 64);
+            unsigned const bw = (w + block - 1) / block;
+            unsigned const bh = (h + block - 1) / block;
+            std::vector<std::uint8_t> blocks(bw * bh);
+            for(std::uint8_t& b : blocks)
+                b = rng() % 6;
+            for(unsigned y = 0; y < h; y += 1)
+            for(unsigned x = 0; x < w; x += 1)
+            {
+                rgb_t const color = palette[blocks[x / block + (y / block) * bw]];
+                unsigned char* p = data + (x + y*w) * 3;
+                p[0] = color.r;
+                p[1] = color.g;
+                p[2] = color.b;
+            }
+        }
+        break;
+
+    case IMAGE_PHOTO:
+        {
+            // A few octaves of value noise per channel, plus some grain:
+            constexpr unsigned OCTAVES = 4;
+            constexpr unsigned BASE_CELL = 128;
+            std::vector<float> lattices[3][OCTAVES];
+            unsigned lws[OCTAVES];
+            for(unsigned o = 0; o < OCTAVES; o += 1)
+            {
+                unsigned const cell = BASE_CELL >> o;
+                lws[o] = w / cell + 2;
+                unsigned const lh = h / cell + 2;
+                for(unsigned c = 0; c < 3; c += 1)
+                {
+                    lattices[c][o].resize(lws[o] * lh);
+                    for(float& v : lattices[c][o])
+                        v = (rng() >> 8) / float(1 << 24);
+                }
+            }
+
+            for(unsigned y = 0; y < h; y += 1)
+            for(unsigned x = 0; x < w; x += 1)
+            {
+                unsigned char* p = data + (x + y*w) * 3;
+                for(unsigned c = 0; c < 3; c += 1)
+                {
+                    float v = 0.0f;
+                    float amplitude = 0.5f;
+                    for(unsigned o = 0; o < OCTAVES; o += 1)
+                    {
+                        float const cell = BASE_CELL >> o;
+                        v += amplitude * value_noise(lattices[c][o], lws[o], x / cell, y / cell);
+                        amplitude *= 0.5f;
+                    }
+                    v += ((rng() >> 24) - 128.0f) / 2048.0f;
+                    p[c] = std::clamp<int>(v * 255.0f / 0.9375f, 0, 255);
+                }
+            }
+        }
+        break;
+    }
+
+    return image;
+}
+
+// An 8x8 Bayer matrix, standing in for a user's DITHER_CUSTOM image.
+wxImage make_bayer()
+{
+    wxImage image(8, 8, false);
+    unsigned char* data = image.GetData();
+    for(unsigned y = 0; y < 8; y += 1)
+    for(unsigned x = 0; x < 8; x += 1)
+    {
+        unsigned const xy = x ^ y;
+        unsigned const v = ((xy & 1) << 5) | ((y & 1) << 4) | ((xy & 2) << 2) | ((y & 2) << 1) | ((xy & 4) >> 1) | ((y & 4) >> 2);
+        std::memset(data + (x + y*8) * 3, v * 4 + 2, 3);
+    }
+    return image;
+}
+
+// Keeps the optimizer from dropping work whose result goes unused.
+volatile unsigned sink;
+
+void print_kernel(char const* name, char const* input, stats_t const& stats, double items, char const* unit)
+{
+    std::printf("%-22s %-26s %10.3f %10.3f %10.3f %10.1f %s/s\n", name, input,
+                stats.min, stats.median, stats.p99, items / 1e6 / (stats.median / 1000.0), unit);
+}
+
+void bench_kernels(bool quick)
+{
+    unsigned const runs = quick ? 10 : 100;
+    constexpr unsigned W = 256;
+    constexpr unsigned H = 240;
+
+    std::printf("%-22s %-26s %10s %10s %10s %12s\n", "kernel", "input", "min ms", "median ms", "p99 ms", "median rate");
+
+    wxImage const photo = make_image(IMAGE_PHOTO, W, H, 1);
+    color_histogram_t const histogram = make_histogram(photo.GetData(), W * H);
+    rgb_t const* const photo_rgb = reinterpret_cast<rgb_t const*>(photo.GetData());
+
+    // Nearest-candidate search, over every pixel of the photo:
+    for(unsigned knobs : { 4, 16 })
+    for(unsigned maps : { 1, 4 })
+    for(bool dithered : { false, true })
+    {
+        settings_t settings;
+        settings.auto_color(histogram, knobs, true);
+        rng_t rng = { knobs * 31 + maps };
+        for(color_knob_t& knob : settings.color_knobs)
+        {
+            for(unsigned i = 1; i < maps; i += 1)
+            {
+                rgb_t c = knob.map_colors[0];
+                c.r += rng() % 32;
+                c.g += rng() % 32;
+                c.b += rng() % 32;
+                knob.map_colors[i] = c;
+                knob.map_enable[i] = true;
+            }
+        }
+        knob_set_t const set(settings.color_knobs);
+
+        stats_t const stats = time_stats(runs, [&]
+        {
+            unsigned total = 0;
+            for(unsigned i = 0; i < W * H; i += 1)
+            {
+                dither_offset_t const offset = { float(int(i % 7) - 3), float(int(i % 5) - 2), float(int(i % 3) - 1) };
+                if(dithered)
+                    total += set.nearest<true>(0xFFFF, photo_rgb[i], offset).knob;
+                else
+                    total += set.nearest<false>(0xFFFF, photo_rgb[i], offset).knob;
+            }
+            sink = total;
+        });
+
+        char input[64];
+        std::snprintf(input, sizeof(input), "%u knobs x %u colors%s", knobs, maps, dithered ? ", offset" : "");
+        print_kernel("nearest", input, stats, W * H, "Mpx");
+    }
+
+    // Mask sampling, at the stretch of a few cutoffs:
+    std::array<wxImage, NUM_MASK_DITHERS> const dither_images = builtin_dither_images();
+    for(int cutoff : { 0, 4, 12 })
+    {
+        wxImage const& image = dither_images[DITHER_Z1 - FIRST_MASK];
+        dither_mask_t const mask = { image.GetData(), unsigned(image.GetWidth()), unsigned(image.GetHeight()),
+                                     (cutoff + 8) / 8.0f };
+
+        stats_t const stats = time_stats(runs, [&]
+        {
+            unsigned total = 0;
+            for(unsigned y = 0; y < H; y += 1)
+            for(unsigned x = 0; x < W; x += 1)
+                total += mask.lerp(x, y).r;
+            sink = total;
+        });
+
+        char input[64];
+        std::snprintf(input, sizeof(input), "z1, cutoff %d", cutoff);
+        print_kernel("dither_lerp", input, stats, W * H, "Mpx");
+    }
+
+    // Each diffusion kernel, spreading a fixed error from every pixel:
+    {
+        std::vector<qerr_t> qerrs(W * H);
+        qerr_t const q = { 12, -7, 3 };
+
+        auto const bench_diffuse = [&](char const* name, auto const& fn)
+        {
+            stats_t const stats = time_stats(runs, [&]{ std::fill(qerrs.begin(), qerrs.end(), qerr_t{}); }, [&]
+            {
+                for(unsigned y = 0; y < H; y += 1)
+                for(unsigned x = 0; x < W; x += 1)
+                    fn(x, y);
+            });
+            sink = qerrs[W * H / 2].r;
+            print_kernel("diffuse", name, stats, W * H, "Mpx");
+        };
+
+#define BENCH_KERNEL(k) bench_diffuse(#k, [&](int x, int y) { diffuse<k>(qerrs.data(), W, H, x, y, false, q); })
+        BENCH_KERNEL(WAVES_KERNEL);
+        BENCH_KERNEL(FLOYD_KERNEL);
+        BENCH_KERNEL(HORIZONTAL_KERNEL);
+        BENCH_KERNEL(VAN_GOGH_KERNEL);
+        BENCH_KERNEL(ATKINSON_KERNEL);
+        BENCH_KERNEL(JJN_KERNEL);
+        BENCH_KERNEL(STUCKI_KERNEL);
+        BENCH_KERNEL(SIERRA_KERNEL);
+#undef BENCH_KERNEL
+
+        custom_diffusion_t jjn;
+        for(diffusion_tap_t const& tap : JJN_KERNEL.taps)
+            jjn.taps.push_back(tap);
+        custom_diffuser_t const custom_diffuser(jjn, W, H);
+        bench_diffuse("custom (JJN taps)", [&](int x, int y) { custom_diffuser(qerrs.data(), x, y, false, q); });
+    }
+
+    // Cleanup passes, over the same dithered and undithered outputs:
+    for(dither_style_t style : { DITHER_NONE, DITHER_FLOYD })
+    {
+        settings_t settings;
+        settings.w = W;
+        settings.h = H;
+        settings.dither_style = style;
+        settings.auto_color(histogram, 8, false);
+
+        std::vector<std::uint8_t> quantized;
+        std::vector<std::uint8_t> attributes;
+        settings.convert(photo, dither_images[0], quantized, attributes);
+
+        std::vector<std::uint8_t> nes;
+        auto const bench_pass = [&](char const* name, void(*pass)(std::vector<std::uint8_t>&, int, int))
+        {
+            stats_t const stats = time_stats(runs, [&]{ nes = quantized; }, [&]{ pass(nes, W, H); });
+            print_kernel(name, style == DITHER_NONE ? "photo, no dither" : "photo, floyd", stats, W * H, "Mpx");
+        };
+
+        bench_pass("cull_zags", cull_zags);
+        bench_pass("cull_dots", cull_dots);
+        bench_pass("cull_pipes", cull_pipes);
+        bench_pass("clean_lines", clean_lines);
+    }
+
+    // Median cut, on histograms of few and many colors:
+    for(image_kind_t kind : { IMAGE_PIXEL_ART, IMAGE_PHOTO, IMAGE_NOISE })
+    {
+        wxImage const source = make_image(kind, W, H, 1);
+        color_histogram_t const source_histogram = make_histogram(source.GetData(), W * H);
+
+        for(unsigned count : { 4, 16 })
+        {
+            char input[64];
+            std::snprintf(input, sizeof(input), "%s, %zu colors, %u", image_kind_names[kind], source_histogram.size(), count);
+
+            stats_t const cut = time_stats(runs, [&]{ sink = median_cut(source_histogram, count).size(); });
+            print_kernel("median_cut", input, cut, source_histogram.size(), "Mcolor");
+
+            settings_t settings;
+            stats_t const auto_color = time_stats(runs, [&]{ settings.auto_color(source_histogram, count, false); });
+            print_kernel("auto_color", input, auto_color, source_histogram.size(), "Mcolor");
+        }
+    }
+}
+
+struct pipeline_case_t
+{
+    image_kind_t image;
+    unsigned sw, sh, dw, dh;
+    dither_style_t style;
+    unsigned knobs;
+    char const* passes;
+};
+
+struct pipeline_result_t
+{
+    pipeline_case_t c;
+    double total_ms; // Of the whole convert() call, not just the timed stages.
+    double mps; // Source megapixels per second.
+    stage_times_t times;
+};
+
+struct pass_set_t
+{
+    char const* name;
+    bool cull_dots, cull_pipes, cull_zags, clean_lines;
+};
+
+pass_set_t const pass_sets[] =
+{
+    { "none",  false, false, false, false },
+    { "dots",  true,  false, false, false },
+    { "pipes", false, true,  false, false },
+    { "zags",  false, false, true,  false },
+    { "lines", false, false, false, true  },
+    { "all",   true,  true,  true,  true  },
+};
+
+std::vector<pipeline_result_t> bench_pipeline(bool quick)
+{
+    struct size_case_t { unsigned sw, sh, dw, dh; };
+    size_case_t const sizes[] =
+    {
+        { 256, 240, 256, 240 },
+        { 1024, 960, 256, 240 },
+        { 1920, 1080, 512, 288 },
+    };
+    unsigned const num_sizes = quick ? 1 : std::size(sizes);
+    unsigned const runs = quick ? 1 : 3;
+
+    std::array<wxImage, NUM_MASK_DITHERS> dither_images = builtin_dither_images();
+    dither_images[DITHER_CUSTOM - FIRST_MASK] = make_bayer();
+
+    custom_diffusion_t floyd;
+    floyd.taps = {{ { 1, 0, 7.0f / 16.0f }, { -1, 1, 3.0f / 16.0f }, { 0, 1, 5.0f / 16.0f }, { 1, 1, 1.0f / 16.0f } }};
+
+    // Every style, then knob counts and cleanup passes on a few of them:
+    std::vector<pipeline_case_t> cases;
+    auto const add = [&](pipeline_case_t const& c)
+    {
+        for(pipeline_case_t const& o : cases)
+            if(o.image == c.image && o.sw == c.sw && o.sh == c.sh && o.style == c.style
+               && o.knobs == c.knobs && std::strcmp(o.passes, c.passes) == 0)
+                return;
+        cases.push_back(c);
+    };
+
+    for(unsigned s = 0; s < num_sizes; s += 1)
+    for(unsigned k = 0; k < NUM_IMAGE_KINDS; k += 1)
+    {
+        pipeline_case_t c = { image_kind_t(k), sizes[s].sw, sizes[s].sh, sizes[s].dw, sizes[s].dh, DITHER_NONE, 8, "none" };
+        for(unsigned style = 0; style < NUM_DITHER; style += 1)
+        {
+            c.style = dither_style_t(style);
+            add(c);
+        }
+        for(dither_style_t style : { DITHER_NONE, DITHER_FLOYD, DITHER_Z1 })
+        for(unsigned knobs : { 2, 4, 8, 12, 16 })
+        {
+            c.style = style;
+            c.knobs = knobs;
+            add(c);
+        }
+        c.knobs = 8;
+        for(dither_style_t style : { DITHER_NONE, DITHER_FLOYD })
+        for(pass_set_t const& passes : pass_sets)
+        {
+            c.style = style;
+            c.passes = passes.name;
+            add(c);
+        }
+    }
+
+    std::printf("%-10s %-20s %-16s %5s %-6s %10s %8s", "image", "size", "dither", "knobs", "passes", "total ms", "MP/s");
+    for(unsigned i = 0; i < NUM_CONVERT_STAGES; i += 1)
+        std::printf(" %11s", stage_names[i]);
+    std::printf("\n");
+
+    std::vector<pipeline_result_t> results;
+    wxImage source;
+    pipeline_case_t prev = {};
+    color_histogram_t histogram;
+    for(pipeline_case_t const& c : cases)
+    {
+        if(!source.IsOk() || prev.image != c.image || prev.sw != c.sw || prev.sh != c.sh)
+        {
+            source = make_image(c.image, c.sw, c.sh, c.image + 1);
+            histogram = make_histogram(source.GetData(), std::size_t(c.sw) * c.sh);
+        }
+        prev = c;
+
+        settings_t settings;
+        settings.w = c.dw;
+        settings.h = c.dh;
+        settings.dither_style = c.style;
+        settings.custom_diffusion = floyd;
+        settings.auto_color(histogram, c.knobs, false);
+        for(pass_set_t const& passes : pass_sets)
+        {
+            if(std::strcmp(passes.name, c.passes) != 0)
+                continue;
+            settings.cull_dots = passes.cull_dots;
+            settings.cull_pipes = passes.cull_pipes;
+            settings.cull_zags = passes.cull_zags;
+            settings.clean_lines = passes.clean_lines;
+        }
+
+        wxImage const& dither_image = c.style >= FIRST_MASK ? dither_images[c.style - FIRST_MASK] : dither_images[0];
+        std::vector<std::uint8_t> dst_nes;
+        std::vector<std::uint8_t> attributes;
+
+        // Keep the fastest run:
+        pipeline_result_t result = { c, INFINITY };
+        for(unsigned run = 0; run < runs; run += 1)
+        {
+            stage_times_t times;
+            auto const start = std::chrono::steady_clock::now();
+            settings.convert(source, dither_image, dst_nes, attributes, nullptr, &times);
+            std::chrono::duration<double, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+            if(elapsed.count() < result.total_ms)
+            {
+                result.total_ms = elapsed.count();
+                result.times = times;
+            }
+        }
+        result.mps = (double(c.sw) * c.sh / 1e6) / (result.total_ms / 1000.0);
+        results.push_back(result);
+
+        char size[32];
+        std::snprintf(size, sizeof(size), "%ux%u -> %ux%u", c.sw, c.sh, c.dw, c.dh);
+        std::printf("%-10s %-20s %-16s %5u %-6s %10.2f %8.1f", image_kind_names[c.image], size,
+                    dither_names[c.style], c.knobs, c.passes, result.total_ms, result.mps);
+        for(unsigned i = 0; i < NUM_CONVERT_STAGES; i += 1)
+            std::printf(" %11.2f", result.times.ms[i]);
+        std::printf("\n");
+    }
+
+    return results;
+}
+
+bool write_csv(char const* path, std::vector<pipeline_result_t> const& results)
+{
+    FILE* fp = std::fopen(path, "w");
+    if(!fp)
+    {
+        std::fprintf(stderr, "Unable to write %s\n", path);
+        return false;
+    }
+
+    std::fprintf(fp, "image,src_w,src_h,dst_w,dst_h,dither,knobs,passes,total_ms,mps");
+    for(unsigned i = 0; i < NUM_CONVERT_STAGES; i += 1)
+        std::fprintf(fp, ",%s_ms", stage_names[i]);
+    std::fprintf(fp, "\n");
+
+    for(pipeline_result_t const& r : results)
+    {
+        std::fprintf(fp, "%s,%u,%u,%u,%u,%s,%u,%s,%.4f,%.4f", image_kind_names[r.c.image],
+                     r.c.sw, r.c.sh, r.c.dw, r.c.dh, dither_names[r.c.style], r.c.knobs, r.c.passes,
+                     r.total_ms, r.mps);
+        for(unsigned i = 0; i < NUM_CONVERT_STAGES; i += 1)
+            std::fprintf(fp, ",%.4f", r.times.ms[i]);
+        std::fprintf(fp, "\n");
+    }
+
+    std::fclose(fp);
+    return true;
+}
+
+bool write_json(char const* path, std::vector<pipeline_result_t> const& results)
+{
+    FILE* fp = std::fopen(path, "w");
+    if(!fp)
+    {
+        std::fprintf(stderr, "Unable to write %s\n", path);
+        return false;
+    }
+
+#ifdef GIT_COMMIT
+    std::fprintf(fp, "{\n  \"commit\": \"%s\",\n  \"results\": [\n", GIT_COMMIT);
+#else
+    std::fprintf(fp, "{\n  \"results\": [\n");
+#endif
+    for(std::size_t i = 0; i < results.size(); i += 1)
+    {
+        pipeline_result_t const& r = results[i];
+        std::fprintf(fp, "    { \"image\": \"%s\", \"src_w\": %u, \"src_h\": %u, \"dst_w\": %u, \"dst_h\": %u, "
+                     "\"dither\": \"%s\", \"knobs\": %u, \"passes\": \"%s\", \"total_ms\": %.4f, \"mps\": %.4f, \"stages_ms\": {",
+                     image_kind_names[r.c.image], r.c.sw, r.c.sh, r.c.dw, r.c.dh,
+                     dither_names[r.c.style], r.c.knobs, r.c.passes, r.total_ms, r.mps);
+        for(unsigned s = 0; s < NUM_CONVERT_STAGES; s += 1)
+            std::fprintf(fp, "%s\"%s\": %.4f", s ? ", " : " ", stage_names[s], r.times.ms[s]);
+        std::fprintf(fp, " } }%s\n", i + 1 < results.size() ? "," : "");
+    }
+    std::fprintf(fp, "  ]\n}\n");
+
+    std::fclose(fp);
+    return true;
+}
+
+// The value 'p' of the way through sorted 'samples', with 'p' from 0 to 1.
+double percentile(std::vector<double> const& samples, double p)
+{
+    if(samples.empty())
+        return 0.0;
+    return samples[std::min<std::size_t>(samples.size() - 1, p * samples.size())];
+}
+
+void print_latencies(char const* name, std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    double total = 0.0;
+    for(double sample : samples)
+        total += sample;
+    std::printf("%-10s %10.2f %10.2f %10.2f %10.2f %10.2f\n", name, total / std::max<std::size_t>(samples.size(), 1),
+                percentile(samples, 0.50), percentile(samples, 0.95), percentile(samples, 0.99),
+                samples.empty() ? 0.0 : samples.back());
+}
+
+bool bench_replay(char const* path)
+{
+    std::vector<session_event_t> events;
+    std::string error;
+    if(!load_session(path, events, error))
+    {
+        std::fprintf(stderr, "%s\n", error.c_str());
+        return false;
+    }
+
+    std::array<wxImage, NUM_MASK_DITHERS> const dither_images = builtin_dither_images();
+
+    // One cache throughout, as the program keeps, so that edits which only
+    // redo some stages are as fast as they were:
+    convert_cache_t cache;
+    std::vector<std::uint8_t> dst_nes;
+    std::vector<std::uint8_t> attributes;
+
+    std::vector<double> replayed;
+    std::vector<double> recorded;
+    for(session_event_t const& event : events)
+    {
+        if(!event.source.IsOk())
+            continue;
+
+        settings_t const& settings = event.settings;
+        wxImage const& dither_image = settings.dither_style == DITHER_CUSTOM && event.custom_dither.IsOk()
+            ? event.custom_dither
+            : dither_images[std::max(settings.dither_style, FIRST_MASK) - FIRST_MASK];
+
+        auto const start = std::chrono::steady_clock::now();
+        settings.convert(event.source, dither_image, dst_nes, attributes, &cache);
+        std::chrono::duration<double, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+        replayed.push_back(elapsed.count());
+        recorded.push_back(event.recorded_ms);
+    }
+
+    std::printf("%s: %zu updates over %.1f s\n", path, replayed.size(),
+                events.empty() ? 0.0 : events.back().time_ms / 1000.0);
+    std::printf("%-10s %10s %10s %10s %10s %10s\n", "latency", "mean ms", "p50 ms", "p95 ms", "p99 ms", "max ms");
+    print_latencies("replayed", replayed);
+    print_latencies("recorded", recorded);
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    bool quick = false;
+    char const* csv_path = nullptr;
+    char const* json_path = nullptr;
+    char const* replay_path = nullptr;
+    std::vector<std::string> suites;
+
+    for(int i = 1; i < argc; i += 1)
+    {
+        if(std::strcmp(argv[i], "--quick") == 0)
+            quick = true;
+        else if(std::strcmp(argv[i], "--csv") == 0 && i + 1 < argc)
+            csv_path = argv[++i];
+        else if(std::strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            json_path = argv[++i];
+        else if(std::strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+            replay_path = argv[++i];
+        else if(argv[i][0] != '-')
+            suites.push_back(argv[i]);
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--quick] [--csv PATH] [--json PATH] [--replay PATH] [resample] [kernels] [pipeline]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    auto const run = [&](char const* suite)
+    {
+        return (suites.empty() && !replay_path) || std::find(suites.begin(), suites.end(), suite) != suites.end();
+    };
+
+    wxInitAllImageHandlers();
+
+    if(replay_path)
+    {
+        if(!bench_replay(replay_path))
+            return 1;
+        std::printf("\n");
+    }
+
+    if(run("resample"))
+    {
+        bench_resample();
+        std::printf("\n");
+    }
+
+    if(run("kernels"))
+    {
+        bench_kernels(quick);
+        std::printf("\n");
+    }
+
+    if(run("pipeline"))
+    {
+        std::vector<pipeline_result_t> const results = bench_pipeline(quick);
+        if(csv_path && !write_csv(csv_path, results))
+            return 1;
+        if(json_path && !write_json(json_path, results))
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,522 @@
+#include "chr.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <queue>
+#include <unordered_map>
+
+#include "nes_colors.hpp"
+
+namespace
+{
+
+struct chr_hash_t
+{
+    std::size_t operator()(chr_tile_t const& tile) const
+    {
+        std::uint64_t a, b;
+        std::memcpy(&a, tile.data(), 8);
+        std::memcpy(&b, tile.data() + 8, 8);
+        std::uint64_t h = a * 0x9E3779B97F4A7C15ull;
+        h ^= (h >> 32) ^ b;
+        h *= 0xBF58476D1CE4E5B9ull;
+        return h ^ (h >> 29);
+    }
+};
+
+std::uint8_t reverse_bits(std::uint8_t b)
+{
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+    return b;
+}
+
+chr_tile_t flip_h(chr_tile_t tile)
+{
+    for(std::uint8_t& row : tile)
+        row = reverse_bits(row);
+    return tile;
+}
+
+chr_tile_t flip_v(chr_tile_t tile)
+{
+    std::reverse(tile.begin() + 0, tile.begin() + 8);
+    std::reverse(tile.begin() + 8, tile.begin() + 16);
+    return tile;
+}
+
+unsigned blocks_w(unsigned w) { return (w + 15) / 16; }
+unsigned blocks_h(unsigned h) { return (h + 15) / 16; }
+
+// Maps each NES color to its 2-bit value in a sub-palette,
+// using the closest entry when the color is missing.
+struct value_map_t
+{
+    value_map_t(std::array<std::uint8_t, 4> const& pal)
+    {
+        for(unsigned c = 0; c < 64; c += 1)
+        {
+            float best_dist = INFINITY;
+            for(unsigned i = 0; i < pal.size(); i += 1)
+            {
+                if(pal[i] == c)
+                {
+                    value[c] = i;
+                    exact[c] = true;
+                    break;
+                }
+
+                if(pal[i] >= 64)
+                    continue;
+
+                float const dist = distance(nes_colors[c], nes_colors[pal[i]]);
+                if(dist < best_dist)
+                {
+                    best_dist = dist;
+                    value[c] = i;
+                }
+            }
+        }
+    }
+
+    std::array<std::uint8_t, 64> value = {};
+    std::array<bool, 64> exact = {};
+};
+
+// Packs the tile at tile coordinates (tx, ty).
+// Pixels past the image edge use the background.
+chr_tile_t pack_tile(std::uint8_t const* nes, unsigned w, unsigned h, unsigned tx, unsigned ty,
+                     value_map_t const& map, unsigned* mismatched = nullptr)
+{
+    chr_tile_t tile = {};
+    for(unsigned y = 0; y < 8; y += 1)
+    for(unsigned x = 0; x < 8; x += 1)
+    {
+        unsigned const px = tx * 8 + x;
+        unsigned const py = ty * 8 + y;
+        if(px >= w || py >= h)
+            continue;
+
+        std::uint8_t const color = nes[px + py*w] & 63;
+        std::uint8_t const value = map.value[color];
+        if(mismatched)
+            *mismatched += !map.exact[color];
+        tile[y + 0] |= (value & 1) << (7 - x);
+        tile[y + 8] |= (value >> 1) << (7 - x);
+    }
+    return tile;
+}
+
+// Writes a tile back as NES colors, using the sub-palette 'pal'.
+void unpack_tile(std::uint8_t* nes, unsigned w, unsigned h, unsigned tx, unsigned ty,
+                 chr_tile_t const& tile, std::array<std::uint8_t, 4> const& pal)
+{
+    for(unsigned y = 0; y < 8; y += 1)
+    for(unsigned x = 0; x < 8; x += 1)
+    {
+        unsigned const px = tx * 8 + x;
+        unsigned const py = ty * 8 + y;
+        if(px >= w || py >= h)
+            continue;
+
+        unsigned const value = ((tile[y + 0] >> (7 - x)) & 1) | (((tile[y + 8] >> (7 - x)) & 1) << 1);
+        nes[px + py*w] = pal[value] < 64 ? pal[value] : pal[0];
+    }
+}
+
+} // namespace
+
+std::vector<std::uint8_t> pick_attributes(std::uint8_t const* nes, unsigned w, unsigned h,
+                                          subpalettes_t const& subpalettes)
+{
+    unsigned const bw = blocks_w(w);
+    unsigned const bh = blocks_h(h);
+    std::vector<std::uint8_t> result(bw * bh);
+
+    std::array<std::array<bool, 64>, NUM_SUBPALETTES> has = {};
+    for(unsigned p = 0; p < subpalettes.size(); p += 1)
+        for(std::uint8_t color : subpalettes[p])
+            if(color < 64)
+                has[p][color] = true;
+
+    for(unsigned by = 0; by < bh; by += 1)
+    for(unsigned bx = 0; bx < bw; bx += 1)
+    {
+        std::array<unsigned, 64> counts = {};
+        for(unsigned y = by * 16; y < std::min(by * 16 + 16, h); y += 1)
+        for(unsigned x = bx * 16; x < std::min(bx * 16 + 16, w); x += 1)
+            counts[nes[x + y*w] & 63] += 1;
+
+        unsigned best = 0;
+        unsigned best_covered = 0;
+        for(unsigned p = 0; p < subpalettes.size(); p += 1)
+        {
+            unsigned covered = 0;
+            for(unsigned c = 0; c < 64; c += 1)
+                if(has[p][c])
+                    covered += counts[c];
+
+            if(covered > best_covered)
+            {
+                best_covered = covered;
+                best = p;
+            }
+        }
+
+        result[bx + by * bw] = best;
+    }
+
+    return result;
+}
+
+void enforce_attributes(std::uint8_t* nes, unsigned w, unsigned h,
+                        subpalettes_t const& subpalettes, std::uint8_t const* attributes)
+{
+    std::array<std::unique_ptr<value_map_t>, NUM_SUBPALETTES> maps;
+    for(unsigned p = 0; p < maps.size(); p += 1)
+        maps[p] = std::make_unique<value_map_t>(subpalettes[p]);
+
+    for(unsigned y = 0; y < h; y += 1)
+    for(unsigned x = 0; x < w; x += 1)
+    {
+        unsigned const p = attributes[x / 16 + (y / 16) * blocks_w(w)];
+        std::uint8_t& color = nes[x + y*w];
+        color = subpalettes[p][maps[p]->value[color & 63]];
+    }
+}
+
+chr_export_t export_chr(std::uint8_t const* nes, unsigned w, unsigned h,
+                        subpalettes_t const& subpalettes, std::uint8_t const* attributes,
+                        bool flip)
+{
+    chr_export_t chr;
+    chr.tiles_w = (w + 7) / 8;
+    chr.tiles_h = (h + 7) / 8;
+    chr.nametable.resize(chr.tiles_w * chr.tiles_h);
+    chr.flips.resize(chr.tiles_w * chr.tiles_h);
+
+    std::vector<std::uint8_t> const blocks = attributes
+        ? std::vector<std::uint8_t>(attributes, attributes + blocks_w(w) * blocks_h(h))
+        : pick_attributes(nes, w, h, subpalettes);
+    std::array<std::unique_ptr<value_map_t>, NUM_SUBPALETTES> maps;
+    for(unsigned p = 0; p < maps.size(); p += 1)
+        maps[p] = std::make_unique<value_map_t>(subpalettes[p]);
+
+    std::unordered_map<chr_tile_t, std::uint16_t, chr_hash_t> index;
+    index.reserve(chr.nametable.size());
+
+    for(unsigned ty = 0; ty < chr.tiles_h; ty += 1)
+    for(unsigned tx = 0; tx < chr.tiles_w; tx += 1)
+    {
+        value_map_t const& map = *maps[blocks[tx / 2 + (ty / 2) * blocks_w(w)]];
+
+        chr_tile_t const tile = pack_tile(nes, w, h, tx, ty, map, &chr.mismatched);
+
+        unsigned const i = tx + ty * chr.tiles_w;
+
+        if(flip)
+        {
+            std::array<chr_tile_t, 3> const variants = {{ flip_h(tile), flip_v(tile), flip_h(flip_v(tile)) }};
+            std::array<std::uint8_t, 3> const bits = {{ CHR_FLIP_H, CHR_FLIP_V, CHR_FLIP_H | CHR_FLIP_V }};
+
+            if(!index.count(tile))
+            {
+                for(unsigned v = 0; v < variants.size(); v += 1)
+                {
+                    auto it = index.find(variants[v]);
+                    if(it != index.end())
+                    {
+                        chr.nametable[i] = it->second;
+                        chr.flips[i] = bits[v];
+                        goto next_tile;
+                    }
+                }
+            }
+        }
+
+        {
+            auto [it, inserted] = index.try_emplace(tile, chr.tiles.size());
+            if(inserted)
+                chr.tiles.push_back(tile);
+            chr.nametable[i] = it->second;
+        }
+
+    next_tile:;
+    }
+
+    // Pack four 16x16 areas into each attribute byte:
+    unsigned const aw = (w + 31) / 32;
+    unsigned const ah = (h + 31) / 32;
+    chr.attributes.resize(aw * ah);
+    for(unsigned ay = 0; ay < ah; ay += 1)
+    for(unsigned ax = 0; ax < aw; ax += 1)
+    {
+        std::uint8_t byte = 0;
+        for(unsigned q = 0; q < 4; q += 1)
+        {
+            unsigned const bx = ax * 2 + (q & 1);
+            unsigned const by = ay * 2 + (q >> 1);
+            if(bx < blocks_w(w) && by < blocks_h(h))
+                byte |= blocks[bx + by * blocks_w(w)] << (q * 2);
+        }
+        chr.attributes[ax + ay * aw] = byte;
+    }
+
+    return chr;
+}
+
+namespace
+{
+
+// reduce_tiles() with the sub-palette of each 16x16 area in 'blocks'.
+unsigned merge_tiles(std::uint8_t* nes, unsigned w, unsigned h,
+                     subpalettes_t const& subpalettes, std::uint8_t const* blocks,
+                     unsigned budget)
+{
+    unsigned const tiles_w = (w + 7) / 8;
+    unsigned const tiles_h = (h + 7) / 8;
+
+    std::array<std::unique_ptr<value_map_t>, NUM_SUBPALETTES> maps;
+    for(unsigned p = 0; p < maps.size(); p += 1)
+        maps[p] = std::make_unique<value_map_t>(subpalettes[p]);
+
+    // Each unique tile, with its planes as 64-bit words for fast Hamming distances:
+    struct node_t
+    {
+        chr_tile_t tile;
+        std::uint64_t lo;
+        std::uint64_t hi;
+        unsigned pop;
+        unsigned count;
+        std::uint8_t used;            // Bit v is set if a pixel has value v.
+        std::uint8_t valid = 0xF;     // Values that pack back to themselves wherever the tile is used.
+        std::uint64_t inside = ~0ull; // Pixels within the image wherever the tile is used.
+        unsigned version = 0;
+        bool alive = true;
+    };
+
+    // Which values of each sub-palette pack back to themselves, having a
+    // color that no earlier entry repeats:
+    std::array<std::uint8_t, NUM_SUBPALETTES> valid_values = {};
+    for(unsigned p = 0; p < subpalettes.size(); p += 1)
+        for(unsigned v = 0; v < 4; v += 1)
+            if(subpalettes[p][v] < 64 && maps[p]->value[subpalettes[p][v]] == v)
+                valid_values[p] |= 1 << v;
+
+    std::vector<node_t> nodes;
+    std::vector<unsigned> node_of(tiles_w * tiles_h);
+    std::unordered_map<chr_tile_t, unsigned, chr_hash_t> index;
+
+    for(unsigned ty = 0; ty < tiles_h; ty += 1)
+    for(unsigned tx = 0; tx < tiles_w; tx += 1)
+    {
+        unsigned const p = blocks[tx / 2 + (ty / 2) * blocks_w(w)];
+        chr_tile_t const tile = pack_tile(nes, w, h, tx, ty, *maps[p]);
+
+        // Tiles on the right and bottom edges may be cut off, in the same
+        // layout as a plane:
+        std::array<std::uint8_t, 8> inside_rows = {};
+        for(unsigned y = 0; y < 8 && ty * 8 + y < h; y += 1)
+            inside_rows[y] = 0xFF00 >> std::min(w - tx * 8, 8u);
+        std::uint64_t inside;
+        std::memcpy(&inside, inside_rows.data(), 8);
+
+        auto [it, inserted] = index.try_emplace(tile, nodes.size());
+        if(inserted)
+        {
+            node_t& node = nodes.emplace_back();
+            node.tile = tile;
+            std::memcpy(&node.lo, tile.data() + 0, 8);
+            std::memcpy(&node.hi, tile.data() + 8, 8);
+            node.pop = std::popcount(node.lo) + std::popcount(node.hi);
+            node.count = 0;
+            node.used = bool(~node.lo & ~node.hi) << 0 | bool(node.lo & ~node.hi) << 1
+                      | bool(~node.lo & node.hi) << 2 | bool(node.lo & node.hi) << 3;
+        }
+        nodes[it->second].count += 1;
+        nodes[it->second].valid &= valid_values[p];
+        nodes[it->second].inside &= inside;
+        node_of[tx + ty * tiles_w] = it->second;
+    }
+
+    unsigned alive = nodes.size();
+    if(alive <= budget)
+        return alive;
+
+    // Since dist(a, b) >= |pop(a) - pop(b)|, bucketing by popcount lets the
+    // nearest tile search stop early instead of comparing against every tile.
+    std::array<std::vector<unsigned>, 129> buckets;
+    for(unsigned i = 0; i < nodes.size(); i += 1)
+        buckets[nodes[i].pop].push_back(i);
+
+    auto const dist = [&](node_t const& a, node_t const& b) -> unsigned
+    {
+        return std::popcount(a.lo ^ b.lo) + std::popcount(a.hi ^ b.hi);
+    };
+
+    // Merging writes 'to' over every place 'from' is used. It must pack back
+    // to 'to' there, so it can't need a color missing from the sub-palette,
+    // nor have pixels past the image edge, which pack as 0:
+    auto const can_merge = [&](node_t const& from, node_t const& to) -> bool
+    {
+        return (to.used & ~from.valid) == 0 && ((to.lo | to.hi) & ~from.inside) == 0;
+    };
+
+    struct merge_t
+    {
+        std::uint64_t cost;
+        unsigned from;
+        unsigned to;
+        unsigned from_version;
+        unsigned to_version;
+
+        // Cheapest first, then the lowest 'from', so ties don't depend on queue order:
+        bool operator<(merge_t const& o) const { return cost != o.cost ? cost > o.cost : from > o.from; }
+    };
+
+    std::priority_queue<merge_t> queue;
+
+    // Finds the nearest tile 'from' can merge into, the lowest index among
+    // equally near ones:
+    auto const push_nearest = [&](unsigned from)
+    {
+        node_t const& a = nodes[from];
+        unsigned best = ~0u;
+        unsigned best_dist = ~0u;
+
+        for(unsigned d = 0; d <= best_dist && d <= 128; d += 1)
+        {
+            for(int sign : { -1, 1 })
+            {
+                int const pop = int(a.pop) + sign * int(d);
+                if(pop < 0 || pop > 128 || (d == 0 && sign > 0))
+                    continue;
+
+                for(unsigned to : buckets[pop])
+                {
+                    if(to == from || !can_merge(a, nodes[to]))
+                        continue;
+                    unsigned const td = dist(a, nodes[to]);
+                    if(td < best_dist || (td == best_dist && to < best))
+                    {
+                        best_dist = td;
+                        best = to;
+                    }
+                }
+            }
+        }
+
+        if(best != ~0u)
+            queue.push({ std::uint64_t(a.count) * best_dist, from, best, a.version, nodes[best].version });
+    };
+
+    for(unsigned i = 0; i < nodes.size(); i += 1)
+        push_nearest(i);
+
+    std::vector<unsigned> merged_into(nodes.size());
+    for(unsigned i = 0; i < nodes.size(); i += 1)
+        merged_into[i] = i;
+
+    while(alive > budget && !queue.empty())
+    {
+        merge_t const m = queue.top();
+        queue.pop();
+
+        node_t& from = nodes[m.from];
+        node_t& to = nodes[m.to];
+
+        if(!from.alive || from.version != m.from_version)
+            continue;
+        if(!to.alive || to.version != m.to_version)
+        {
+            push_nearest(m.from);
+            continue;
+        }
+
+        from.alive = false;
+        auto& bucket = buckets[from.pop];
+        bucket.erase(std::find(bucket.begin(), bucket.end(), m.from));
+        merged_into[m.from] = m.to;
+
+        to.count += from.count;
+        to.valid &= from.valid;
+        to.inside &= from.inside;
+        to.version += 1;
+        push_nearest(m.to);
+
+        alive -= 1;
+    }
+
+    // Write the merged tiles back:
+    for(unsigned ty = 0; ty < tiles_h; ty += 1)
+    for(unsigned tx = 0; tx < tiles_w; tx += 1)
+    {
+        unsigned const original = node_of[tx + ty * tiles_w];
+        unsigned target = original;
+        while(merged_into[target] != target)
+            target = merged_into[target];
+
+        if(target != original)
+        {
+            unsigned const p = blocks[tx / 2 + (ty / 2) * blocks_w(w)];
+            unpack_tile(nes, w, h, tx, ty, nodes[target].tile, subpalettes[p]);
+        }
+    }
+
+    return alive;
+}
+
+} // namespace
+
+unsigned reduce_tiles(std::uint8_t* nes, unsigned w, unsigned h,
+                      subpalettes_t const& subpalettes, std::uint8_t const* attributes,
+                      unsigned budget)
+{
+    if(attributes)
+        return merge_tiles(nes, w, h, subpalettes, attributes, budget);
+
+    // Sub-palettes picked from the pixels can change once merged tiles are
+    // written back, which splits tiles apart again, so go again while they do:
+    constexpr unsigned MAX_ROUNDS = 4;
+    std::vector<std::uint8_t> blocks = pick_attributes(nes, w, h, subpalettes);
+    for(unsigned round = 0; round < MAX_ROUNDS; round += 1)
+    {
+        unsigned const count = merge_tiles(nes, w, h, subpalettes, blocks.data(), budget);
+        std::vector<std::uint8_t> picked = pick_attributes(nes, w, h, subpalettes);
+        if(picked == blocks)
+            return count;
+        blocks = std::move(picked);
+    }
+
+    // Without a budget nothing is merged, so this just counts:
+    return merge_tiles(nes, w, h, subpalettes, blocks.data(), ~0u);
+}
+
+bool write_chr(std::string const& base, chr_export_t const& chr, bool flip)
+{
+    if(chr.tiles.size() > MAX_CHR_TILES)
+        return false;
+
+    auto const write = [&](char const* ext, void const* data, std::size_t size) -> bool
+    {
+        std::string const path = base + ext;
+        std::FILE* fp = std::fopen(path.c_str(), "wb");
+        if(!fp)
+            return false;
+        bool const ok = std::fwrite(data, 1, size, fp) == size;
+        return std::fclose(fp) == 0 && ok;
+    };
+
+    // Nametable entries are bytes:
+    std::vector<std::uint8_t> nametable(chr.nametable.begin(), chr.nametable.end());
+
+    return (write(".chr", chr.tiles.data(), chr.tiles.size() * sizeof(chr_tile_t))
+            && write(".nam", nametable.data(), nametable.size())
+            && write(".atr", chr.attributes.data(), chr.attributes.size())
+            && (!flip || write(".flp", chr.flips.data(), chr.flips.size())));
+}
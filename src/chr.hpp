@@ -0,0 +1,68 @@
+#ifndef CHR_HPP
+#define CHR_HPP
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// An 8x8 NES tile in 2bpp planar form: 8 bytes of the low plane, then 8
+// bytes of the high plane. The leftmost pixel of a row is the top bit.
+using chr_tile_t = std::array<std::uint8_t, 16>;
+
+constexpr unsigned NUM_SUBPALETTES = 4;
+
+// The background sub-palettes. Entry 0 of each is the shared background
+// color, and unused entries hold 0xFF.
+using subpalettes_t = std::array<std::array<std::uint8_t, 4>, NUM_SUBPALETTES>;
+
+constexpr unsigned MAX_CHR_TILES = 256; // What a byte of nametable can index.
+
+constexpr std::uint8_t CHR_FLIP_H = 1 << 6; // Same bits as OAM attributes.
+constexpr std::uint8_t CHR_FLIP_V = 1 << 7;
+
+struct chr_export_t
+{
+    unsigned tiles_w = 0;
+    unsigned tiles_h = 0;
+
+    std::vector<chr_tile_t> tiles;          // Unique tiles.
+    std::vector<std::uint16_t> nametable;   // Tile index of each tile position.
+    std::vector<std::uint8_t> flips;        // CHR_FLIP_* of each tile position.
+    std::vector<std::uint8_t> attributes;   // One byte per 32x32 area, row major.
+
+    unsigned mismatched = 0; // Pixels whose color wasn't in their sub-palette.
+};
+
+// Picks the sub-palette of each 16x16 area as the one covering the most
+// of its pixels.
+std::vector<std::uint8_t> pick_attributes(std::uint8_t const* nes, unsigned w, unsigned h,
+                                          subpalettes_t const& subpalettes);
+
+// Replaces each color missing from its 16x16 area's sub-palette
+// with the closest color that isn't.
+void enforce_attributes(std::uint8_t* nes, unsigned w, unsigned h,
+                        subpalettes_t const& subpalettes, std::uint8_t const* attributes);
+
+// Converts a NES-colored image into tiles, a nametable and attributes.
+// Duplicate tiles are merged, along with flipped duplicates if 'flip' is set.
+// 'attributes' holds the sub-palette of each 16x16 area, or is null to
+// have them picked.
+chr_export_t export_chr(std::uint8_t const* nes, unsigned w, unsigned h,
+                        subpalettes_t const& subpalettes, std::uint8_t const* attributes,
+                        bool flip);
+
+// Merges the cheapest pairs of similar tiles, by pixel difference times
+// use count, until no more than 'budget' unique tiles remain. A tile is
+// only merged into one whose colors all exist in the sub-palettes where it
+// is used, so more may remain when no such merge is left.
+// Rewrites the merged tiles in 'nes' and returns the new unique count.
+unsigned reduce_tiles(std::uint8_t* nes, unsigned w, unsigned h,
+                      subpalettes_t const& subpalettes, std::uint8_t const* attributes,
+                      unsigned budget);
+
+// Writes 'base.chr', 'base.nam', 'base.atr', and 'base.flp' when flipping.
+// Fails without writing anything if there are more than MAX_CHR_TILES tiles.
+bool write_chr(std::string const& base, chr_export_t const& chr, bool flip);
+
+#endif
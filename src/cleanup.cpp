@@ -0,0 +1,299 @@
+#include "cleanup.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+
+#include "flat/flat_map.hpp"
+
+void cull_zags(std::vector<std::uint8_t>& nes, int w, int h)
+{
+    auto const at = [&](int x, int y) -> std::uint8_t&
+    {
+        return nes[x + y*w];
+    };
+
+    for(int py = 0; py < h - 1; py += 1)
+    for(int px = 0; px < w - 2; px += 1)
+    {
+        std::uint8_t tl = at(px+0, py+0);
+        std::uint8_t tc = at(px+1, py+0);
+        std::uint8_t tr = at(px+2, py+0);
+        std::uint8_t bl = at(px+0, py+1);
+        std::uint8_t bc = at(px+1, py+1);
+        std::uint8_t br = at(px+2, py+1);
+
+        if(tc == bc)
+            continue;
+
+        int eq = 0;
+        eq += tl == bc;
+        eq += bl == tc;
+        eq += tr == bc;
+        eq += br == tc;
+
+        eq += tl != tc;
+        eq += bl != bc;
+        eq += tr != tc;
+        eq += br != bc;
+
+        if(eq < 7)
+            continue;
+
+        std::swap(at(px+1, py+0), at(px+1, py+1));
+    }
+}
+
+void cull_dots(std::vector<std::uint8_t>& nes, int w, int h)
+{
+    auto const at = [&](int x, int y) -> std::uint8_t&
+    {
+        return nes[x + y*w];
+    };
+
+    fc::vector_map<std::uint8_t, int> c_map;
+    std::vector<std::uint8_t> new_nes = nes;
+
+    for(int py = 0; py < h; py += 1)
+    for(int px = 0; px < w; px += 1)
+    {
+        c_map.clear();
+        std::uint8_t color = at(px, py);
+
+        auto const get_neighbor = [&](int x, int y) -> std::uint8_t
+        {
+            x += px;
+            y += py;
+            if(x < 0 || y < 0 || x >= w || y >= h)
+                return 0xFF;
+            return at(x, y);
+        };
+
+        auto const check_neighbor = [&](int x, int y, int weight)
+        {
+            auto n = get_neighbor(x, y);
+            if(n < 64)
+                c_map[n] += weight;
+        };
+
+        check_neighbor(-1, -1, 1);
+        check_neighbor( 1, -1, 1);
+        check_neighbor(-1,  1, 1);
+        check_neighbor( 1,  1, 1);
+
+        check_neighbor(-1,  0, 16);
+        check_neighbor( 1,  0, 16);
+        check_neighbor( 0, -1, 8);
+        check_neighbor( 0,  1, 8);
+
+        if(c_map[color] == 0)
+        {
+            auto it = std::ranges::max_element(c_map.container.begin(), c_map.container.end(), 
+                                               [&](auto const& a, auto const& b) { return a.second < b.second; });
+            if(it->second >= 32)
+                color = it->first;
+        }
+
+        new_nes[px + py * w] = color;
+    }
+
+    std::swap(nes, new_nes);
+}
+
+void cull_pipes(std::vector<std::uint8_t>& nes, int w, int h)
+{
+    auto const at = [&](int x, int y) -> std::uint8_t&
+    {
+        return nes[x + y*w];
+    };
+
+    fc::vector_map<std::uint8_t, int> c_map;
+    std::vector<std::uint8_t> new_nes = nes;
+
+    for(int py = 0; py < h-1; py += 1)
+    for(int px = 0; px < w; px += 1)
+    {
+        std::uint8_t color = at(px, py);
+
+        if(color != at(px, py+1))
+            continue;
+
+        c_map.clear();
+
+        auto const get_neighbor = [&](int x, int y) -> std::uint8_t
+        {
+            x += px;
+            y += py;
+            if(x < 0 || y < 0 || x >= w || y >= h)
+                return 0xFF;
+            return at(x, y);
+        };
+
+        auto const check_neighbor = [&](int x, int y, int weight)
+        {
+            auto n = get_neighbor(x, y);
+            if(n < 64)
+                c_map[n] += weight;
+        };
+
+        check_neighbor(-1, -1, 1);
+        check_neighbor( 1, -1, 1);
+        check_neighbor(-1,  2, 1);
+        check_neighbor( 1,  2, 1);
+
+        check_neighbor(-1,  0, 16);
+        check_neighbor( 1,  0, 16);
+        check_neighbor(-1,  1, 16);
+        check_neighbor( 1,  1, 16);
+        check_neighbor( 0, -1, 8);
+        check_neighbor( 0,  2, 8);
+
+        if(c_map[color] == 0)
+        {
+            auto it = std::ranges::max_element(c_map.container.begin(), c_map.container.end(), 
+                                               [&](auto const& a, auto const& b) { return a.second < b.second; });
+            if(it->second >= 64)
+                color = it->first;
+        }
+
+        new_nes[px + py * w] = color;
+        new_nes[px + (py+1) * w] = color;
+    }
+
+    std::swap(nes, new_nes);
+}
+
+void clean_lines(std::vector<std::uint8_t>& nes, int w, int h)
+{
+    auto const at = [&](int x, int y) -> std::uint8_t&
+    {
+        return nes[x + y*w];
+    };
+
+    std::array<std::uint8_t, 4> matched;
+    std::vector<int> a_x, a_y, b_x, b_y;
+
+    for(int py = 0; py < h; py += 1)
+    for(int px = 0; px < w; px += 1)
+    {
+        auto const pattern_match = [&](int pw, int ph, bool flip_x, bool flip_y, char const* pattern)
+        {
+            for(int my = 0; my <= int(flip_y); my += 1)
+            for(int mx = 0; mx <= int(flip_x); mx += 1)
+            {
+                a_x.clear();
+                a_y.clear();
+                b_x.clear();
+                b_y.clear();
+                matched.fill(0xFF);
+
+                for(int iy = 0; iy < ph; iy += 1)
+                for(int ix = 0; ix < pw; ix += 1)
+                {
+                    int x, y;
+
+                    if(mx)
+                        x = px + pw - ix - 1;
+                    else
+                        x = px + ix;
+
+                    if(my)
+                        y = py + ph - iy - 1;
+                    else
+                        y = py + iy;
+
+                    if(x >= w)
+                        goto next_iter;
+                    if(y >= h)
+                        goto next_iter;
+
+                    std::uint8_t p = pattern[ix + iy*pw];
+                    if(p == 'A')
+                    {
+                        a_x.push_back(x);
+                        a_y.push_back(y);
+                        p = 0;
+                    }
+                    else if(p == 'B')
+                    {
+                        b_x.push_back(x);
+                        b_y.push_back(y);
+                        p = 0;
+                    }
+                    else
+                        p -= '0';
+                    std::uint8_t const c = at(x, y);
+
+                    if(p < matched.size())
+                    {
+                        if(matched[p] >= 64)
+                            matched[p] = c;
+                        else if(matched[p] != c)
+                            goto next_iter;
+                    }
+                }
+
+                if(matched[0] >= 64)
+                    goto next_iter;
+
+                for(unsigned i = 1; i < matched.size(); i += 1)
+                    if(matched[0] == matched[i])
+                        goto next_iter;
+
+                if(matched[1] < 64)
+                {
+                    for(int i = 0; i < a_x.size(); i += 1)
+                    {
+                        assert(at(a_x[i], a_y[i]) != matched[1]);
+                        at(a_x[i], a_y[i]) = matched[1];
+                    }
+                }
+
+                if(matched[2] < 64)
+                {
+                    for(int i = 0; i < b_x.size(); i += 1)
+                    {
+                        assert(at(b_x[i], b_y[i]) != matched[2]);
+                        at(b_x[i], b_y[i]) = matched[2];
+                    }
+                }
+
+            next_iter:;
+            }
+        };
+
+        pattern_match(
+            4, 4, true, true,
+            ".022"
+            "1A02"
+            "11A0"
+            ".11.");
+
+        pattern_match(
+            3, 4, true, false,
+            "111"
+            "0A1"
+            "200"
+            "222");
+
+        pattern_match(
+            4, 3, false, true,
+            "1022"
+            "1A02"
+            "1102");
+
+        pattern_match(
+            4, 4, true, false,
+            "1111"
+            "00A1"
+            "2B00"
+            "2222");
+
+        pattern_match(
+            4, 4, false, true,
+            "1022"
+            "10B2"
+            "1A02"
+            "1102");
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef CLEANUP_HPP
+#define CLEANUP_HPP
+
+#include <cstdint>
+#include <vector>
+
+// Passes that tidy up a quantized image of 'w' by 'h' NES colors.
+
+// Swaps vertical pairs of pixels that form zigzags along edges.
+void cull_zags(std::vector<std::uint8_t>& nes, int w, int h);
+
+// Replaces lone pixels with the color mostly surrounding them.
+void cull_dots(std::vector<std::uint8_t>& nes, int w, int h);
+
+// Like cull_dots(), but for vertical pairs of pixels.
+void cull_pipes(std::vector<std::uint8_t>& nes, int w, int h);
+
+// Straightens jaggies along diagonal lines by matching small patterns.
+void clean_lines(std::vector<std::uint8_t>& nes, int w, int h);
+
+#endif
@@ -0,0 +1,535 @@
+// Checks settings_t::convert() against reference_convert() on random
+// inputs. Build and run with 'make diff'.
+//
+// Usage: pixeler-diff [--cases N] [--seed S]
+//
+// Each case is converted without a cache, with a fresh cache, and with a
+// cache left over from converting slightly different settings, and every
+// result must match the reference exactly. The exception is an ROI edit
+// under diffusion, which redoes only the area around the edited ROIs and
+// has to match the reference of the settings before the edit outside it.
+// A failing case is shrunk to something small before it's printed, and
+// its images are written to 'diff-source.png' and 'diff-dither.png'.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <wx/wx.h>
+
+#include "image_io.hpp"
+#include "model.hpp"
+#include "reference.hpp"
+
+namespace
+{
+
+struct rng_t
+{
+    std::uint32_t state;
+
+    std::uint32_t operator()()
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    // In [lo, hi]:
+    int range(int lo, int hi) { return lo + int((*this)() % unsigned(hi - lo + 1)); }
+    bool chance(unsigned one_in) { return (*this)() % one_in == 0; }
+};
+
+struct diff_case_t
+{
+    wxImage source;
+    wxImage dither;
+    settings_t before; // Converted first, to leave something in the cache.
+    settings_t after;  // What gets checked.
+};
+
+rgb_t random_color(rng_t& rng)
+{
+    return { std::uint8_t(rng()), std::uint8_t(rng()), std::uint8_t(rng()) };
+}
+
+wxImage random_image(rng_t& rng, unsigned w, unsigned h)
+{
+    wxImage image(w, h, false);
+    unsigned char* data = image.GetData();
+
+    // Few colors make ties and repeats likely, which is where shortcuts break:
+    std::vector<rgb_t> palette(rng.range(1, 8));
+    for(rgb_t& color : palette)
+        color = random_color(rng);
+
+    unsigned const kind = rng() % 3;
+    for(unsigned y = 0; y < h; y += 1)
+    for(unsigned x = 0; x < w; x += 1)
+    {
+        rgb_t color;
+        if(kind == 0)
+            color = random_color(rng);
+        else if(kind == 1)
+            color = palette[rng() % palette.size()];
+        else
+            color = { std::uint8_t(x * 255 / w), std::uint8_t(y * 255 / h), palette[0].b };
+        std::memcpy(data + (x + y*w) * 3, &color, 3);
+    }
+
+    return image;
+}
+
+color_knob_t random_knob(rng_t& rng)
+{
+    color_knob_t knob;
+    if(rng.chance(6))
+        return knob;
+
+    knob.nes_color = rng() % 64;
+    for(unsigned i = 0; i < MAP_SIZE; i += 1)
+    {
+        knob.map_colors[i] = rng.chance(2) ? nes_colors[knob.nes_color] : random_color(rng);
+        knob.map_enable[i] = i == 0 || rng.chance(3);
+    }
+    if(rng.chance(3))
+        knob.greed = rng.range(-20, 20);
+    if(rng.chance(3))
+        knob.bleed = rng.range(-20, 20);
+    return knob;
+}
+
+std::array<color_knob_t, 16> random_knobs(rng_t& rng)
+{
+    std::array<color_knob_t, 16> knobs = {};
+    unsigned const count = rng.range(1, 16);
+    for(unsigned k = 0; k < count; k += 1)
+        knobs[k] = random_knob(rng);
+    return knobs;
+}
+
+roi_t random_roi(rng_t& rng, int w, int h)
+{
+    roi_t roi;
+    roi.x = rng.range(-4, w - 1);
+    roi.y = rng.range(-4, h - 1);
+    roi.w = rng.range(1, w);
+    roi.h = rng.range(1, h);
+    if(rng.chance(2))
+    {
+        roi.mask.resize(roi.w * roi.h);
+        for(unsigned i = 0; i < roi.mask.size(); i += 1)
+            roi.mask[i] = rng.chance(2);
+    }
+    roi.color_knobs = random_knobs(rng);
+    return roi;
+}
+
+// Changes 'settings' the way a single edit in the GUI would:
+void random_edit(rng_t& rng, settings_t& settings)
+{
+    switch(rng() % 8)
+    {
+    case 0:
+        break;
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+        {
+            color_knob_t& knob = settings.color_knobs[rng() % 16];
+            switch(rng() % 4)
+            {
+            case 0: knob = random_knob(rng); break;
+            case 1: knob.greed = rng.range(-20, 20); break;
+            case 2: knob.bleed = rng.range(-20, 20); break;
+            case 3: knob.map_enable[rng() % MAP_SIZE] ^= true; break;
+            }
+        }
+        break;
+    case 5:
+    case 6:
+        if(!settings.rois.empty() && rng.chance(2))
+            settings.rois.erase(settings.rois.begin() + rng() % settings.rois.size());
+        else
+            settings.rois.push_back(random_roi(rng, settings.w, settings.h));
+        break;
+    case 7:
+        settings.dither_scale = rng.range(0, 40);
+        settings.dither_cutoff = rng.range(0, 48);
+        break;
+    }
+}
+
+settings_t random_settings(rng_t& rng, int w, int h)
+{
+    settings_t s;
+    s.w = w;
+    s.h = h;
+
+    s.dither_style = dither_style_t(rng() % NUM_DITHER);
+    s.dither_scale = rng.range(0, 40);
+    s.dither_cutoff = rng.chance(2) ? 0 : rng.range(0, 48);
+    s.custom_diffusion.serpentine = rng.chance(2);
+    for(unsigned i = rng.range(1, 6); i > 0; i -= 1)
+    {
+        int const y = rng.range(0, 2);
+        s.custom_diffusion.taps.push_back({ y ? rng.range(-2, 2) : rng.range(1, 2), y, rng.range(1, 8) / 16.0f });
+    }
+
+    s.cull_dots = rng.chance(4);
+    s.cull_pipes = rng.chance(4);
+    s.cull_zags = rng.chance(4);
+    s.clean_lines = rng.chance(4);
+    s.nes_attributes = rng.chance(4);
+    s.refine_attributes = rng.chance(2);
+    if(rng.chance(8))
+        s.tile_budget = rng.range(1, 16);
+
+    s.color_knobs = random_knobs(rng);
+    if(rng.chance(3))
+        for(unsigned i = rng.range(1, 3); i > 0; i -= 1)
+            s.rois.push_back(random_roi(rng, w, h));
+
+    return s;
+}
+
+diff_case_t random_case(std::uint32_t seed)
+{
+    rng_t rng = { seed * 2654435761u | 1 };
+    diff_case_t c;
+
+    int const w = rng.range(1, 40);
+    int const h = rng.range(1, 40);
+    switch(rng() % 3)
+    {
+    case 0: c.source = random_image(rng, w, h); break;
+    case 1: c.source = random_image(rng, w * rng.range(1, 3), h * rng.range(1, 3)); break;
+    case 2: c.source = random_image(rng, rng.range(1, 120), rng.range(1, 120)); break;
+    }
+    c.dither = random_image(rng, rng.range(1, 8), rng.range(1, 8));
+
+    // The cache only helps if the source and size stay, so only settings change:
+    c.before = random_settings(rng, w, h);
+    if(rng.chance(8))
+        c.after = random_settings(rng, w, h);
+    else
+    {
+        c.after = c.before;
+        random_edit(rng, c.after);
+    }
+
+    return c;
+}
+
+// The pixels a cached convert() may redo when only ROIs changed: the box
+// around the changed ones, widened by ROI_PATCH_MARGIN to either side and below.
+struct patch_t
+{
+    int x0 = 0;
+    int y0 = 0;
+    int x1 = 0;
+    int y1 = 0;
+
+    bool contains(int x, int y) const { return x >= x0 && x < x1 && y >= y0 && y < y1; }
+};
+
+patch_t roi_patch(std::vector<roi_t> const& before, std::vector<roi_t> const& after, int w, int h)
+{
+    patch_t patch = { w, h, 0, 0 };
+    auto const add = [&](roi_t const& roi)
+    {
+        int const x0 = std::max(roi.x, 0);
+        int const y0 = std::max(roi.y, 0);
+        int const x1 = std::min(roi.x + roi.w, w);
+        int const y1 = std::min(roi.y + roi.h, h);
+        if(x0 >= x1 || y0 >= y1)
+            return;
+        patch = { std::min(patch.x0, x0), std::min(patch.y0, y0), std::max(patch.x1, x1), std::max(patch.y1, y1) };
+    };
+
+    std::size_t const before_count = std::min<std::size_t>(before.size(), MAX_ROIS);
+    std::size_t const after_count = std::min<std::size_t>(after.size(), MAX_ROIS);
+    for(std::size_t r = 0; r < std::max(before_count, after_count); r += 1)
+    {
+        if(r < before_count && r < after_count && before[r] == after[r])
+            continue;
+        if(r < before_count)
+            add(before[r]);
+        if(r < after_count)
+            add(after[r]);
+    }
+
+    patch.x0 = std::max(patch.x0 - ROI_PATCH_MARGIN, 0);
+    patch.x1 = std::min(patch.x1 + ROI_PATCH_MARGIN, w);
+    patch.y1 = std::min(patch.y1 + ROI_PATCH_MARGIN, h);
+    return patch;
+}
+
+// Which way of converting disagreed with the reference, or null:
+char const* check_case(diff_case_t const& c)
+{
+    std::vector<std::uint8_t> expected_nes, expected_attributes;
+    reference_convert(c.after, c.source, c.dither, expected_nes, expected_attributes);
+
+    std::vector<std::uint8_t> nes, attributes;
+    auto const matches = [&] { return nes == expected_nes && attributes == expected_attributes; };
+
+    c.after.convert(c.source, c.dither, nes, attributes);
+    if(!matches())
+        return "uncached";
+
+    convert_cache_t cache;
+    c.after.convert(c.source, c.dither, nes, attributes, &cache);
+    if(!matches())
+        return "fresh cache";
+
+    bool const patched = c.after.dither_style != DITHER_NONE && c.after.dither_style <= LAST_DIFFUSION
+                         && !c.after.nes_attributes && c.before.rois != c.after.rois;
+    if(!patched)
+    {
+        cache = {};
+        c.before.convert(c.source, c.dither, nes, attributes, &cache);
+        c.after.convert(c.source, c.dither, nes, attributes, &cache);
+        if(!matches())
+            return "after an edit";
+        return nullptr;
+    }
+
+    // Redoing just the ROIs with diffusion keeps the cached pixels outside
+    // the patch, as the error it sends on would otherwise reach everything
+    // right of and below it. So those pixels must match the conversion
+    // before the edit exactly. Compare before the passes that spread
+    // changes around, and leave out what the patched path ignores:
+    settings_t before = c.before;
+    settings_t after = c.after;
+    for(settings_t* s : { &before, &after })
+    {
+        s->cull_dots = s->cull_pipes = s->cull_zags = s->clean_lines = false;
+        s->tile_budget = 0;
+        s->refine_attributes = false;
+        if(s->dither_style != DITHER_CUSTOM_DIFFUSION)
+            s->custom_diffusion = {};
+    }
+
+    settings_t same_rois = after;
+    same_rois.rois = before.rois;
+    bool const only_rois = same_rois == before;
+
+    std::vector<std::uint8_t> before_nes, before_attributes;
+    reference_convert(before, c.source, c.dither, before_nes, before_attributes);
+    reference_convert(after, c.source, c.dither, expected_nes, expected_attributes);
+
+    cache = {};
+    before.convert(c.source, c.dither, nes, attributes, &cache);
+    after.convert(c.source, c.dither, nes, attributes, &cache);
+    if(!only_rois)
+        return matches() ? nullptr : "after an edit";
+    if(nes.size() != before_nes.size() || attributes != expected_attributes)
+        return "after an ROI edit";
+
+    patch_t const patch = roi_patch(c.before.rois, c.after.rois, after.w, after.h);
+    for(int y = 0; y < after.h; y += 1)
+    for(int x = 0; x < after.w; x += 1)
+        if(!patch.contains(x, y) && nes[x + y * after.w] != before_nes[x + y * after.w])
+            return "outside an ROI patch";
+
+    return nullptr;
+}
+
+wxImage crop(wxImage const& image, unsigned w, unsigned h)
+{
+    return image.GetSubImage(wxRect(0, 0, w, h));
+}
+
+// Simplifies a failing case for as long as it keeps failing.
+diff_case_t shrink(diff_case_t c)
+{
+    using edit_t = std::function<bool(diff_case_t&)>;
+
+    // Applies 'fn' to the settings of both conversions:
+    auto const both = [](auto fn) -> edit_t
+    {
+        return [fn](diff_case_t& c) { return fn(c.before) | fn(c.after); };
+    };
+
+    std::vector<edit_t> edits =
+    {
+        [](diff_case_t& c) { bool const changed = !(c.before == c.after); c.before = c.after; return changed; },
+        both([](settings_t& s) { bool const changed = s.w > 1; s.w = std::max(1, s.w / 2); return changed; }),
+        both([](settings_t& s) { bool const changed = s.h > 1; s.h = std::max(1, s.h / 2); return changed; }),
+        both([](settings_t& s) { return std::exchange(s.w, s.w - 1) > 1; }),
+        both([](settings_t& s) { return std::exchange(s.h, s.h - 1) > 1; }),
+        [](diff_case_t& c)
+        {
+            if(c.source.GetWidth() <= 1)
+                return false;
+            c.source = crop(c.source, c.source.GetWidth() / 2, c.source.GetHeight());
+            return true;
+        },
+        [](diff_case_t& c)
+        {
+            if(c.source.GetHeight() <= 1)
+                return false;
+            c.source = crop(c.source, c.source.GetWidth(), c.source.GetHeight() / 2);
+            return true;
+        },
+        both([](settings_t& s) { return std::exchange(s.cull_dots, false); }),
+        both([](settings_t& s) { return std::exchange(s.cull_pipes, false); }),
+        both([](settings_t& s) { return std::exchange(s.cull_zags, false); }),
+        both([](settings_t& s) { return std::exchange(s.clean_lines, false); }),
+        both([](settings_t& s) { return std::exchange(s.refine_attributes, false); }),
+        both([](settings_t& s) { return std::exchange(s.nes_attributes, false); }),
+        both([](settings_t& s) { return std::exchange(s.tile_budget, 0) != 0; }),
+        both([](settings_t& s) { return std::exchange(s.dither_style, DITHER_NONE) != DITHER_NONE; }),
+        both([](settings_t& s) { return std::exchange(s.dither_scale, 0) != 0; }),
+        both([](settings_t& s) { return std::exchange(s.dither_cutoff, 0) != 0; }),
+    };
+
+    for(unsigned r = 0; r < MAX_ROIS; r += 1)
+    {
+        edits.push_back(both([r](settings_t& s)
+        {
+            if(r >= s.rois.size())
+                return false;
+            s.rois.erase(s.rois.begin() + r);
+            return true;
+        }));
+    }
+
+    for(unsigned k = 0; k < 16; k += 1)
+    {
+        edits.push_back(both([k](settings_t& s) { return std::exchange(s.color_knobs[k], {}) != color_knob_t{}; }));
+        edits.push_back(both([k](settings_t& s) { return std::exchange(s.color_knobs[k].greed, 0) != 0; }));
+        edits.push_back(both([k](settings_t& s) { return std::exchange(s.color_knobs[k].bleed, 0) != 0; }));
+        for(unsigned i = 1; i < MAP_SIZE; i += 1)
+            edits.push_back(both([k, i](settings_t& s) { return std::exchange(s.color_knobs[k].map_enable[i], false); }));
+    }
+
+    for(bool progress = true; progress;)
+    {
+        progress = false;
+        for(edit_t const& edit : edits)
+        {
+            diff_case_t next = c;
+            if(edit(next) && check_case(next))
+            {
+                c = std::move(next);
+                progress = true;
+            }
+        }
+    }
+
+    return c;
+}
+
+void print_knobs(std::array<color_knob_t, 16> const& knobs, char const* indent)
+{
+    for(unsigned k = 0; k < knobs.size(); k += 1)
+    {
+        color_knob_t const& knob = knobs[k];
+        if(knob == color_knob_t{})
+            continue;
+        std::printf("%sknob %u: %s greed %d bleed %d maps", indent, k, color_string(knob.nes_color).c_str(), knob.greed, knob.bleed);
+        for(unsigned i = 0; i < MAP_SIZE; i += 1)
+            if(knob.map_enable[i])
+                std::printf(" #%02X%02X%02X", knob.map_colors[i].r, knob.map_colors[i].g, knob.map_colors[i].b);
+        std::printf("\n");
+    }
+}
+
+void print_settings(char const* name, settings_t const& s)
+{
+    std::printf("%s: %dx%d, dither %d scale %d cutoff %d", name, s.w, s.h, s.dither_style, s.dither_scale, s.dither_cutoff);
+    if(s.dither_style == DITHER_CUSTOM_DIFFUSION)
+    {
+        std::printf(" taps");
+        for(diffusion_tap_t const& tap : s.custom_diffusion.taps)
+            std::printf(" (%d,%d)*%g", tap.x, tap.y, tap.weight);
+        if(s.custom_diffusion.serpentine)
+            std::printf(" serpentine");
+    }
+    std::printf("%s%s%s%s%s%s",
+                s.cull_dots ? ", cull dots" : "", s.cull_pipes ? ", cull pipes" : "",
+                s.cull_zags ? ", cull zags" : "", s.clean_lines ? ", clean lines" : "",
+                s.nes_attributes ? ", attributes" : "", s.refine_attributes ? " (refined)" : "");
+    if(s.tile_budget)
+        std::printf(", tile budget %d", s.tile_budget);
+    std::printf("\n");
+
+    print_knobs(s.color_knobs, "  ");
+    for(roi_t const& roi : s.rois)
+    {
+        std::printf("  roi at %d,%d size %dx%d%s\n", roi.x, roi.y, roi.w, roi.h, roi.mask.empty() ? "" : ", masked");
+        print_knobs(roi.color_knobs, "    ");
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    unsigned cases = 1000;
+    std::uint32_t seed = 1;
+
+    for(int i = 1; i < argc; i += 1)
+    {
+        if(std::strcmp(argv[i], "--cases") == 0 && i + 1 < argc)
+            cases = std::strtoul(argv[++i], nullptr, 10);
+        else if(std::strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = std::strtoul(argv[++i], nullptr, 10);
+        else
+        {
+            std::fprintf(stderr, "usage: %s [--cases N] [--seed S]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    wxInitAllImageHandlers();
+
+    for(unsigned i = 0; i < cases; i += 1)
+    {
+        diff_case_t const c = random_case(seed + i);
+        char const* const failed = check_case(c);
+        if(!failed)
+            continue;
+
+        std::printf("Case %u (--seed %u --cases 1) differs from the reference %s. Shrinking...\n",
+                    seed + i, seed + i, failed);
+        diff_case_t const small = shrink(c);
+
+        std::printf("Smallest case differs %s:\n", check_case(small));
+        std::printf("source: %dx%d, dither image: %dx%d\n", small.source.GetWidth(), small.source.GetHeight(),
+                    small.dither.GetWidth(), small.dither.GetHeight());
+        if(!(small.before == small.after))
+            print_settings("before", small.before);
+        print_settings("after", small.after);
+
+        std::vector<std::uint8_t> expected_nes, expected_attributes;
+        std::vector<std::uint8_t> nes, attributes;
+        reference_convert(small.after, small.source, small.dither, expected_nes, expected_attributes);
+        small.after.convert(small.source, small.dither, nes, attributes);
+        for(unsigned p = 0; p < std::min(nes.size(), expected_nes.size()); p += 1)
+        {
+            if(nes[p] != expected_nes[p])
+            {
+                std::printf("first uncached difference at %d,%d: %s instead of %s\n", p % small.after.w, p / small.after.w,
+                            color_string(nes[p]).c_str(), color_string(expected_nes[p]).c_str());
+                break;
+            }
+        }
+
+        save_png("diff-source.png", small.source, 6);
+        save_png("diff-dither.png", small.dither, 6);
+        return 1;
+    }
+
+    std::printf("%u cases match the reference.\n", cases);
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include "diffusion.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+bool load_diffusion_kernel(std::string const& path, custom_diffusion_t& kernel, std::string& error)
+{
+    std::ifstream file(path);
+    if(!file)
+    {
+        error = "Unable to open " + path;
+        return false;
+    }
+
+    float divisor = 0.0f;
+    unsigned chunky = 1;
+    bool serpentine = false;
+    std::vector<std::vector<std::string>> rows;
+
+    std::string line;
+    for(unsigned line_number = 1; std::getline(file, line); line_number += 1)
+    {
+        std::istringstream ss(line);
+        std::vector<std::string> tokens;
+        for(std::string token; ss >> token;)
+            tokens.push_back(token);
+
+        if(tokens.empty() || tokens[0][0] == '#')
+            continue;
+
+        if(tokens[0] == "divisor" && tokens.size() == 2)
+            divisor = std::strtof(tokens[1].c_str(), nullptr);
+        else if(tokens[0] == "chunky" && tokens.size() == 2)
+            chunky = std::clamp(std::atoi(tokens[1].c_str()), 1, 8);
+        else if(tokens[0] == "serpentine" && tokens.size() == 1)
+            serpentine = true;
+        else
+            rows.push_back(tokens);
+    }
+
+    // Find the pixel itself:
+    int cx = -1;
+    int cy = -1;
+    for(unsigned y = 0; y < rows.size(); y += 1)
+    for(unsigned x = 0; x < rows[y].size(); x += 1)
+    {
+        if(rows[y][x] != "*")
+            continue;
+        if(cy >= 0)
+        {
+            error = "More than one '*' in " + path;
+            return false;
+        }
+        cx = x;
+        cy = y;
+    }
+
+    if(cy != 0)
+    {
+        error = cy < 0 ? "No '*' in " + path : "Rows above the '*' in " + path;
+        return false;
+    }
+
+    std::vector<diffusion_tap_t> taps;
+    float sum = 0.0f;
+    for(unsigned y = 0; y < rows.size(); y += 1)
+    for(unsigned x = 0; x < rows[y].size(); x += 1)
+    {
+        if(rows[y][x] == "*" || rows[y][x] == ".")
+            continue;
+
+        char* end;
+        float const weight = std::strtof(rows[y][x].c_str(), &end);
+        if(*end)
+        {
+            error = "Bad weight '" + rows[y][x] + "' in " + path;
+            return false;
+        }
+        if(weight == 0.0f)
+            continue;
+
+        // Pixels before this one have already been chosen:
+        if(y == 0 && int(x) < cx)
+        {
+            error = "Weights left of the '*' in " + path;
+            return false;
+        }
+
+        taps.push_back({ int(x) - cx, int(y), weight });
+        sum += weight;
+    }
+
+    if(divisor <= 0.0f)
+        divisor = sum;
+    if(divisor <= 0.0f)
+    {
+        error = "No weights in " + path;
+        return false;
+    }
+
+    kernel.taps.clear();
+    kernel.serpentine = serpentine;
+    for(diffusion_tap_t const& tap : taps)
+    for(unsigned i = 0; i < chunky; i += 1)
+    for(unsigned j = 0; j < chunky; j += 1)
+        kernel.taps.push_back({ tap.x*int(chunky) + int(i), tap.y*int(chunky) + int(j), tap.weight / divisor / (chunky * chunky) });
+
+    return true;
+}
+
+custom_diffuser_t::custom_diffuser_t(custom_diffusion_t const& kernel, int w, int h)
+: w(w)
+, h(h)
+{
+    for(diffusion_tap_t const& tap : kernel.taps)
+    {
+        forward.push_back({ tap.x + tap.y*w, tap.x, tap.y, tap.weight });
+        mirrored.push_back({ -tap.x + tap.y*w, -tap.x, tap.y, tap.weight });
+        reach = std::max(reach, std::abs(tap.x));
+        depth = std::max(depth, tap.y);
+    }
+}
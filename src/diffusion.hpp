@@ -0,0 +1,234 @@
+#ifndef DIFFUSION_HPP
+#define DIFFUSION_HPP
+
+#include <array>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "nes_colors.hpp"
+
+enum diffusion_rows_t : unsigned char
+{
+    ALL_ROWS,
+    EVEN_ROWS,
+    ODD_ROWS,
+};
+
+// Where a share of a pixel's error goes, relative to the pixel.
+struct diffusion_tap_t
+{
+    int x;
+    int y;
+    float weight;
+    diffusion_rows_t rows = ALL_ROWS; // Which rows of the image the tap applies on.
+
+    bool operator==(diffusion_tap_t const&) const = default;
+};
+
+// An error diffusion kernel. The built-in ones are constexpr, so that
+// diffuse() can expand them into straight-line code.
+template<std::size_t N>
+struct diffusion_kernel_t
+{
+    std::array<diffusion_tap_t, N> taps;
+    unsigned chunky = 1;     // Spreads each tap over a chunky x chunky block.
+    bool serpentine = false; // Runs odd rows right to left, with mirrored taps.
+};
+
+constexpr diffusion_kernel_t<2> WAVES_KERNEL = {{{
+    { 0, 1, 0.75f },
+    { 1, 1, 0.25f },
+}}};
+
+constexpr diffusion_kernel_t<4> FLOYD_KERNEL = {{{
+    {  1, 0, 7.0f / 16.0f },
+    { -1, 1, 3.0f / 16.0f },
+    {  0, 1, 5.0f / 16.0f },
+    {  0, 2, 1.0f / 16.0f },
+}}};
+
+constexpr diffusion_kernel_t<4> HORIZONTAL_KERNEL = {{{
+    { 0, 1, 0.75f, ODD_ROWS },
+    { 1, 1, 0.25f, ODD_ROWS },
+    { 1, 0, 0.25f, EVEN_ROWS },
+    { 2, 0, 0.75f, EVEN_ROWS },
+}}};
+
+constexpr diffusion_kernel_t<4> VAN_GOGH_KERNEL = { FLOYD_KERNEL.taps, 2 };
+
+// Only diffuses 3/4 of the error, for higher contrast.
+constexpr diffusion_kernel_t<6> ATKINSON_KERNEL = {{{
+    {  1, 0, 1.0f / 8.0f },
+    {  2, 0, 1.0f / 8.0f },
+    { -1, 1, 1.0f / 8.0f },
+    {  0, 1, 1.0f / 8.0f },
+    {  1, 1, 1.0f / 8.0f },
+    {  0, 2, 1.0f / 8.0f },
+}}};
+
+// Jarvis, Judice and Ninke.
+constexpr diffusion_kernel_t<12> JJN_KERNEL = {{{
+    {  1, 0, 7.0f / 48.0f },
+    {  2, 0, 5.0f / 48.0f },
+    { -2, 1, 3.0f / 48.0f },
+    { -1, 1, 5.0f / 48.0f },
+    {  0, 1, 7.0f / 48.0f },
+    {  1, 1, 5.0f / 48.0f },
+    {  2, 1, 3.0f / 48.0f },
+    { -2, 2, 1.0f / 48.0f },
+    { -1, 2, 3.0f / 48.0f },
+    {  0, 2, 5.0f / 48.0f },
+    {  1, 2, 3.0f / 48.0f },
+    {  2, 2, 1.0f / 48.0f },
+}}};
+
+constexpr diffusion_kernel_t<12> STUCKI_KERNEL = {{{
+    {  1, 0, 8.0f / 42.0f },
+    {  2, 0, 4.0f / 42.0f },
+    { -2, 1, 2.0f / 42.0f },
+    { -1, 1, 4.0f / 42.0f },
+    {  0, 1, 8.0f / 42.0f },
+    {  1, 1, 4.0f / 42.0f },
+    {  2, 1, 2.0f / 42.0f },
+    { -2, 2, 1.0f / 42.0f },
+    { -1, 2, 2.0f / 42.0f },
+    {  0, 2, 4.0f / 42.0f },
+    {  1, 2, 2.0f / 42.0f },
+    {  2, 2, 1.0f / 42.0f },
+}}};
+
+constexpr diffusion_kernel_t<10> SIERRA_KERNEL = {{{
+    {  1, 0, 5.0f / 32.0f },
+    {  2, 0, 3.0f / 32.0f },
+    { -2, 1, 2.0f / 32.0f },
+    { -1, 1, 4.0f / 32.0f },
+    {  0, 1, 5.0f / 32.0f },
+    {  1, 1, 4.0f / 32.0f },
+    {  2, 1, 2.0f / 32.0f },
+    { -1, 2, 2.0f / 32.0f },
+    {  0, 2, 3.0f / 32.0f },
+    {  1, 2, 2.0f / 32.0f },
+}}};
+
+// Replaces each tap of a chunky kernel with its block of taps.
+template<auto const& KERNEL>
+constexpr auto expand_chunky()
+{
+    constexpr unsigned C = KERNEL.chunky;
+    diffusion_kernel_t<KERNEL.taps.size() * C * C> result = {};
+    result.serpentine = KERNEL.serpentine;
+
+    unsigned n = 0;
+    for(diffusion_tap_t const& tap : KERNEL.taps)
+    for(unsigned i = 0; i < C; i += 1)
+    for(unsigned j = 0; j < C; j += 1)
+        result.taps[n++] = { tap.x*int(C) + int(i), tap.y*int(C) + int(j), tap.weight / (C * C), tap.rows };
+
+    return result;
+}
+
+// Spreads the error 'q' of pixel (px, py) through a built-in kernel into
+// 'qerrs', a w by h image. Taps are mirrored if 'mirror' is set.
+template<auto const& KERNEL>
+inline void diffuse(qerr_t* qerrs, int w, int h, int px, int py, bool mirror, qerr_t q)
+{
+    static constexpr auto expanded = expand_chunky<KERNEL>();
+
+    auto const tap = [&](diffusion_tap_t const& t)
+    {
+        if((t.rows == EVEN_ROWS && (py & 1)) || (t.rows == ODD_ROWS && !(py & 1)))
+            return;
+        int const x = px + (mirror ? -t.x : t.x);
+        int const y = py + t.y;
+        if(x < 0 || x >= w || y < 0 || y >= h)
+            return;
+        qerrs[x + y*w].r += q.r * t.weight;
+        qerrs[x + y*w].g += q.g * t.weight;
+        qerrs[x + y*w].b += q.b * t.weight;
+    };
+
+    [&]<std::size_t... I>(std::index_sequence<I...>)
+    {
+        (tap(expanded.taps[I]), ...);
+    }(std::make_index_sequence<expanded.taps.size()>());
+}
+
+// A kernel only known at runtime, with chunky blocks already expanded.
+struct custom_diffusion_t
+{
+    std::vector<diffusion_tap_t> taps;
+    bool serpentine = false;
+
+    bool operator==(custom_diffusion_t const&) const = default;
+};
+
+// Reads a kernel from a text file laid out like the usual tables:
+//
+//     # Floyd-Steinberg. Lines starting with '#' are comments.
+//     divisor 16       (optional, defaults to the sum of the weights)
+//     chunky 2         (optional)
+//     serpentine       (optional)
+//       *  7
+//     3 5 1
+//
+// '*' marks the pixel itself, and '.' or '0' are unused spots. Columns
+// line up by their position in the row, so every row should be as wide.
+// Returns false and describes the problem in 'error' on failure.
+bool load_diffusion_kernel(std::string const& path, custom_diffusion_t& kernel, std::string& error);
+
+// A custom kernel prepared for one image size. Each tap's offset into the
+// image is precomputed, and pixels far enough from the edges skip the
+// bounds checks.
+class custom_diffuser_t
+{
+public:
+    custom_diffuser_t(custom_diffusion_t const& kernel, int w, int h);
+
+    void operator()(qerr_t* qerrs, int px, int py, bool mirror, qerr_t q) const
+    {
+        std::vector<tap_t> const& taps = mirror ? mirrored : forward;
+
+        if(px >= reach && px < w - reach && py < h - depth)
+        {
+            qerr_t* const center = qerrs + px + py*w;
+            for(tap_t const& t : taps)
+            {
+                center[t.offset].r += q.r * t.weight;
+                center[t.offset].g += q.g * t.weight;
+                center[t.offset].b += q.b * t.weight;
+            }
+            return;
+        }
+
+        for(tap_t const& t : taps)
+        {
+            int const x = px + t.x;
+            int const y = py + t.y;
+            if(x < 0 || x >= w || y < 0 || y >= h)
+                continue;
+            qerrs[x + y*w].r += q.r * t.weight;
+            qerrs[x + y*w].g += q.g * t.weight;
+            qerrs[x + y*w].b += q.b * t.weight;
+        }
+    }
+
+private:
+    struct tap_t
+    {
+        int offset;
+        int x;
+        int y;
+        float weight;
+    };
+
+    std::vector<tap_t> forward;
+    std::vector<tap_t> mirrored;
+    int w;
+    int h;
+    int reach = 0; // Furthest tap to either side.
+    int depth = 0; // Furthest tap down.
+};
+
+#endif
@@ -0,0 +1,219 @@
+#include "histogram.hpp"
+
+#include <algorithm>
+
+#include "image_io.hpp"
+#include "model.hpp"
+
+namespace
+{
+
+std::uint32_t pack(rgb_t c) { return (c.r << 16) | (c.g << 8) | c.b; }
+
+// Sorts by color and combines equal colors.
+void combine(color_histogram_t& histogram)
+{
+    std::sort(histogram.begin(), histogram.end(), [](color_count_t const& a, color_count_t const& b)
+        { return pack(a.color) < pack(b.color); });
+
+    std::size_t out = 0;
+    for(std::size_t i = 0; i < histogram.size(); i += 1)
+    {
+        if(out && histogram[out-1].color == histogram[i].color)
+            histogram[out-1].weight += histogram[i].weight;
+        else
+            histogram[out++] = histogram[i];
+    }
+    histogram.resize(out);
+}
+
+} // namespace
+
+color_histogram_t make_histogram(unsigned char const* rgb, std::size_t pixels, float weight)
+{
+    std::vector<std::uint32_t> packed(pixels);
+    for(std::size_t i = 0; i < pixels; i += 1)
+        packed[i] = (rgb[i*3+0] << 16) | (rgb[i*3+1] << 8) | rgb[i*3+2];
+    std::sort(packed.begin(), packed.end());
+
+    color_histogram_t histogram;
+    for(std::size_t i = 0; i < pixels;)
+    {
+        std::size_t j = i + 1;
+        while(j < pixels && packed[j] == packed[i])
+            j += 1;
+
+        rgb_t const color = { std::uint8_t(packed[i] >> 16), std::uint8_t(packed[i] >> 8), std::uint8_t(packed[i]) };
+        histogram.push_back({ color, float(j - i) * weight });
+        i = j;
+    }
+
+    return histogram;
+}
+
+color_histogram_t merge_histograms(std::vector<color_histogram_t const*> const& histograms)
+{
+    color_histogram_t merged;
+    for(color_histogram_t const* histogram : histograms)
+        merged.insert(merged.end(), histogram->begin(), histogram->end());
+    combine(merged);
+    return merged;
+}
+
+std::vector<rgb_t> median_cut(color_histogram_t histogram, unsigned count)
+{
+    struct bucket_t
+    {
+        std::size_t begin;
+        std::size_t end;
+        int range;
+        std::uint8_t rgb_t::*channel;
+
+        auto operator<=>(bucket_t const& o) const { return range <=> o.range; }
+    };
+
+    std::vector<bucket_t> buckets;
+
+    auto const set_bucket_range = [&](bucket_t& bucket)
+    {
+        if(bucket.begin == bucket.end)
+        {
+            bucket.range = 0;
+            bucket.channel = &rgb_t::r;
+            return;
+        }
+
+        rgb_t min = { 255, 255, 255 };
+        rgb_t max = { 0, 0, 0 };
+        for(std::size_t i = bucket.begin; i < bucket.end; i += 1)
+        {
+            rgb_t const& rgb = histogram[i].color;
+
+            min.r = std::min(min.r, rgb.r);
+            min.g = std::min(min.g, rgb.g);
+            min.b = std::min(min.b, rgb.b);
+
+            max.r = std::max(max.r, rgb.r);
+            max.g = std::max(max.g, rgb.g);
+            max.b = std::max(max.b, rgb.b);
+        }
+
+        rgb_t const dist = { max.r - min.r, max.g - min.g, max.b - min.b };
+
+        if(dist.r >= dist.g && dist.r >= dist.b)
+        {
+            bucket.range = dist.r;
+            bucket.channel = &rgb_t::r;
+        }
+        else if(dist.g >= dist.r && dist.g >= dist.b)
+        {
+            bucket.range = dist.g;
+            bucket.channel = &rgb_t::g;
+        }
+        else
+        {
+            bucket.range = dist.b;
+            bucket.channel = &rgb_t::b;
+        }
+    };
+
+    auto& initial = buckets.emplace_back();
+    initial.begin = 0;
+    initial.end = histogram.size();
+    set_bucket_range(initial);
+
+    while(buckets.size() < count)
+    {
+        auto m = std::max_element(buckets.begin(), buckets.end());
+        if(m->begin == m->end)
+            break;
+
+        if(m->end - m->begin == 1)
+        {
+            // A single color can only be split by weight:
+            std::size_t const at = m->end;
+            histogram[m->begin].weight *= 0.5f;
+            histogram.insert(histogram.begin() + at, histogram[m->begin]);
+            for(bucket_t& bucket : buckets)
+            {
+                if(bucket.begin >= at)
+                    bucket.begin += 1;
+                if(bucket.end >= at)
+                    bucket.end += 1;
+            }
+        }
+
+        auto const channel = m->channel;
+        std::sort(histogram.begin() + m->begin, histogram.begin() + m->end, [&](color_count_t const& a, color_count_t const& b)
+            { return a.color.*channel < b.color.*channel; });
+
+        // Split where half the weight lies on each side:
+        float total = 0.0f;
+        for(std::size_t i = m->begin; i < m->end; i += 1)
+            total += histogram[i].weight;
+
+        std::size_t split = m->begin + 1;
+        float below = histogram[m->begin].weight;
+        while(split + 1 < m->end && below + histogram[split].weight <= total * 0.5f)
+            below += histogram[split++].weight;
+
+        bucket_t new_bucket;
+        new_bucket.begin = split;
+        new_bucket.end = m->end;
+        m->end = split;
+        set_bucket_range(*m);
+        set_bucket_range(new_bucket);
+        buckets.push_back(new_bucket);
+    }
+
+    std::vector<rgb_t> result;
+    for(bucket_t const& bucket : buckets)
+    {
+        float r = 0.0f, g = 0.0f, b = 0.0f, total = 0.0f;
+        for(std::size_t i = bucket.begin; i < bucket.end; i += 1)
+        {
+            color_count_t const& c = histogram[i];
+            r += c.color.r * c.weight;
+            g += c.color.g * c.weight;
+            b += c.color.b * c.weight;
+            total += c.weight;
+        }
+
+        if(total > 0.0f)
+            result.push_back({ std::uint8_t(r / total), std::uint8_t(g / total), std::uint8_t(b / total) });
+        else
+            result.push_back(BLACK);
+    }
+
+    return result;
+}
+
+color_histogram_t histogram_cache_t::get(std::filesystem::path const& path)
+{
+    std::error_code ec;
+    auto const time = std::filesystem::last_write_time(path, ec);
+    if(ec)
+        return {};
+    auto const size = std::filesystem::file_size(path, ec);
+    if(ec)
+        return {};
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(path);
+        if(it != entries.end() && it->second.time == time && it->second.size == size)
+            return it->second.histogram;
+    }
+
+    // Palettes don't need more detail than the converter uses:
+    wxImage const image = load_image(path.string(), MAX_SIZE, MAX_SIZE);
+    if(!image.IsOk())
+        return {};
+
+    std::size_t const pixels = std::size_t(image.GetWidth()) * image.GetHeight();
+    color_histogram_t histogram = make_histogram(image.GetData(), pixels, 1.0f / pixels);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    entries[path] = { time, size, histogram };
+    return histogram;
+}
@@ -0,0 +1,55 @@
+#ifndef HISTOGRAM_HPP
+#define HISTOGRAM_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "nes_colors.hpp"
+
+struct color_count_t
+{
+    rgb_t color;
+    float weight;
+};
+
+// Unique colors and how much of the image they cover, sorted by color.
+using color_histogram_t = std::vector<color_count_t>;
+
+// Counts the colors of 'pixels' RGB pixels. Each pixel weighs 'weight'.
+color_histogram_t make_histogram(unsigned char const* rgb, std::size_t pixels, float weight = 1.0f);
+
+// Sums histograms together.
+color_histogram_t merge_histograms(std::vector<color_histogram_t const*> const& histograms);
+
+// Splits the histogram into 'count' buckets by weighted median cut and
+// returns the weighted average color of each bucket.
+std::vector<rgb_t> median_cut(color_histogram_t histogram, unsigned count);
+
+// Remembers the histograms of image files, so that solving a palette for
+// a set of images only scans the files that are new or changed.
+class histogram_cache_t
+{
+public:
+    // Returns the file's histogram, normalized to a total weight of 1,
+    // or an empty histogram if the file can't be read. Thread safe.
+    color_histogram_t get(std::filesystem::path const& path);
+
+private:
+    struct entry_t
+    {
+        std::filesystem::file_time_type time;
+        std::uintmax_t size;
+        color_histogram_t histogram;
+    };
+
+    std::mutex mutex;
+    std::map<std::filesystem::path, entry_t> entries;
+};
+
+#endif
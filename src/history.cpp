@@ -0,0 +1,161 @@
+#include "history.hpp"
+
+#include <functional>
+
+namespace
+{
+
+struct hasher_t
+{
+    std::size_t value = 0;
+
+    template<typename T>
+    void add(T const& t)
+    {
+        value ^= std::hash<T>()(t) + 0x9e3779b97f4a7c15ull + (value << 6) + (value >> 2);
+    }
+
+    void add(color_knob_t const& knob)
+    {
+        add(knob.nes_color);
+        for(unsigned i = 0; i < MAP_SIZE; i += 1)
+        {
+            add(knob.map_enable[i]);
+            add(knob.map_colors[i].r | knob.map_colors[i].g << 8 | knob.map_colors[i].b << 16);
+        }
+        add(knob.greed);
+        add(knob.bleed);
+    }
+};
+
+} // namespace
+
+std::size_t hash_settings(settings_t const& settings)
+{
+    hasher_t h;
+    h.add(settings.w);
+    h.add(settings.h);
+    h.add(settings.cull_dots);
+    h.add(settings.cull_pipes);
+    h.add(settings.cull_zags);
+    h.add(settings.clean_lines);
+    h.add(settings.nes_attributes);
+    h.add(settings.refine_attributes);
+    h.add(settings.tile_budget);
+    h.add(settings.optimize_ms);
+    h.add(int(settings.dither_style));
+    h.add(settings.dither_scale);
+    h.add(settings.dither_cutoff);
+
+    h.add(settings.custom_diffusion.serpentine);
+    for(diffusion_tap_t const& tap : settings.custom_diffusion.taps)
+    {
+        h.add(tap.x);
+        h.add(tap.y);
+        h.add(tap.weight);
+        h.add(int(tap.rows));
+    }
+
+    for(color_knob_t const& knob : settings.color_knobs)
+        h.add(knob);
+
+    h.add(settings.rois.size());
+    for(roi_t const& roi : settings.rois)
+    {
+        h.add(roi.x);
+        h.add(roi.y);
+        h.add(roi.w);
+        h.add(roi.h);
+        h.add(roi.mask);
+        for(color_knob_t const& knob : roi.color_knobs)
+            h.add(knob);
+    }
+
+    return h.value;
+}
+
+void history_t::push(settings_t const& settings)
+{
+    if(!states.empty() && get(current) == settings)
+        return;
+
+    if(!states.empty())
+        states.resize(current + 1);
+
+    state_t state;
+    state.settings = settings;
+
+    // Share what didn't change with the state before:
+    std::vector<roi_t> rois = std::move(state.settings.rois);
+    state.settings.rois = {};
+    if(!states.empty() && *states.back().rois == rois)
+        state.rois = states.back().rois;
+    else
+        state.rois = std::make_shared<std::vector<roi_t> const>(std::move(rois));
+
+    custom_diffusion_t custom_diffusion = std::move(state.settings.custom_diffusion);
+    state.settings.custom_diffusion = {};
+    if(!states.empty() && *states.back().custom_diffusion == custom_diffusion)
+        state.custom_diffusion = states.back().custom_diffusion;
+    else
+        state.custom_diffusion = std::make_shared<custom_diffusion_t const>(std::move(custom_diffusion));
+
+    states.push_back(std::move(state));
+    if(states.size() > MAX_STATES)
+        states.pop_front();
+    current = states.size() - 1;
+}
+
+bool history_t::undo(settings_t& settings)
+{
+    if(!can_undo())
+        return false;
+    current -= 1;
+    settings = get(current);
+    return true;
+}
+
+bool history_t::redo(settings_t& settings)
+{
+    if(!can_redo())
+        return false;
+    current += 1;
+    settings = get(current);
+    return true;
+}
+
+settings_t history_t::get(unsigned i) const
+{
+    settings_t settings = states[i].settings;
+    settings.rois = *states[i].rois;
+    settings.custom_diffusion = *states[i].custom_diffusion;
+    return settings;
+}
+
+result_cache_t::result_t const* result_cache_t::find(settings_t const& settings, wxImage const& base_image,
+                                                     wxImage const& dither_image)
+{
+    std::size_t const hash = hash_settings(settings);
+    for(auto it = entries.begin(); it != entries.end(); ++it)
+    {
+        if(it->hash != hash
+           || it->base_image.GetData() != base_image.GetData()
+           || it->dither_image.GetData() != dither_image.GetData()
+           || it->settings != settings)
+        {
+            continue;
+        }
+
+        entries.splice(entries.begin(), entries, it);
+        return &entries.front().result;
+    }
+    return nullptr;
+}
+
+void result_cache_t::add(settings_t const& settings, wxImage const& base_image, wxImage const& dither_image,
+                         result_t result)
+{
+    entries.push_front({ hash_settings(settings), settings, base_image, dither_image, std::move(result) });
+    if(entries.size() > CAPACITY)
+        entries.pop_back();
+}
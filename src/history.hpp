@@ -0,0 +1,88 @@
+#ifndef HISTORY_HPP
+#define HISTORY_HPP
+
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <vector>
+
+#include <wx/wx.h>
+
+#include "model.hpp"
+#include "quality.hpp"
+
+// A hash of everything in 'settings'.
+std::size_t hash_settings(settings_t const& settings);
+
+// Settings to undo and redo. States share their ROIs and custom diffusion
+// kernel with the state before them when those didn't change, which they
+// rarely do, so each state costs about one settings_t without them.
+class history_t
+{
+public:
+    static constexpr unsigned MAX_STATES = 256;
+
+    // Makes 'settings' the current state, dropping what could be redone.
+    // Does nothing if they are the current state.
+    void push(settings_t const& settings);
+
+    // Step to the previous or next state and store it in 'settings'.
+    // Return false if there is none.
+    bool undo(settings_t& settings);
+    bool redo(settings_t& settings);
+
+    bool can_undo() const { return current > 0; }
+    bool can_redo() const { return current + 1 < states.size(); }
+
+private:
+    struct state_t
+    {
+        settings_t settings; // Without 'rois' and 'custom_diffusion'.
+        std::shared_ptr<std::vector<roi_t> const> rois;
+        std::shared_ptr<custom_diffusion_t const> custom_diffusion;
+    };
+
+    settings_t get(unsigned i) const;
+
+    std::deque<state_t> states;
+    unsigned current = 0;
+};
+
+// The outputs of recent updates, so that returning to earlier settings
+// shows them without converting again. Least recently used go first.
+class result_cache_t
+{
+public:
+    static constexpr unsigned CAPACITY = 16;
+
+    struct result_t
+    {
+        std::vector<std::uint8_t> dst_nes;
+        std::vector<std::uint8_t> attributes;
+        quality_t quality;
+    };
+
+    // The result of converting 'base_image' with 'settings' and
+    // 'dither_image', or null if it isn't cached.
+    result_t const* find(settings_t const& settings, wxImage const& base_image, wxImage const& dither_image);
+
+    void add(settings_t const& settings, wxImage const& base_image, wxImage const& dither_image, result_t result);
+
+    void clear() { entries.clear(); }
+
+private:
+    struct entry_t
+    {
+        std::size_t hash;
+        settings_t settings;
+        // Kept so that their data can't be freed and reused by other images:
+        wxImage base_image;
+        wxImage dither_image;
+        result_t result;
+    };
+
+    std::list<entry_t> entries; // Most recently used first.
+};
+
+#endif
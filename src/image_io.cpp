@@ -0,0 +1,453 @@
+#include "image_io.hpp"
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include <png.h>
+#include <jpeglib.h>
+
+#include "nes_colors.hpp"
+
+namespace
+{
+
+// Shrinks an RGB image by an integer factor, one scanline at a time,
+// so the full-resolution image never has to be resident.
+class box_reducer_t
+{
+public:
+    box_reducer_t(unsigned iw, unsigned ih, unsigned factor)
+    : iw(iw)
+    , ih(ih)
+    , factor(std::max(1u, factor))
+    , ow((iw + this->factor - 1) / this->factor)
+    , oh((ih + this->factor - 1) / this->factor)
+    , sums(ow * 3)
+    {
+        data = (unsigned char*)std::malloc(ow * oh * 3);
+    }
+
+    ~box_reducer_t() { std::free(data); }
+
+    box_reducer_t(box_reducer_t const&) = delete;
+    box_reducer_t& operator=(box_reducer_t const&) = delete;
+
+    void add_row(unsigned char const* row)
+    {
+        for(unsigned x = 0; x < iw; x += 1)
+        {
+            unsigned const i = (x / factor) * 3;
+            sums[i+0] += row[x*3+0];
+            sums[i+1] += row[x*3+1];
+            sums[i+2] += row[x*3+2];
+        }
+
+        in_y += 1;
+        if(in_y % factor == 0 || in_y == ih)
+            flush();
+    }
+
+    // Hands the reduced pixels over to a wxImage.
+    wxImage release()
+    {
+        if(!data || out_y != oh)
+            return wxImage();
+        wxImage image(ow, oh, data);
+        data = nullptr;
+        return image;
+    }
+
+private:
+    void flush()
+    {
+        unsigned const rows = in_y - out_y * factor;
+        unsigned char* dst = data + out_y * ow * 3;
+
+        for(unsigned x = 0; x < ow; x += 1)
+        {
+            unsigned const cols = std::min(factor, iw - x * factor);
+            unsigned const n = cols * rows;
+            for(unsigned c = 0; c < 3; c += 1)
+                dst[x*3+c] = (sums[x*3+c] + n/2) / n;
+        }
+
+        std::fill(sums.begin(), sums.end(), 0);
+        out_y += 1;
+    }
+
+    unsigned const iw;
+    unsigned const ih;
+    unsigned const factor;
+    unsigned const ow;
+    unsigned const oh;
+    unsigned in_y = 0;
+    unsigned out_y = 0;
+    std::vector<std::uint32_t> sums;
+    unsigned char* data = nullptr;
+};
+
+bool report(progress_fn_t const& progress, float amount)
+{
+    return !progress || progress(amount);
+}
+
+unsigned reduce_factor(unsigned iw, unsigned ih, unsigned target_w, unsigned target_h)
+{
+    return std::max(1u, std::min(iw / std::max(1u, target_w), ih / std::max(1u, target_h)));
+}
+
+struct file_closer_t
+{
+    void operator()(std::FILE* fp) const { std::fclose(fp); }
+};
+using file_ptr_t = std::unique_ptr<std::FILE, file_closer_t>;
+
+struct jpeg_error_t
+{
+    jpeg_error_mgr mgr;
+    std::jmp_buf jmp;
+};
+
+void jpeg_error_exit(j_common_ptr cinfo)
+{
+    std::longjmp(reinterpret_cast<jpeg_error_t*>(cinfo->err)->jmp, 1);
+}
+
+void jpeg_output_message(j_common_ptr cinfo)
+{
+    char buffer[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, buffer);
+    std::fprintf(stderr, "libjpeg: %s\n", buffer);
+}
+
+// What the decoders touch after setjmp. It lives on the heap behind a
+// pointer set before setjmp, as automatic objects changed after setjmp
+// are indeterminate once longjmp returns there.
+struct jpeg_state_t
+{
+    jpeg_decompress_struct cinfo = {};
+    jpeg_error_t err;
+    std::vector<unsigned char> row;
+    std::unique_ptr<box_reducer_t> reducer;
+};
+
+// Holds no objects with destructors, so that longjmp can skip past it.
+// Returns false if the image is unsupported or loading was cancelled.
+bool decode_jpeg(jpeg_state_t& state, std::FILE* fp, unsigned target_w, unsigned target_h,
+                 progress_fn_t const& progress)
+{
+    jpeg_decompress_struct& cinfo = state.cinfo;
+
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+
+    if(cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK)
+        return false;
+
+    // Let the DCT do as much of the reduction as it can:
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    for(unsigned denom = 8; denom > 1; denom /= 2)
+    {
+        if(cinfo.image_width / denom >= target_w && cinfo.image_height / denom >= target_h)
+        {
+            cinfo.scale_denom = denom;
+            break;
+        }
+    }
+
+    jpeg_start_decompress(&cinfo);
+
+    unsigned const iw = cinfo.output_width;
+    unsigned const ih = cinfo.output_height;
+    state.reducer = std::make_unique<box_reducer_t>(iw, ih, reduce_factor(iw, ih, target_w, target_h));
+    state.row.resize(iw * cinfo.output_components);
+
+    while(cinfo.output_scanline < cinfo.output_height)
+    {
+        JSAMPROW rows[1] = { state.row.data() };
+        jpeg_read_scanlines(&cinfo, rows, 1);
+        state.reducer->add_row(state.row.data());
+
+        if(!report(progress, float(cinfo.output_scanline) / ih))
+            return false;
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    return true;
+}
+
+wxImage load_jpeg(std::FILE* fp, unsigned target_w, unsigned target_h, progress_fn_t const& progress)
+{
+    auto const state = std::make_unique<jpeg_state_t>();
+    state->cinfo.err = jpeg_std_error(&state->err.mgr);
+    state->err.mgr.error_exit = jpeg_error_exit;
+    state->err.mgr.output_message = jpeg_output_message;
+
+    if(setjmp(state->err.jmp))
+    {
+        jpeg_destroy_decompress(&state->cinfo);
+        return wxImage();
+    }
+
+    jpeg_create_decompress(&state->cinfo);
+    bool const ok = decode_jpeg(*state, fp, target_w, target_h, progress);
+    jpeg_destroy_decompress(&state->cinfo);
+
+    return ok ? state->reducer->release() : wxImage();
+}
+
+// Like jpeg_state_t, for the same reason.
+struct png_state_t
+{
+    std::vector<unsigned char> pixels;
+    std::unique_ptr<box_reducer_t> reducer;
+};
+
+// Holds no objects with destructors, so that longjmp can skip past it.
+// Returns false if loading was cancelled.
+bool decode_png(png_structp png, png_infop info, png_state_t& state, std::FILE* fp,
+                unsigned target_w, unsigned target_h, progress_fn_t const& progress)
+{
+    png_init_io(png, fp);
+    png_read_info(png, info);
+
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_strip_alpha(png);
+    png_set_gray_to_rgb(png);
+    int const passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    unsigned const iw = png_get_image_width(png, info);
+    unsigned const ih = png_get_image_height(png, info);
+    state.reducer = std::make_unique<box_reducer_t>(iw, ih, reduce_factor(iw, ih, target_w, target_h));
+
+    std::vector<unsigned char>& pixels = state.pixels;
+    if(passes > 1)
+    {
+        // Interlaced images only become whole after the last pass.
+        pixels.resize(std::size_t(iw) * ih * 3);
+        for(int pass = 0; pass < passes; pass += 1)
+        for(unsigned y = 0; y < ih; y += 1)
+        {
+            png_read_row(png, &pixels[std::size_t(y) * iw * 3], nullptr);
+            if(!report(progress, float(pass * ih + y + 1) / (passes * ih)))
+                return false;
+        }
+        for(unsigned y = 0; y < ih; y += 1)
+            state.reducer->add_row(&pixels[std::size_t(y) * iw * 3]);
+    }
+    else
+    {
+        pixels.resize(iw * 3);
+        for(unsigned y = 0; y < ih; y += 1)
+        {
+            png_read_row(png, pixels.data(), nullptr);
+            state.reducer->add_row(pixels.data());
+            if(!report(progress, float(y + 1) / ih))
+                return false;
+        }
+    }
+
+    png_read_end(png, nullptr);
+    return true;
+}
+
+wxImage load_png(std::FILE* fp, unsigned target_w, unsigned target_h, progress_fn_t const& progress)
+{
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if(!png)
+        return wxImage();
+    png_infop info = png_create_info_struct(png);
+    auto const state = std::make_unique<png_state_t>();
+
+    if(!info || setjmp(png_jmpbuf(png)))
+    {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return wxImage();
+    }
+
+    bool const ok = decode_png(png, info, *state, fp, target_w, target_h, progress);
+    png_destroy_read_struct(&png, &info, nullptr);
+
+    return ok ? state->reducer->release() : wxImage();
+}
+
+} // namespace
+
+wxImage load_image(std::string const& path, unsigned target_w, unsigned target_h,
+                   progress_fn_t const& progress)
+{
+    wxImage image;
+
+    if(file_ptr_t fp{ std::fopen(path.c_str(), "rb") })
+    {
+        unsigned char sig[8] = {};
+        std::size_t const read = std::fread(sig, 1, sizeof(sig), fp.get());
+        std::rewind(fp.get());
+
+        if(read == sizeof(sig) && png_sig_cmp(sig, 0, sizeof(sig)) == 0)
+            image = load_png(fp.get(), target_w, target_h, progress);
+        else if(read >= 3 && sig[0] == 0xFF && sig[1] == 0xD8 && sig[2] == 0xFF)
+            image = load_jpeg(fp.get(), target_w, target_h, progress);
+    }
+
+    if(!image.IsOk() && report(progress, 0.0f))
+    {
+        // Formats we don't decode ourselves:
+        image.LoadFile(path);
+        if(image.IsOk())
+        {
+            unsigned const iw = image.GetWidth();
+            unsigned const ih = image.GetHeight();
+            unsigned const factor = reduce_factor(iw, ih, target_w, target_h);
+            if(factor > 1)
+                image.Rescale(iw / factor, ih / factor, wxIMAGE_QUALITY_BOX_AVERAGE);
+        }
+    }
+
+    return image;
+}
+
+bool save_png(std::string const& path, wxImage const& image, int level,
+              progress_fn_t const& progress)
+{
+    if(!image.IsOk())
+        return false;
+
+    // Set up libpng before creating the file, so failing leaves none behind:
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if(!png)
+        return false;
+    png_infop info = png_create_info_struct(png);
+    if(!info)
+    {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+
+    file_ptr_t fp{ std::fopen(path.c_str(), "wb") };
+    if(!fp)
+    {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+
+    unsigned const w = image.GetWidth();
+    unsigned const h = image.GetHeight();
+    unsigned char const* const data = image.GetData();
+
+    if(setjmp(png_jmpbuf(png)))
+    {
+    fail:
+        png_destroy_write_struct(&png, &info);
+        fp.reset();
+        std::remove(path.c_str());
+        return false;
+    }
+
+    png_init_io(png, fp.get());
+    png_set_compression_level(png, std::clamp(level, 0, 9));
+    // Adaptive filtering costs more than it saves at the fast levels.
+    if(level <= 1)
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+    png_set_IHDR(png, info, w, h, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+
+    for(unsigned y = 0; y < h; y += 1)
+    {
+        png_write_row(png, data + std::size_t(y) * w * 3);
+        if(!report(progress, float(y + 1) / h))
+            goto fail;
+    }
+
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+    return true;
+}
+
+bool save_nes_png(std::string const& path, unsigned w, unsigned h,
+                  std::uint8_t const* nes_pixels, std::vector<std::uint8_t> const& palette,
+                  int level, progress_fn_t const& progress)
+{
+    if(palette.empty() || palette.size() > 256)
+        return false;
+
+    std::array<std::uint8_t, 256> lut = {};
+    std::vector<png_color> png_palette;
+    for(std::uint8_t color : palette)
+    {
+        lut[color] = png_palette.size();
+        rgb_t const rgb = nes_colors[color & 63];
+        png_palette.push_back({ rgb.r, rgb.g, rgb.b });
+    }
+
+    int depth = 1;
+    while((1u << depth) < palette.size())
+        depth *= 2;
+    unsigned const per_byte = 8 / depth;
+
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    if(!png)
+        return false;
+    png_infop info = png_create_info_struct(png);
+    if(!info)
+    {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+
+    file_ptr_t fp{ std::fopen(path.c_str(), "wb") };
+    if(!fp)
+    {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+
+    std::vector<png_byte> row((w + per_byte - 1) / per_byte);
+
+    if(setjmp(png_jmpbuf(png)))
+    {
+    fail:
+        png_destroy_write_struct(&png, &info);
+        fp.reset();
+        std::remove(path.c_str());
+        return false;
+    }
+
+    png_init_io(png, fp.get());
+    png_set_compression_level(png, std::clamp(level, 0, 9));
+    // Filtering rarely helps palettized data.
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+    png_set_IHDR(png, info, w, h, depth, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_set_PLTE(png, info, png_palette.data(), png_palette.size());
+    png_write_info(png, info);
+
+    for(unsigned y = 0; y < h; y += 1)
+    {
+        std::uint8_t const* src = nes_pixels + std::size_t(y) * w;
+        std::fill(row.begin(), row.end(), 0);
+        for(unsigned x = 0; x < w; x += 1)
+        {
+            unsigned const shift = 8 - depth * (x % per_byte + 1);
+            row[x / per_byte] |= lut[src[x]] << shift;
+        }
+
+        png_write_row(png, row.data());
+        if(!report(progress, float(y + 1) / h))
+            goto fail;
+    }
+
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+    return true;
+}
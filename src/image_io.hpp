@@ -0,0 +1,34 @@
+#ifndef IMAGE_IO_HPP
+#define IMAGE_IO_HPP
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <wx/wx.h>
+
+// Receives progress in [0, 1]. Returning false cancels the operation.
+using progress_fn_t = std::function<bool(float)>;
+
+// Loads an image, reducing it during decode so that it stays at least
+// 'target_w' x 'target_h' pixels large (when the source is larger).
+// JPEGs use libjpeg's DCT scaling, PNGs are box-reduced per scanline,
+// and anything else falls back to wxImage::LoadFile.
+// Returns an invalid image on failure or cancellation.
+wxImage load_image(std::string const& path, unsigned target_w, unsigned target_h,
+                   progress_fn_t const& progress = {});
+
+// Writes an 8-bit RGB PNG using the zlib compression 'level' (0-9).
+// Returns false on failure or cancellation, leaving no partial file.
+bool save_png(std::string const& path, wxImage const& image, int level,
+              progress_fn_t const& progress = {});
+
+// Writes a palettized PNG straight from a buffer of NES color indices.
+// The PNG palette follows 'palette' (which must hold every color used),
+// and the bit depth is the smallest of 1, 2, 4 or 8 that fits.
+bool save_nes_png(std::string const& path, unsigned w, unsigned h,
+                  std::uint8_t const* nes_pixels, std::vector<std::uint8_t> const& palette,
+                  int level, progress_fn_t const& progress = {});
+
+#endif
@@ -7,17 +7,39 @@
 #include <wx/spinctrl.h>
 #include <wx/statline.h>
 #include <wx/clrpicker.h>
+#include <wx/progdlg.h>
+#include <wx/timer.h>
 
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <filesystem>
 #include <cstring>
 #include <map>
+#include <thread>
 
 #include "model.hpp"
 #include "graphics.hpp"
+#include "image_io.hpp"
+#include "atlas.hpp"
+#include "thread_pool.hpp"
+#include "tune.hpp"
+#include "variants.hpp"
 
 enum
 {
     ID_AUTO_COLOR,
+    ID_SHARED_COLOR,
+    ID_PNG_FAST,
+    ID_PNG_NORMAL,
+    ID_PNG_SMALL,
+    ID_PNG_INDEXED,
+    ID_EXPORT_CHR,
+    ID_CHR_FLIP,
+    ID_ATLAS,
+    ID_ROI_MASK,
+    ID_AUTO_TUNE,
+    ID_VARIANTS,
 };
 
 class app_t: public wxApp
@@ -55,7 +77,12 @@ public:
         if(picker)
             Bind(wxEVT_LEFT_DOWN, &visual_t::on_click, this);
         else
+        {
             Bind(wxEVT_MOUSEWHEEL, &visual_t::on_wheel, this);
+            Bind(wxEVT_RIGHT_DOWN, &visual_t::on_roi_down, this);
+            Bind(wxEVT_MOTION, &visual_t::on_roi_drag, this);
+            Bind(wxEVT_RIGHT_UP, &visual_t::on_roi_up, this);
+        }
 
         Bind(wxEVT_UPDATE_UI, &visual_t::on_update, this);
         Connect(wxEVT_PAINT, wxPaintEventHandler(visual_t::on_paint), 0, this);
@@ -97,18 +124,19 @@ public:
     {
         if(picker)
         {
-            if(model.picker_bitmap.IsOk())
+            wxBitmap const& bitmap = model.picker_view();
+            if(bitmap.IsOk())
             {
 #ifdef GC_RENDER
-                gc.DrawBitmap(model.picker_bitmap, 0, 0, 512, 512);
+                gc.DrawBitmap(bitmap, 0, 0, 512, 512);
 #else
-                gc.DrawBitmap(model.picker_bitmap, 0, 0);
+                gc.DrawBitmap(bitmap, 0, 0);
 #endif
             }
         }
         else
         {
-            auto& bitmap = model.display ? model.output_bitmap : model.base_bitmap;
+            wxBitmap const& bitmap = model.view();
             if(bitmap.IsOk())
             {
 #ifdef GC_RENDER
@@ -117,6 +145,23 @@ public:
                 gc.DrawBitmap(bitmap, 0, 0);
 #endif
             }
+
+            // Outline the ROIs, and the one being dragged out.
+            // Attribute mode ignores ROIs, so they aren't shown then:
+            gc.SetBrush(*wxTRANSPARENT_BRUSH);
+            for(unsigned r = 0; r < model.rois.size() && !model.nes_attributes; r += 1)
+            {
+                roi_t const& roi = model.rois[r];
+                gc.SetPen(wxPen(int(r) == selected_roi ? *wxRED : *wxWHITE, 0));
+                gc.DrawRectangle(roi.x, roi.y, roi.w, roi.h);
+            }
+
+            if(dragging)
+            {
+                wxRect const rect = drag_rect();
+                gc.SetPen(wxPen(*wxRED, 0));
+                gc.DrawRectangle(rect.x, rect.y, rect.width, rect.height);
+            }
         }
     }
 
@@ -180,24 +225,72 @@ public:
 
     void on_click(wxMouseEvent& event)
     {
-        if(model.picker_image.IsOk() && picker_fn)
+        wxImage const& picker_image = model.picker();
+        if(picker_image.IsOk() && picker_fn)
         {
             SetFocus();
-            int x = std::clamp(event.GetPosition().x, 0, model.picker_image.GetWidth());
-            int y = std::clamp(event.GetPosition().y, 0, model.picker_image.GetHeight());
+            int x = std::clamp(event.GetPosition().x, 0, picker_image.GetWidth());
+            int y = std::clamp(event.GetPosition().y, 0, picker_image.GetHeight());
             rgb_t read;
-            read.r = model.picker_image.GetRed(x, y);
-            read.g = model.picker_image.GetGreen(x, y);
-            read.b = model.picker_image.GetBlue(x, y);
+            read.r = picker_image.GetRed(x, y);
+            read.g = picker_image.GetGreen(x, y);
+            read.b = picker_image.GetBlue(x, y);
             picker_fn(read);
         }
     }
 
+    // Right-dragging over the output marks out a new ROI:
+    wxPoint to_output(wxMouseEvent const& event) const
+    {
+        wxPoint const p = CalcUnscrolledPosition(event.GetPosition());
+        return { std::clamp(p.x / scale, 0, model.w), std::clamp(p.y / scale, 0, model.h) };
+    }
+
+    wxRect drag_rect() const
+    {
+        return wxRect(std::min(drag_start.x, drag_end.x), std::min(drag_start.y, drag_end.y),
+                      std::abs(drag_end.x - drag_start.x), std::abs(drag_end.y - drag_start.y));
+    }
+
+    void on_roi_down(wxMouseEvent& event)
+    {
+        drag_start = drag_end = to_output(event);
+        dragging = true;
+        CaptureMouse();
+    }
+
+    void on_roi_drag(wxMouseEvent& event)
+    {
+        if(!dragging)
+            return;
+        drag_end = to_output(event);
+        Refresh();
+    }
+
+    void on_roi_up(wxMouseEvent& event)
+    {
+        if(!dragging)
+            return;
+        dragging = false;
+        if(HasCapture())
+            ReleaseMouse();
+        Refresh();
+
+        wxRect const rect = drag_rect();
+        if(rect.width > 0 && rect.height > 0 && roi_fn)
+            roi_fn(rect);
+    }
+
     std::function<void(rgb_t)> picker_fn;
+    std::function<void(wxRect)> roi_fn;
+    int selected_roi = -1; // Drawn highlighted.
 
 protected:
     model_t& model;
     bool picker;
+    bool dragging = false;
+    wxPoint drag_start;
+    wxPoint drag_end;
     int scale = 1;
     int w = 0;
     int h = 0;
@@ -417,13 +510,61 @@ wxWindow* get_top(wxWindow* pWindow)
     return pWin;
 }
 
+// Runs 'job' on a worker thread while a progress dialog keeps the UI responsive.
+// Returns false if the user cancelled.
+bool run_in_background(wxWindow* parent, wxString const& title, std::function<void(progress_fn_t const&)> job)
+{
+    std::atomic<int> permille = 0;
+    std::atomic<bool> cancel = false;
+    std::atomic<bool> done = false;
+    std::exception_ptr error;
+
+    std::thread thread([&]
+    {
+        try
+        {
+            job([&](float amount)
+            {
+                permille = std::clamp<int>(amount * 1000.0f, 0, 1000);
+                return !cancel;
+            });
+        }
+        catch(...)
+        {
+            error = std::current_exception();
+        }
+        done = true;
+    });
+
+    // Don't flash a dialog for quick jobs:
+    for(int i = 0; i < 10 && !done; i += 1)
+        wxMilliSleep(10);
+
+    if(!done)
+    {
+        // App modal, so nothing can touch the model while the job runs.
+        wxProgressDialog dlg(title, title, 1000, parent, wxPD_APP_MODAL | wxPD_CAN_ABORT | wxPD_ELAPSED_TIME);
+        while(!done)
+        {
+            if(!dlg.Update(std::min<int>(permille, 999)))
+                cancel = true;
+            wxMilliSleep(20);
+        }
+    }
+
+    thread.join();
+    if(error)
+        std::rethrow_exception(error);
+    return !cancel;
+}
+
 class pal_entry_t : public wxPanel
 {
 public:
     pal_entry_t(wxWindow* parent, model_t& model, color_knob_t& knob)
     : wxPanel(parent)
     , model(model)
-    , knob(knob)
+    , knob(&knob)
     {
         color = new color_button_t(this, model, knob.nes_color, &knob);
         color->Bind(wxEVT_BUTTON, &pal_entry_t::on_click_nes, this);
@@ -449,10 +590,20 @@ public:
         SetSizerAndFit(sizer);
     }
 
+    // Points the entry at another knob, such as the same one of an ROI.
+    void set_knob(color_knob_t& new_knob)
+    {
+        knob = &new_knob;
+        color->knob = knob;
+        for(auto* ptr : map_colors)
+            ptr->knob = knob;
+        manual_update();
+    }
+
     void manual_update() 
     { 
-        greed->SetValue(knob.greed);
-        bleed->SetValue(knob.bleed);
+        greed->SetValue(knob->greed);
+        bleed->SetValue(knob->bleed);
         for(auto* ptr : map_colors)
             ptr->manual_update();
         color->manual_update();
@@ -492,13 +643,13 @@ public:
     {
         auto btn = static_cast<rgb_button_t*>(event.GetEventObject());
         unsigned index = btn->index;
-        rgb_dialog_t dlg(this, model, knob.nes_color, knob.map_colors[index]);
+        rgb_dialog_t dlg(this, model, knob->nes_color, knob->map_colors[index]);
         
         auto result = dlg.ShowModal();
         if(result == wxID_OK) 
         {
-            knob.map_enable[index] = true;
-            knob.map_colors[index] = dlg.rgb;
+            knob->map_enable[index] = true;
+            knob->map_colors[index] = dlg.rgb;
             btn->update_color();
             model.update();
             auto* top = get_top(this);
@@ -508,7 +659,7 @@ public:
         }
         else if(result == wxID_DELETE) 
         {
-            knob.map_enable[index] = false;
+            knob->map_enable[index] = false;
             btn->update_color();
             model.update();
             auto* top = get_top(this);
@@ -520,7 +671,7 @@ public:
 
     void on_greed(wxScrollEvent& event)
     {
-        if(knob.set_greed(event.GetPosition()))
+        if(knob->set_greed(event.GetPosition()))
         {
             model.update();
 
@@ -533,7 +684,7 @@ public:
 
     void on_bleed(wxScrollEvent& event)
     {
-        if(knob.set_bleed(event.GetPosition()))
+        if(knob->set_bleed(event.GetPosition()))
         {
             model.update();
 
@@ -546,7 +697,7 @@ public:
 
 private:
     model_t& model;
-    color_knob_t& knob;
+    color_knob_t* knob;
     color_button_t* color;
     std::array<rgb_button_t*, 4> map_colors;
     wxSlider* greed;
@@ -582,6 +733,229 @@ public:
     wxCheckBox* map;
 };
 
+class atlas_dialog_t : public wxDialog
+{
+public:
+    atlas_dialog_t(wxWindow* parent)
+    : wxDialog(parent, wxID_ANY, "Convert Sprite Sheet")
+    {
+        wxBoxSizer* sizer = new wxBoxSizer(wxVERTICAL);
+        wxFlexGridSizer* grid = new wxFlexGridSizer(2);
+
+        cell_w = new wxSpinCtrl(this);
+        cell_w->SetRange(0, 4096);
+        cell_w->SetValue(0);
+
+        cell_h = new wxSpinCtrl(this);
+        cell_h->SetRange(0, 4096);
+        cell_h->SetValue(0);
+
+        colors = new wxSpinCtrl(this);
+        colors->SetRange(1, 3);
+        colors->SetValue(3);
+
+        grid->Add(new wxStaticText(this, wxID_ANY, "Cell width (0 finds cells):"), 0, wxALL | wxALIGN_CENTER_VERTICAL, 4);
+        grid->Add(cell_w, 0, wxALL, 4);
+        grid->Add(new wxStaticText(this, wxID_ANY, "Cell height (0 finds cells):"), 0, wxALL | wxALIGN_CENTER_VERTICAL, 4);
+        grid->Add(cell_h, 0, wxALL, 4);
+        grid->Add(new wxStaticText(this, wxID_ANY, "Colors per cell:"), 0, wxALL | wxALIGN_CENTER_VERTICAL, 4);
+        grid->Add(colors, 0, wxALL, 4);
+
+        map = new wxCheckBox(this, wxID_ANY, "Create RGB Mapping");
+
+        sizer->Add(grid, 0, wxALL | wxALIGN_CENTER, 4);
+        sizer->Add(map, 0, wxALL | wxALIGN_CENTER, 4);
+
+        wxSizer* bs = CreateButtonSizer(wxOK | wxCANCEL);
+        sizer->Add(bs, 0, wxALL | wxALIGN_CENTER, 8);
+
+        SetSizerAndFit(sizer);
+    }
+
+    wxSpinCtrl* cell_w;
+    wxSpinCtrl* cell_h;
+    wxSpinCtrl* colors;
+    wxCheckBox* map;
+};
+
+// Shows the image under every dither style, or under a range of greeds
+// of one knob, side by side. Thumbnails fill in as they finish rendering.
+// Clicking one closes the dialog with it in 'picked'.
+class variant_dialog_t : public wxDialog
+{
+public:
+    static constexpr int CELL = 200;  // Thumbnail size.
+    static constexpr int LABEL = 36;  // Text below each thumbnail.
+    static constexpr int MARGIN = 8;
+
+    variant_dialog_t(wxWindow* parent, model_t const& model, wxArrayString const& style_names)
+    : wxDialog(parent, wxID_ANY, "Compare Variants", wxDefaultPosition, wxSize(900, 700),
+               wxDEFAULT_DIALOG_STYLE | wxRESIZE_BORDER)
+    , model(model)
+    , style_names(style_names)
+    , timer(this)
+    {
+        wxBoxSizer* sizer = new wxBoxSizer(wxVERTICAL);
+
+        mode = new wxChoice(this, wxID_ANY);
+        mode->Append("Dither styles");
+        for(unsigned k = 0; k < model.color_knobs.size(); k += 1)
+            if(model.color_knobs[k].nes_color < 64)
+                mode->Append(wxString::Format("Greed of color %u", k + 1));
+        mode->SetSelection(0);
+        mode->Bind(wxEVT_CHOICE, &variant_dialog_t::on_mode, this);
+        sizer->Add(mode, 0, wxALL, 4);
+
+        grid = new wxScrolledWindow(this);
+        grid->SetScrollRate(0, 16);
+        grid->SetBackgroundStyle(wxBG_STYLE_PAINT);
+        grid->Bind(wxEVT_PAINT, &variant_dialog_t::on_paint, this);
+        grid->Bind(wxEVT_LEFT_DOWN, &variant_dialog_t::on_click, this);
+        grid->Bind(wxEVT_SIZE, &variant_dialog_t::on_size, this);
+        sizer->Add(grid, 1, wxEXPAND);
+
+        Bind(wxEVT_TIMER, &variant_dialog_t::on_timer, this);
+        SetSizer(sizer);
+        render();
+    }
+
+    settings_t picked;
+
+private:
+    // The knob each greed mode varies:
+    unsigned mode_knob() const
+    {
+        unsigned index = 0;
+        for(unsigned k = 0; k < model.color_knobs.size(); k += 1)
+            if(model.color_knobs[k].nes_color < 64 && ++index == unsigned(mode->GetSelection()))
+                return k;
+        return 0;
+    }
+
+    void render()
+    {
+        std::vector<variant_t> variants;
+        if(mode->GetSelection() <= 0)
+        {
+            for(unsigned style = 0; style < NUM_DITHER; style += 1)
+            {
+                // Ones needing a file that isn't loaded would come out blank:
+                if(style == DITHER_CUSTOM && !model.dither_images.back().IsOk())
+                    continue;
+                variant_t variant = { style_names[style].ToStdString(), model };
+                variant.settings.dither_style = dither_style_t(style);
+                variants.push_back(std::move(variant));
+            }
+        }
+        else
+        {
+            unsigned const knob = mode_knob();
+            int const greed = model.color_knobs[knob].greed;
+            for(int v = std::max(greed - 8, -20); v <= std::min(greed + 8, 20); v += 2)
+            {
+                variant_t variant = { wxString::Format("Greed %d", v).ToStdString(), model };
+                variant.settings.color_knobs[knob].greed = v;
+                variants.push_back(std::move(variant));
+            }
+        }
+
+        // Waits for any previous renders, which quit early:
+        renderer.reset();
+        thumbnails.assign(variants.size(), wxBitmap());
+        renderer = std::make_unique<variant_renderer_t>(std::move(variants), model.base_image, model.dither_images);
+        timer.Start(30);
+        layout();
+    }
+
+    unsigned columns() const
+    {
+        return std::max(1, grid->GetClientSize().GetWidth() / (CELL + MARGIN));
+    }
+
+    void layout()
+    {
+        unsigned const rows = (thumbnails.size() + columns() - 1) / columns();
+        grid->SetVirtualSize(columns() * (CELL + MARGIN), rows * (CELL + LABEL + MARGIN));
+        grid->Refresh();
+    }
+
+    void on_mode(wxCommandEvent& event) { render(); }
+    void on_size(wxSizeEvent& event) { layout(); event.Skip(); }
+
+    void on_timer(wxTimerEvent& event)
+    {
+        for(unsigned i : renderer->poll())
+        {
+            settings_t const& settings = renderer->variants[i].settings;
+            std::vector<std::uint8_t> const& nes = renderer->output(i);
+
+            wxImage image(settings.w, settings.h);
+            unsigned char* const ptr = image.GetData();
+            for(std::size_t j = 0; j < nes.size(); j += 1)
+            {
+                ptr[j*3+0] = nes_colors[nes[j]].r;
+                ptr[j*3+1] = nes_colors[nes[j]].g;
+                ptr[j*3+2] = nes_colors[nes[j]].b;
+            }
+
+            // Whole pixels when enlarging, so dithering stays crisp:
+            float zoom = std::min(float(CELL) / settings.w, float(CELL) / settings.h);
+            if(zoom >= 1.0f)
+                zoom = std::floor(zoom);
+            image.Rescale(std::max(1, int(settings.w * zoom)), std::max(1, int(settings.h * zoom)),
+                          zoom >= 1.0f ? wxIMAGE_QUALITY_NEAREST : wxIMAGE_QUALITY_BOX_AVERAGE);
+            thumbnails[i] = wxBitmap(image);
+        }
+
+        if(renderer->done())
+            timer.Stop();
+        grid->Refresh();
+    }
+
+    void on_paint(wxPaintEvent& event)
+    {
+        wxPaintDC dc(grid);
+        grid->PrepareDC(dc);
+        dc.Clear();
+
+        for(unsigned i = 0; i < thumbnails.size(); i += 1)
+        {
+            int const x = (i % columns()) * (CELL + MARGIN) + MARGIN / 2;
+            int const y = (i / columns()) * (CELL + LABEL + MARGIN) + MARGIN / 2;
+
+            wxString label = renderer->variants[i].label;
+            if(thumbnails[i].IsOk())
+            {
+                dc.DrawBitmap(thumbnails[i], x, y);
+                quality_t const& quality = renderer->quality(i);
+                label += wxString::Format("\nPSNR %.1f dB, SSIM %.3f", quality.psnr, quality.ssim);
+            }
+            else
+                label += "\nRendering...";
+            dc.DrawText(label, x, y + CELL + 2);
+        }
+    }
+
+    void on_click(wxMouseEvent& event)
+    {
+        wxPoint const p = grid->CalcUnscrolledPosition(event.GetPosition());
+        int const col = p.x / (CELL + MARGIN);
+        unsigned const i = (p.y / (CELL + LABEL + MARGIN)) * columns() + col;
+        if(col >= int(columns()) || i >= thumbnails.size() || !thumbnails[i].IsOk())
+            return;
+        picked = renderer->variants[i].settings;
+        EndModal(wxID_OK);
+    }
+
+    model_t const& model;
+    wxArrayString style_names;
+    wxChoice* mode;
+    wxScrolledWindow* grid;
+    wxTimer timer;
+    std::unique_ptr<variant_renderer_t> renderer;
+    std::vector<wxBitmap> thumbnails;
+};
+
 class frame_t : public wxFrame
 {
 public:
@@ -593,15 +967,38 @@ public:
         menu_file->Append(wxID_OPEN, "&Open Image\tCTRL+O");
         menu_file->Append(wxID_SAVE, "&Save Image\tCTRL+S");
         menu_file->Append(wxID_SAVEAS, "Save Image &As\tSHIFT+CTRL+S");
+
+        wxMenu* menu_png = new wxMenu;
+        menu_png->AppendRadioItem(ID_PNG_FAST, "Fast");
+        menu_png->AppendRadioItem(ID_PNG_NORMAL, "Normal");
+        menu_png->AppendRadioItem(ID_PNG_SMALL, "Smallest");
+        menu_png->Check(ID_PNG_NORMAL, true);
+        menu_png->AppendSeparator();
+        menu_png->AppendCheckItem(ID_PNG_INDEXED, "Indexed Color");
+        menu_png->Check(ID_PNG_INDEXED, model.save_indexed);
+        menu_file->AppendSubMenu(menu_png, "PNG Compression");
+        menu_file->AppendSeparator();
+        menu_file->Append(ID_EXPORT_CHR, "&Export CHR\tCTRL+E");
+        menu_file->AppendCheckItem(ID_CHR_FLIP, "Merge Flipped Tiles");
+        menu_file->Append(ID_ATLAS, "Convert Sprite S&heet...");
+
         menu_file->AppendSeparator();
         menu_file->Append(wxID_EXIT);
 
         wxMenu* menu_edit = new wxMenu;
+        undo = menu_edit->Append(wxID_UNDO, "&Undo\tCTRL+Z");
+        redo = menu_edit->Append(wxID_REDO, "&Redo\tCTRL+Y");
+        menu_edit->AppendSeparator();
         copy = menu_edit->Append(wxID_COPY, "Copy Image\tCTRL+C");
         paste = menu_edit->Append(wxID_PASTE, "Paste Image (Preview must be off)\tCTRL+V");
         menu_edit->AppendSeparator();
         menu_edit->Append(wxID_NEW, "Reset Colors\tCTRL+N");
         menu_edit->Append(ID_AUTO_COLOR, "Automatic Colors");
+        menu_edit->Append(ID_SHARED_COLOR, "Shared Automatic Colors...");
+        menu_edit->Append(ID_AUTO_TUNE, "Auto-Tune Dithering...");
+        menu_edit->Append(ID_VARIANTS, "Compare Variants...\tCTRL+K");
+        menu_edit->AppendSeparator();
+        roi_mask = menu_edit->Append(ID_ROI_MASK, "Add ROI from Mask Image...");
 
         wxMenuBar* menu_bar = new wxMenuBar;
         menu_bar->Append(menu_file, "&File");
@@ -610,7 +1007,10 @@ public:
 
         SetMenuBar(menu_bar);
      
-        model.status_bar = CreateStatusBar();
+        // Update times, then how close the output is to the source:
+        model.status_bar = CreateStatusBar(2);
+        int const status_widths[] = { -2, -1 };
+        model.status_bar->SetStatusWidths(2, status_widths);
 
         wxPanel* l_panel = new wxPanel(this);
         wxPanel* r_panel = new wxPanel(this);
@@ -623,12 +1023,12 @@ public:
             wxStaticText* preview_label = new wxStaticText(wh_panel, wxID_ANY, "  Preview:");
 
             w_ctrl= new wxSpinCtrl(wh_panel);
-            w_ctrl->SetRange(8, 512);
+            w_ctrl->SetRange(8, MAX_SIZE);
             w_ctrl->SetIncrement(8);
             w_ctrl->SetValue(model.w);
 
             h_ctrl= new wxSpinCtrl(wh_panel);
-            h_ctrl->SetRange(8, 512);
+            h_ctrl->SetRange(8, MAX_SIZE);
             h_ctrl->SetIncrement(8);
             h_ctrl->SetValue(model.h);
 
@@ -653,6 +1053,18 @@ public:
 
         {
             wxBoxSizer* sizer = new wxBoxSizer(wxVERTICAL);
+
+            // Which knobs the entries below edit. Right-drag over the output to add ROIs:
+            wxBoxSizer* roi_sizer = new wxBoxSizer(wxHORIZONTAL);
+            roi_sizer->Add(new wxStaticText(r_panel, wxID_ANY, "Knobs of:"), wxSizerFlags().Border(wxALL));
+            knob_set = new wxChoice(r_panel, wxID_ANY);
+            knob_set->Bind(wxEVT_CHOICE, &frame_t::on_knob_set, this);
+            roi_sizer->Add(knob_set, wxSizerFlags().Border(wxALL));
+            remove_roi = new wxButton(r_panel, wxID_ANY, "Remove ROI");
+            remove_roi->Bind(wxEVT_BUTTON, &frame_t::on_remove_roi, this);
+            roi_sizer->Add(remove_roi, wxSizerFlags().Border(wxALL));
+            sizer->Add(roi_sizer);
+
             for(unsigned i = 0; i < model.color_knobs.size(); i += 1)
             {
                 pal_entry_t* entry = new pal_entry_t(r_panel, model, model.color_knobs[i]);
@@ -660,6 +1072,13 @@ public:
                 pal_entries.push_back(entry);
             }
             r_panel->SetSizer(sizer);
+
+            select_knob_set(0);
+            visual->roi_fn = [this](wxRect const& rect)
+            {
+                if(!model.nes_attributes)
+                    add_roi(rect, {});
+            };
         }
 
         wxPanel* dither_panel = new wxPanel(l_panel);
@@ -673,6 +1092,11 @@ public:
             str.Add("Floyd");
             str.Add("Horizontal");
             str.Add("Van Gogh");
+            str.Add("Atkinson");
+            str.Add("Jarvis");
+            str.Add("Stucki");
+            str.Add("Sierra");
+            str.Add("Custom Diffusion");
             str.Add("Z1");
             str.Add("CZ332");
             str.Add("Brix");
@@ -728,6 +1152,44 @@ public:
             post_panel->SetSizer(sizer);
         }
 
+        wxPanel* nes_panel = new wxPanel(l_panel);
+        {
+            wxBoxSizer* sizer = new wxBoxSizer(wxHORIZONTAL);
+
+            sizer->Add(new wxStaticText(nes_panel, wxID_ANY, "Attributes:"), wxSizerFlags().Border(wxALL));
+            nes_attributes = new wxCheckBox(nes_panel, wxID_ANY, "");
+            nes_attributes->SetValue(model.nes_attributes);
+            nes_attributes->SetToolTip("Limits each 16x16 area to one sub-palette of the whole image's colors. ROIs are ignored.");
+            nes_attributes->Bind(wxEVT_CHECKBOX, &frame_t::on_nes_attributes, this);
+            sizer->Add(nes_attributes, wxSizerFlags().Border(wxALL));
+
+            sizer->Add(new wxStaticText(nes_panel, wxID_ANY, " Refine:"), wxSizerFlags().Border(wxALL));
+            refine_attributes = new wxCheckBox(nes_panel, wxID_ANY, "");
+            refine_attributes->SetValue(model.refine_attributes);
+            refine_attributes->Bind(wxEVT_CHECKBOX, &frame_t::on_refine_attributes, this);
+            sizer->Add(refine_attributes, wxSizerFlags().Border(wxALL));
+
+            sizer->Add(new wxStaticText(nes_panel, wxID_ANY, " Tile Budget:"), wxSizerFlags().Border(wxALL));
+            tile_budget = new wxSpinCtrl(nes_panel);
+            tile_budget->SetRange(0, 4096);
+            tile_budget->SetIncrement(16);
+            tile_budget->SetValue(model.tile_budget);
+            tile_budget->Bind(wxEVT_SPINCTRL, &frame_t::on_tile_budget<wxSpinEvent>, this);
+            tile_budget->Bind(wxEVT_TEXT, &frame_t::on_tile_budget<wxCommandEvent>, this);
+            sizer->Add(tile_budget);
+
+            sizer->Add(new wxStaticText(nes_panel, wxID_ANY, " Optimize ms:"), wxSizerFlags().Border(wxALL));
+            optimize_ms = new wxSpinCtrl(nes_panel);
+            optimize_ms->SetRange(0, 10000);
+            optimize_ms->SetIncrement(100);
+            optimize_ms->SetValue(model.optimize_ms);
+            optimize_ms->Bind(wxEVT_SPINCTRL, &frame_t::on_optimize_ms<wxSpinEvent>, this);
+            optimize_ms->Bind(wxEVT_TEXT, &frame_t::on_optimize_ms<wxCommandEvent>, this);
+            sizer->Add(optimize_ms);
+
+            nes_panel->SetSizer(sizer);
+        }
+
         {
             wxBoxSizer* sizer = new wxBoxSizer(wxVERTICAL);
             sizer->Add(visual, wxSizerFlags().Border(wxALL));
@@ -735,6 +1197,7 @@ public:
             sizer->Add(new wxStaticLine(l_panel));
             sizer->Add(dither_panel, wxSizerFlags().Expand());
             sizer->Add(post_panel, wxSizerFlags().Expand());
+            sizer->Add(nes_panel, wxSizerFlags().Expand());
 
             l_panel->SetSizer(sizer);
         }
@@ -748,8 +1211,19 @@ public:
         Bind(wxEVT_MENU, &frame_t::on_open, this, wxID_OPEN);
         Bind(wxEVT_MENU, &frame_t::on_save, this, wxID_SAVE);
         Bind(wxEVT_MENU, &frame_t::on_save_as, this, wxID_SAVEAS);
+        Bind(wxEVT_MENU, &frame_t::on_png_level, this, ID_PNG_FAST, ID_PNG_SMALL);
+        Bind(wxEVT_MENU, &frame_t::on_png_indexed, this, ID_PNG_INDEXED);
+        Bind(wxEVT_MENU, &frame_t::on_export_chr, this, ID_EXPORT_CHR);
+        Bind(wxEVT_MENU, &frame_t::on_chr_flip, this, ID_CHR_FLIP);
+        Bind(wxEVT_MENU, &frame_t::on_atlas, this, ID_ATLAS);
         Bind(wxEVT_MENU, &frame_t::on_reset, this, wxID_NEW);
         Bind(wxEVT_MENU, &frame_t::on_auto_color, this, ID_AUTO_COLOR);
+        Bind(wxEVT_MENU, &frame_t::on_shared_color, this, ID_SHARED_COLOR);
+        Bind(wxEVT_MENU, &frame_t::on_auto_tune, this, ID_AUTO_TUNE);
+        Bind(wxEVT_MENU, &frame_t::on_variants, this, ID_VARIANTS);
+        Bind(wxEVT_MENU, &frame_t::on_roi_mask, this, ID_ROI_MASK);
+        Bind(wxEVT_MENU, &frame_t::on_undo, this, wxID_UNDO);
+        Bind(wxEVT_MENU, &frame_t::on_redo, this, wxID_REDO);
         Bind(wxEVT_MENU, &frame_t::on_copy, this, wxID_COPY);
         Bind(wxEVT_MENU, &frame_t::on_paste, this, wxID_PASTE);
         Bind(wxEVT_UPDATE_UI, &frame_t::on_update, this);
@@ -764,6 +1238,9 @@ private:
     void on_update(wxUpdateUIEvent&) 
     {
         paste->Enable(!model.display);
+        undo->Enable(model.can_undo());
+        redo->Enable(model.can_redo());
+        roi_mask->Enable(!model.nes_attributes);
     }
 
     void on_exit(wxCommandEvent& event)
@@ -777,12 +1254,28 @@ private:
 
         wxFileDialog open_dialog(
             this, _("Choose a file to open"), wxEmptyString, wxEmptyString, 
-            _("Image (*.png;*.bmp)|*.png;*.bmp"),
+            _("Image (*.png;*.jpg;*.jpeg;*.bmp)|*.png;*.jpg;*.jpeg;*.bmp"),
             wxFD_OPEN, wxDefaultPosition);
 
         if(open_dialog.ShowModal() == wxID_OK) // if the user click "Open" instead of "Cancel"
         {
-            model.base_image.LoadFile(open_dialog.GetPath());
+            std::string const path = open_dialog.GetPath().ToStdString();
+            wxImage image;
+            bool const finished = run_in_background(this, "Opening image", [&](progress_fn_t const& progress)
+            {
+                // Nothing past MAX_SIZE is ever needed, so shrink while decoding:
+                image = load_image(path, MAX_SIZE, MAX_SIZE, progress);
+            });
+
+            if(!finished)
+                return;
+            if(!image.IsOk())
+            {
+                wxLogError("Failed to open %s", path);
+                return;
+            }
+
+            model.set_base_image(image);
             model.update();
             Update();
             Refresh();
@@ -791,7 +1284,7 @@ private:
 
     void on_reset(wxCommandEvent& event)
     {
-        model.color_knobs = {};
+        edited_knobs() = {};
         for(pal_entry_t* e : pal_entries)
             e->manual_update();
         model.update();
@@ -816,9 +1309,258 @@ private:
         }
     }
 
+    // Picks one palette for a whole set of images, weighing each image equally.
+    void on_shared_color(wxCommandEvent& event)
+    {
+        wxFileDialog open_dialog(
+            this, _("Choose images to share a palette"), wxEmptyString, wxEmptyString, 
+            _("Image (*.png;*.jpg;*.jpeg;*.bmp)|*.png;*.jpg;*.jpeg;*.bmp"),
+            wxFD_OPEN | wxFD_MULTIPLE, wxDefaultPosition);
+
+        if(open_dialog.ShowModal() != wxID_OK)
+            return;
+
+        auto_color_dialog_t dlg(this);
+        if(dlg.ShowModal() != wxID_OK)
+            return;
+
+        wxArrayString paths;
+        open_dialog.GetPaths(paths);
+
+        std::vector<color_histogram_t> histograms(paths.size());
+        bool const finished = run_in_background(this, "Reading images", [&](progress_fn_t const& progress)
+        {
+            std::atomic<unsigned> done = 0;
+            thread_pool_t::global().parallel_for(0, paths.size(), [&](unsigned i)
+            {
+                if(progress && !progress(float(done) / paths.size()))
+                    return;
+                histograms[i] = model.histogram_cache.get(paths[i].ToStdString());
+                done += 1;
+            });
+        });
+
+        if(!finished)
+            return;
+
+        std::vector<color_histogram_t const*> read;
+        for(unsigned i = 0; i < histograms.size(); i += 1)
+        {
+            if(histograms[i].empty())
+                wxLogError("Failed to open %s", paths[i]);
+            else
+                read.push_back(&histograms[i]);
+        }
+
+        if(read.empty())
+            return;
+
+        model.auto_color(merge_histograms(read), dlg.count->GetValue(), dlg.map->GetValue());
+        model.update();
+        for(pal_entry_t* e : pal_entries)
+            e->manual_update();
+        Layout();
+        Update();
+        Refresh();
+    }
+
+    // Searches the dither scale and cutoff and the whole image's greeds
+    // for the settings with the least error.
+    void on_auto_tune(wxCommandEvent& event)
+    {
+        if(!model.base_image.IsOk())
+            return;
+
+        wxArrayString metrics;
+        for(char const* name : tune_metric_names)
+            metrics.Add(name);
+        wxSingleChoiceDialog dlg(this, "Measure the error by:", "Auto-Tune Dithering", metrics);
+        if(dlg.ShowModal() != wxID_OK)
+            return;
+
+        // The search gets images of its own, as wxImage reference counts
+        // aren't thread safe. Cancelling keeps the best found so far:
+        auto const start = std::chrono::steady_clock::now();
+        wxImage const base_image = model.base_image.Copy();
+        wxImage const dither_image = model.dither_image().IsOk() ? model.dither_image().Copy() : wxImage();
+        tune_result_t result;
+        run_in_background(this, "Tuning", [&](progress_fn_t const& progress)
+        {
+            result = auto_tune(model, base_image, dither_image, tune_metric_t(dlg.GetSelection()), progress);
+        });
+        std::chrono::duration<double, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+
+        model.dither_scale = result.settings.dither_scale;
+        model.dither_cutoff = result.settings.dither_cutoff;
+        for(unsigned k = 0; k < model.color_knobs.size(); k += 1)
+            model.color_knobs[k].greed = result.settings.color_knobs[k].greed;
+        model.update();
+
+        dither_scale->SetValue(model.dither_scale);
+        dither_cutoff->SetValue(model.dither_cutoff);
+        for(pal_entry_t* e : pal_entries)
+            e->manual_update();
+        model.status_bar->SetStatusText(wxString::Format("Tuned with %u conversions in %.1f ms",
+                                                         result.evaluations, elapsed.count()));
+        Layout();
+        Update();
+        Refresh();
+    }
+
+    void on_variants(wxCommandEvent& event)
+    {
+        if(!model.base_image.IsOk())
+            return;
+
+        wxArrayString style_names;
+        for(unsigned i = 0; i < dither_style->GetCount(); i += 1)
+            style_names.Add(dither_style->GetString(i));
+
+        variant_dialog_t dlg(this, model, style_names);
+        if(dlg.ShowModal() != wxID_OK)
+            return;
+
+        // Variants only differ in these:
+        model.dither_style = dlg.picked.dither_style;
+        for(unsigned k = 0; k < model.color_knobs.size(); k += 1)
+            model.color_knobs[k].greed = dlg.picked.color_knobs[k].greed;
+        model.update();
+
+        dither_style->SetSelection(model.dither_style);
+        for(pal_entry_t* e : pal_entries)
+            e->manual_update();
+        Layout();
+        Update();
+        Refresh();
+    }
+
+    // 0 is the whole image, followed by each ROI.
+    // Attribute mode ignores ROIs, so only the whole image is editable then.
+    void select_knob_set(unsigned index)
+    {
+        if(model.nes_attributes)
+            index = 0;
+
+        knob_set->Clear();
+        knob_set->Append("Whole Image");
+        for(unsigned r = 0; r < model.rois.size(); r += 1)
+            knob_set->Append(wxString::Format("ROI %u", r + 1));
+        knob_set->SetSelection(index);
+        knob_set->Enable(!model.nes_attributes);
+        knob_set->SetToolTip(model.nes_attributes ? "ROIs are ignored while NES attributes are on" : "");
+        remove_roi->Enable(index > 0);
+        visual->selected_roi = int(index) - 1;
+
+        // Adding ROIs can move the others, so this always rebinds:
+        auto& knobs = edited_knobs();
+        for(unsigned i = 0; i < pal_entries.size(); i += 1)
+            pal_entries[i]->set_knob(knobs[i]);
+    }
+
+    std::array<color_knob_t, 16>& edited_knobs()
+    {
+        int const index = knob_set->GetSelection();
+        return index > 0 ? model.rois[index - 1].color_knobs : model.color_knobs;
+    }
+
+    // New ROIs start out with the whole image's knobs.
+    void add_roi(wxRect const& rect, std::vector<bool> mask)
+    {
+        roi_t roi;
+        roi.x = rect.x;
+        roi.y = rect.y;
+        roi.w = rect.width;
+        roi.h = rect.height;
+        roi.mask = std::move(mask);
+        roi.color_knobs = model.color_knobs;
+        model.rois.push_back(std::move(roi));
+
+        select_knob_set(model.rois.size());
+        model.update();
+        Layout();
+        Update();
+        Refresh();
+    }
+
+    void on_knob_set(wxCommandEvent& event)
+    {
+        select_knob_set(knob_set->GetSelection());
+        Layout();
+        Refresh();
+    }
+
+    void on_remove_roi(wxCommandEvent& event)
+    {
+        int const index = knob_set->GetSelection();
+        if(index <= 0)
+            return;
+
+        model.rois.erase(model.rois.begin() + (index - 1));
+        select_knob_set(0);
+        model.update();
+        Layout();
+        Update();
+        Refresh();
+    }
+
+    // Painted ROIs come from an image the size of the output,
+    // where every pixel that isn't black or transparent is part of it.
+    void on_roi_mask(wxCommandEvent& event)
+    {
+        wxFileDialog open_dialog(
+            this, _("Choose a mask image"), wxEmptyString, wxEmptyString, 
+            _("Image (*.png;*.jpg;*.jpeg;*.bmp)|*.png;*.jpg;*.jpeg;*.bmp"),
+            wxFD_OPEN, wxDefaultPosition);
+
+        if(open_dialog.ShowModal() != wxID_OK)
+            return;
+
+        wxImage image;
+        if(!image.LoadFile(open_dialog.GetPath()))
+        {
+            wxLogError("Failed to open %s", open_dialog.GetPath());
+            return;
+        }
+
+        if(image.GetWidth() != model.w || image.GetHeight() != model.h)
+            image.Rescale(model.w, model.h, wxIMAGE_QUALITY_NEAREST);
+
+        auto const painted = [&](int x, int y)
+        {
+            if(image.HasAlpha() && !image.GetAlpha(x, y))
+                return false;
+            return image.GetRed(x, y) || image.GetGreen(x, y) || image.GetBlue(x, y);
+        };
+
+        int x0 = model.w, y0 = model.h, x1 = 0, y1 = 0;
+        for(int y = 0; y < model.h; y += 1)
+        for(int x = 0; x < model.w; x += 1)
+        {
+            if(!painted(x, y))
+                continue;
+            x0 = std::min(x0, x);
+            y0 = std::min(y0, y);
+            x1 = std::max(x1, x + 1);
+            y1 = std::max(y1, y + 1);
+        }
+
+        if(x0 >= x1)
+        {
+            wxLogError("Nothing is painted in %s", open_dialog.GetPath());
+            return;
+        }
+
+        std::vector<bool> mask((x1 - x0) * (y1 - y0));
+        for(int y = y0; y < y1; y += 1)
+        for(int x = x0; x < x1; x += 1)
+            mask[(x - x0) + (y - y0) * (x1 - x0)] = painted(x, y);
+
+        add_roi(wxRect(x0, y0, x1 - x0, y1 - y0), std::move(mask));
+    }
+
     void on_save(wxCommandEvent& event)
     {
-        if(!model.output_image.IsOk())
+        if(!model.output().IsOk())
             return;
 
         if(model.save_path.empty())
@@ -829,7 +1571,7 @@ private:
 
     void on_save_as(wxCommandEvent& event)
     {
-        if(!model.output_image.IsOk())
+        if(!model.output().IsOk())
             return;
 
         wxFileDialog save_dialog(
@@ -845,16 +1587,155 @@ private:
     }
     void do_save(std::string filename)
     {
-        if(!model.output_image.IsOk())
+        // Built here, as the GUI thread owns the model's images:
+        wxImage const& output = model.output();
+        if(!output.IsOk())
         {
             std::fprintf(stderr, "Unable to save %s\n", filename.c_str());
             return;
         }
 
-        if(!model.output_image.SaveFile(filename, wxBITMAP_TYPE_PNG))
+        bool const indexed = model.save_indexed && model.dst_nes.size() == std::size_t(model.w * model.h);
+        std::vector<std::uint8_t> const palette = indexed ? model.palette() : std::vector<std::uint8_t>();
+
+        bool saved = false;
+        bool const finished = run_in_background(this, "Saving image", [&](progress_fn_t const& progress)
+        {
+            if(indexed)
+                saved = save_nes_png(filename, model.w, model.h, model.dst_nes.data(), palette, model.png_level, progress);
+            else
+                saved = save_png(filename, output, model.png_level, progress);
+        });
+
+        if(finished && !saved)
             wxLogError("Failed to save to %s", filename);
     }
 
+    void on_png_level(wxCommandEvent& event)
+    {
+        switch(event.GetId())
+        {
+        case ID_PNG_FAST:   model.png_level = 1; break;
+        case ID_PNG_NORMAL: model.png_level = 6; break;
+        case ID_PNG_SMALL:  model.png_level = 9; break;
+        }
+    }
+
+    void on_png_indexed(wxCommandEvent& event)
+    {
+        model.save_indexed = event.IsChecked();
+    }
+
+    void on_export_chr(wxCommandEvent& event)
+    {
+        if(model.dst_nes.size() != std::size_t(model.w * model.h))
+            return;
+
+        wxFileDialog save_dialog(
+            this, _("Export CHR as"), wxEmptyString, _("unnamed"), 
+            _("CHR Data (*.chr)|*.chr"),
+            wxFD_SAVE | wxFD_OVERWRITE_PROMPT, wxDefaultPosition);
+
+        if(save_dialog.ShowModal() == wxID_CANCEL)
+            return;
+
+        // The nametable and attributes go next to the .chr:
+        std::filesystem::path base = save_dialog.GetPath().ToStdString();
+        base.replace_extension();
+
+        auto const start = std::chrono::steady_clock::now();
+        chr_export_t const chr = export_chr(model.dst_nes.data(), model.w, model.h, model.subpalettes(), 
+                                             model.attributes.empty() ? nullptr : model.attributes.data(), model.chr_flip);
+        std::chrono::duration<double, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+
+        if(chr.tiles.size() > MAX_CHR_TILES)
+        {
+            wxLogError("The image has %u unique tiles, but a nametable can only use %u. "
+                       "Set a tile budget to merge them.", unsigned(chr.tiles.size()), MAX_CHR_TILES);
+            return;
+        }
+
+        if(!write_chr(base.string(), chr, model.chr_flip))
+        {
+            wxLogError("Failed to export %s", base.string());
+            return;
+        }
+
+        wxString report = wxString::Format("Exported %u unique tiles of %u in %.1f ms", 
+                                           unsigned(chr.tiles.size()), unsigned(chr.nametable.size()), elapsed.count());
+        if(chr.mismatched)
+            report += wxString::Format(", %u pixels outside their sub-palette", chr.mismatched);
+        model.status_bar->SetStatusText(report);
+    }
+
+    void on_chr_flip(wxCommandEvent& event)
+    {
+        model.chr_flip = event.IsChecked();
+    }
+
+    // Converts every cell of the open image with its own palette,
+    // saving the image and a .csv of the cell palettes.
+    void on_atlas(wxCommandEvent& event)
+    {
+        if(!model.base_image.IsOk())
+            return;
+
+        atlas_dialog_t dlg(this);
+        if(dlg.ShowModal() != wxID_OK)
+            return;
+
+        wxFileDialog save_dialog(
+            this, _("Save sprite sheet as"), wxEmptyString, _("unnamed.png"), 
+            _("PNG (*.png)|*.png"),
+            wxFD_SAVE | wxFD_OVERWRITE_PROMPT, wxDefaultPosition);
+
+        if(save_dialog.ShowModal() == wxID_CANCEL)
+            return;
+
+        std::filesystem::path const path = save_dialog.GetPath().ToStdString();
+        std::filesystem::path csv_path = path;
+        csv_path.replace_extension(".csv");
+
+        auto const start = std::chrono::steady_clock::now();
+        atlas_t atlas;
+        bool saved = false;
+        bool const finished = run_in_background(this, "Converting sprite sheet", [&](progress_fn_t const& progress)
+        {
+            // Converting is most of the work:
+            atlas = convert_atlas(model, model.base_image, model.dither_image(),
+                                  dlg.cell_w->GetValue(), dlg.cell_h->GetValue(),
+                                  dlg.colors->GetValue(), dlg.map->GetValue(), 
+                                  [&](float amount) { return progress(amount * 0.9f); });
+
+            std::vector<std::uint8_t> palette;
+            std::array<bool, 64> used = {};
+            for(std::uint8_t color : atlas.nes)
+            {
+                if(!used[color])
+                {
+                    used[color] = true;
+                    palette.push_back(color);
+                }
+            }
+
+            saved = (save_nes_png(path.string(), atlas.w, atlas.h, atlas.nes.data(), palette, model.png_level,
+                                  [&](float amount) { return progress(0.9f + amount * 0.1f); })
+                     && write_atlas_palettes(csv_path.string(), atlas));
+        });
+        std::chrono::duration<double, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+
+        if(!finished)
+            return;
+        if(!saved)
+        {
+            wxLogError("Failed to save to %s", path.string());
+            return;
+        }
+
+        model.status_bar->SetStatusText(wxString::Format("Converted %u cells in %.1f ms", 
+                                                         unsigned(atlas.cells.size()), elapsed.count()));
+    }
+
     template<typename T>
     void on_change_w(T& event)
     {
@@ -880,7 +1761,6 @@ private:
     void on_change_display(wxCommandEvent& event)
     {
         model.display = display_checkbox->GetValue();
-        model.update();
         Layout();
         Update();
         Refresh();
@@ -922,6 +1802,51 @@ private:
         Refresh();
     }
 
+    void on_nes_attributes(wxCommandEvent& event)
+    {
+        model.nes_attributes = nes_attributes->GetValue();
+        select_knob_set(std::max(knob_set->GetSelection(), 0));
+        model.update();
+        Layout();
+        Update();
+        Refresh();
+    }
+
+    void on_refine_attributes(wxCommandEvent& event)
+    {
+        model.refine_attributes = refine_attributes->GetValue();
+        model.update();
+        Layout();
+        Update();
+        Refresh();
+    }
+
+    template<typename T>
+    void on_tile_budget(T& event)
+    {
+        if(model.tile_budget != tile_budget->GetValue())
+        {
+            model.tile_budget = tile_budget->GetValue();
+            model.update();
+            Layout();
+            Update();
+            Refresh();
+        }
+    }
+
+    template<typename T>
+    void on_optimize_ms(T& event)
+    {
+        if(model.optimize_ms != optimize_ms->GetValue())
+        {
+            model.optimize_ms = optimize_ms->GetValue();
+            model.update();
+            Layout();
+            Update();
+            Refresh();
+        }
+    }
+
     void on_dither_style(wxCommandEvent& event)
     {
         if((dither_style_t)event.GetSelection() == DITHER_CUSTOM)
@@ -937,6 +1862,23 @@ private:
             goto selected;
         }
 
+        if((dither_style_t)event.GetSelection() == DITHER_CUSTOM_DIFFUSION)
+        {
+            wxFileDialog open_dialog(
+                this, _("Choose a diffusion kernel to open"), wxEmptyString, wxEmptyString, 
+                _("Kernel (*.txt)|*.txt|All files|*"),
+                wxFD_OPEN, wxDefaultPosition);
+
+            if(open_dialog.ShowModal() == wxID_OK)
+            {
+                std::string error;
+                if(!load_diffusion_kernel(open_dialog.GetPath().ToStdString(), model.custom_diffusion, error))
+                    wxLogError("%s", error);
+            }
+
+            goto selected;
+        }
+
         if(model.dither_style != (dither_style_t)event.GetSelection())
         {
         selected:
@@ -973,11 +1915,49 @@ private:
         }
     }
 
+    void on_undo(wxCommandEvent& event)
+    {
+        if(model.undo())
+            sync_controls();
+    }
+
+    void on_redo(wxCommandEvent& event)
+    {
+        if(model.redo())
+            sync_controls();
+    }
+
+    // Shows the model's settings in every control, after they changed
+    // from outside of them.
+    void sync_controls()
+    {
+        w_ctrl->SetValue(model.w);
+        h_ctrl->SetValue(model.h);
+        cull_dots->SetValue(model.cull_dots);
+        cull_pipes->SetValue(model.cull_pipes);
+        cull_zags->SetValue(model.cull_zags);
+        clean_lines->SetValue(model.clean_lines);
+        nes_attributes->SetValue(model.nes_attributes);
+        refine_attributes->SetValue(model.refine_attributes);
+        tile_budget->SetValue(model.tile_budget);
+        optimize_ms->SetValue(model.optimize_ms);
+        dither_style->SetSelection(model.dither_style);
+        dither_scale->SetValue(model.dither_scale);
+        dither_cutoff->SetValue(model.dither_cutoff);
+
+        // ROIs may have come or gone:
+        select_knob_set(std::min<unsigned>(std::max(knob_set->GetSelection(), 0), model.rois.size()));
+
+        Layout();
+        Update();
+        Refresh();
+    }
+
     void on_copy(wxCommandEvent& event)
     {
         if(wxTheClipboard && wxTheClipboard->Open())
         {
-            wxBitmap& bitmap = model.display ? model.output_bitmap : model.base_bitmap;
+            wxBitmap const& bitmap = model.view();
             if(bitmap.IsOk())
             {
                 wxTheClipboard->SetData(new wxBitmapDataObject(bitmap));
@@ -995,7 +1975,7 @@ private:
             {
                 wxBitmapDataObject data;
                 if(wxTheClipboard->GetData(data))
-                    model.base_image = data.GetBitmap().ConvertToImage();
+                    model.set_base_image(data.GetBitmap().ConvertToImage());
 
                 model.update();
                 Layout();
@@ -1006,8 +1986,11 @@ private:
         }
     }
 
+    wxMenuItem* undo;
+    wxMenuItem* redo;
     wxMenuItem* copy;
     wxMenuItem* paste;
+    wxMenuItem* roi_mask;
 
     visual_t* visual;
     wxSpinCtrl* w_ctrl;
@@ -1017,7 +2000,13 @@ private:
     wxCheckBox* cull_pipes;
     wxCheckBox* cull_zags;
     wxCheckBox* clean_lines;
+    wxCheckBox* nes_attributes;
+    wxCheckBox* refine_attributes;
+    wxSpinCtrl* tile_budget;
+    wxSpinCtrl* optimize_ms;
     std::vector<pal_entry_t*> pal_entries;
+    wxChoice* knob_set;
+    wxButton* remove_roi;
 
     wxChoice* dither_style;
     wxSlider* dither_scale;
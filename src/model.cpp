@@ -1,15 +1,48 @@
 #include "model.hpp"
 
+#include <cstdlib>
+
 #include <wx/mstream.h>
 
-#include "flat/flat_map.hpp"
-#include "flat/flat_set.hpp"
+#include "cleanup.hpp"
+#include "history.hpp"
+#include "optimize.hpp"
+#include "resample.hpp"
+#include "session.hpp"
+#include "thread_pool.hpp"
 
 #include "z1.png.inc"
 #include "cz332.png.inc"
 #include "brix.png.inc"
 #include "custom.png.inc"
 
+namespace
+{
+
+// The built-in kernel of each diffusion style:
+template<dither_style_t STYLE>
+constexpr auto const& style_kernel()
+{
+    if constexpr(STYLE == DITHER_WAVES)
+        return WAVES_KERNEL;
+    else if constexpr(STYLE == DITHER_FLOYD)
+        return FLOYD_KERNEL;
+    else if constexpr(STYLE == DITHER_HORIZONTAL)
+        return HORIZONTAL_KERNEL;
+    else if constexpr(STYLE == DITHER_VAN_GOGH)
+        return VAN_GOGH_KERNEL;
+    else if constexpr(STYLE == DITHER_ATKINSON)
+        return ATKINSON_KERNEL;
+    else if constexpr(STYLE == DITHER_JJN)
+        return JJN_KERNEL;
+    else if constexpr(STYLE == DITHER_STUCKI)
+        return STUCKI_KERNEL;
+    else if constexpr(STYLE == DITHER_SIERRA)
+        return SIERRA_KERNEL;
+}
+
+} // namespace
+
 model_t::model_t()
 {
     constexpr unsigned W = 16;
@@ -38,8 +71,19 @@ model_t::model_t()
     wxImage image(W, H, alloc);
     color_bitmaps[64] = wxBitmap(image);
 
-    // Read the dithers:
- 
+    dither_images = builtin_dither_images();
+
+    history = std::make_unique<history_t>();
+    result_cache = std::make_unique<result_cache_t>();
+
+    if(char const* env = std::getenv("PIXELER_RECORD"))
+        recorder = std::make_unique<session_recorder_t>(env);
+}
+
+model_t::~model_t() = default;
+
+std::array<wxImage, NUM_MASK_DITHERS> builtin_dither_images()
+{
     auto const make_img = [&](char const* name, unsigned char const* data, std::size_t size) -> wxImage
     {
         wxMemoryInputStream stream(data, size);
@@ -49,55 +93,228 @@ model_t::model_t()
         return img;
     };
 
+    std::array<wxImage, NUM_MASK_DITHERS> images;
 #define MAKE_IMG(x) make_img(#x, x, x##_size)
-    dither_images[0] = MAKE_IMG(dither_z1_png);
-    dither_images[1] = MAKE_IMG(dither_cz332_png);
-    dither_images[2] = MAKE_IMG(dither_brix_png);
+    images[0] = MAKE_IMG(dither_z1_png);
+    images[1] = MAKE_IMG(dither_cz332_png);
+    images[2] = MAKE_IMG(dither_brix_png);
+#undef MAKE_IMG
+    return images;
 }
 
 void model_t::update()
 {
+    if(recorder)
+        recorder->begin();
+
+    history->push(*this);
+
     if(!base_image.IsOk())
         return;
 
-    // Create the picker image
-    picker_image = base_image.Copy();
-    if(picker_image.IsOk())
+    std::vector<std::uint8_t> const previous = output_image.IsOk() ? dst_nes : std::vector<std::uint8_t>();
+
+    // Settings seen recently, as after an undo, get their result back:
+    result_cache_t::result_t const* cached = result_cache->find(*this, base_image, dither_image());
+    if(cached && quality.want_error_map && cached->quality.error_map.empty())
+        cached = nullptr;
+    if(cached)
     {
-        picker_image.Rescale(512, 512, wxIMAGE_QUALITY_NEAREST);
-        picker_bitmap = wxBitmap(picker_image);
+        stage_times = {};
+        dst_nes = cached->dst_nes;
+        attributes = cached->attributes;
+        bool const want_error_map = quality.want_error_map;
+        quality = cached->quality;
+        quality.want_error_map = want_error_map;
     }
     else
-        std::fprintf(stderr, "Bad picker image\n");
+    {
+        convert(base_image, dither_image(), dst_nes, attributes, &convert_cache, &stage_times, &quality);
+        result_cache->add(*this, base_image, dither_image(), { dst_nes, attributes, quality });
+    }
+    stage_timer_t write_timer(&stage_times, STAGE_WRITE_OUT);
+
+    // Images and bitmaps are only rebuilt when something shows or saves them:
+    base_bitmap = wxBitmap();
+    output_bitmap = wxBitmap();
+
+    // But an existing output image only needs the pixels that changed,
+    // which after an ROI edit are few:
+    if(previous.size() != dst_nes.size() || output_image.GetWidth() != w || output_image.GetHeight() != h)
+    {
+        output_image = wxImage();
+        write_timer.stop();
+        report_times();
+        if(recorder)
+            recorder->record(*this, base_image, dither_images.back());
+        return;
+    }
+
+    unsigned char* const dst_ptr = output_image.GetData();
+    for(std::size_t i = 0; i < dst_nes.size(); i += 1)
+    {
+        if(dst_nes[i] == previous[i])
+            continue;
+        dst_ptr[i*3+0] = nes_colors[dst_nes[i]].r;
+        dst_ptr[i*3+1] = nes_colors[dst_nes[i]].g;
+        dst_ptr[i*3+2] = nes_colors[dst_nes[i]].b;
+    }
+
+    write_timer.stop();
+    report_times();
+    if(recorder)
+        recorder->record(*this, base_image, dither_images.back());
+}
+
+void model_t::report_times()
+{
+    if(!status_bar)
+        return;
+
+    wxString report = wxString::Format("Update took %.1f ms:", stage_times.total_ms());
+    for(unsigned i = 0; i < NUM_STAGES; i += 1)
+        if(stage_times.ms[i] >= 0.05)
+            report += wxString::Format(" %s %.1f", stage_names[i], stage_times.ms[i]);
+    status_bar->SetStatusText(report);
+
+    if(status_bar->GetFieldsCount() > 1)
+    {
+        status_bar->SetStatusText(wxString::Format("Error %.1f mean, %.0f max, PSNR %.1f dB, SSIM %.3f",
+                                                   quality.mean_error, quality.max_error, quality.psnr, quality.ssim), 1);
+    }
+}
+
+bool model_t::undo()
+{
+    if(!history->undo(*this))
+        return false;
+    update();
+    return true;
+}
+
+bool model_t::redo()
+{
+    if(!history->redo(*this))
+        return false;
+    update();
+    return true;
+}
+
+bool model_t::can_undo() const { return history->can_undo(); }
+bool model_t::can_redo() const { return history->can_redo(); }
+
+void model_t::set_base_image(wxImage const& image)
+{
+    base_image = image;
+    result_cache->clear();
+    picker_image = wxImage();
+    picker_bitmap = wxBitmap();
+}
+
+wxImage const& model_t::picker()
+{
+    if(!picker_image.IsOk() && base_image.IsOk())
+    {
+        stage_timer_t const timer(&stage_times, STAGE_PICKER);
+        picker_image = base_image.Scale(512, 512, wxIMAGE_QUALITY_NEAREST);
+    }
+    return picker_image;
+}
 
-    // Scale the base image:
-    wxImage scaled = base_image.Copy();
-    if(scaled.IsOk())
+wxBitmap const& model_t::picker_view()
+{
+    if(!picker_bitmap.IsOk() && picker().IsOk())
     {
-        scaled.Rescale(w, h, wxIMAGE_QUALITY_BOX_AVERAGE);
-        base_bitmap = wxBitmap(scaled);
+        stage_timer_t const timer(&stage_times, STAGE_BITMAP);
+        picker_bitmap = wxBitmap(picker_image);
+    }
+    return picker_bitmap;
+}
+
+wxImage const& model_t::output()
+{
+    if(output_image.IsOk() || dst_nes.size() != std::size_t(w * h))
+        return output_image;
+
+    stage_timer_t const timer(&stage_times, STAGE_WRITE_OUT);
+    output_image = wxImage(w, h, false);
+    if(!output_image.IsOk())
+    {
+        std::fprintf(stderr, "Bad output image\n");
+        return output_image;
+    }
 
-        output_image = scaled.Copy();
-        if(!output_image.IsOk())
+    unsigned char* const dst_ptr = output_image.GetData();
+    for(std::size_t i = 0; i < dst_nes.size(); i += 1)
+    {
+        dst_ptr[i*3+0] = nes_colors[dst_nes[i]].r;
+        dst_ptr[i*3+1] = nes_colors[dst_nes[i]].g;
+        dst_ptr[i*3+2] = nes_colors[dst_nes[i]].b;
+    }
+
+    return output_image;
+}
+
+wxBitmap const& model_t::view()
+{
+    if(display)
+    {
+        if(!output_bitmap.IsOk() && output().IsOk())
         {
-            std::fprintf(stderr, "Bad output image\n");
-            return;
+            {
+                stage_timer_t const timer(&stage_times, STAGE_BITMAP);
+                output_bitmap = wxBitmap(output_image);
+            }
+            report_times();
         }
+        return output_bitmap;
     }
-    else
+
+    if(!base_bitmap.IsOk() && base_image.IsOk())
     {
-        std::fprintf(stderr, "Bad scaled image\n");
-        return;
+        // Scale the base image:
+        wxImage scaled(w, h, false);
+        if(scaled.IsOk())
+        {
+            {
+                stage_timer_t const timer(&stage_times, STAGE_VIEW_RESAMPLE);
+                resample_box(base_image.GetData(), base_image.GetWidth(), base_image.GetHeight(), scaled.GetData(), w, h);
+            }
+            {
+                stage_timer_t const timer(&stage_times, STAGE_BITMAP);
+                base_bitmap = wxBitmap(scaled);
+            }
+            report_times();
+        }
+        else
+            std::fprintf(stderr, "Bad scaled image\n");
     }
+    return base_bitmap;
+}
 
-    // Temporary output:
-    if(output_image.IsOk())
-        output_bitmap = wxBitmap(output_image);
-    else
-        std::fprintf(stderr, "Bad output bitmap\n");
+knob_set_t::knob_set_t(std::array<color_knob_t, SIZE> const& knobs)
+: knobs(knobs.data())
+{
+    for(unsigned k = 0; k < SIZE; k += 1)
+    {
+        greeds[k] = knobs[k].greedf();
+        bleeds[k] = knobs[k].bleedf();
+    }
+}
+
+wxImage const& model_t::dither_image() const
+{
+    return dither_images[std::max(dither_style, FIRST_MASK) - FIRST_MASK];
+}
+
+void settings_t::convert(wxImage const& base_image, wxImage const& dither_image,
+                         std::vector<std::uint8_t>& dst_nes, std::vector<std::uint8_t>& attributes,
+                         convert_cache_t* cache, stage_times_t* times, quality_t* quality) const
+{
+    if(times)
+        *times = {};
 
     // Dither size
-    auto const& dither_image = dither_images[std::max(dither_style, FIRST_MASK) - FIRST_MASK];
     unsigned const dw = dither_image.GetWidth();  // dither width
     unsigned const dh = dither_image.GetHeight(); // dither height
 
@@ -108,23 +325,66 @@ void model_t::update()
     unsigned rw = std::max<unsigned>(1, bw / w); // region width
     unsigned rh = std::max<unsigned>(1, bh / h); // region height
 
-    scaled = base_image.Copy();
-    scaled.Rescale(rw * w, rh * h);
+    bool const same_source = cache && cache->base_image.IsOk()
+                             && cache->base_image.GetData() == base_image.GetData()
+                             && cache->settings.w == w && cache->settings.h == h;
+    if(cache && !same_source)
+        cache->target.clear();
+
+    // Regions need a source of exactly rw*w by rh*h pixels:
+    std::vector<unsigned char> local_scaled;
+    std::vector<unsigned char>& scaled = cache ? cache->scaled : local_scaled;
+    unsigned char const* src_ptr = base_image.GetData();
+    if(bw != rw * w || bh != rh * h)
+    {
+        if(!same_source || scaled.empty())
+        {
+            stage_timer_t const timer(times, STAGE_RESAMPLE);
+            scaled.resize(std::size_t(rw * w) * (rh * h) * 3);
+            resample_box(src_ptr, bw, bh, scaled.data(), rw * w, rh * h);
+        }
+        src_ptr = scaled.data();
+        bw = rw * w;
+        bh = rh * h;
+    }
 
-    bw = scaled.GetWidth();
-    bh = scaled.GetHeight();
+    // The source averaged to output size, for optimize_dither() and the metrics:
+    std::vector<rgb_t> local_target;
+    auto const output_target = [&]() -> std::vector<rgb_t> const&
+    {
+        std::vector<rgb_t>& target = cache ? cache->target : local_target;
+        if(target.size() != std::size_t(w) * h)
+        {
+            target.resize(std::size_t(w) * h);
+            resample_box(src_ptr, bw, bh, reinterpret_cast<unsigned char*>(target.data()), w, h);
+        }
+        return target;
+    };
 
     // Then identify the best color set for each 8x8 region:
 
     std::vector<qerr_t> qerrs(w * h);
-    std::vector<float> color_scores;
+    custom_diffuser_t const custom_diffuser(custom_diffusion, w, h);
     std::vector<float> region_scores;
     std::vector<qerr_t> region_q;
     std::vector<int> region_q_count;
-    unsigned char* const src_ptr = scaled.GetData();
-    unsigned char* const dst_ptr = output_image.GetData();
+
+    // The best knob of a source color within the current region:
+    struct scored_color_t
+    {
+        rgb_t color;
+        unsigned knob;
+        float score;
+        qerr_t q;
+    };
+
+    // Past this many unique colors, a region is likely a gradient or noise,
+    // and searching the list costs more than it saves:
+    constexpr unsigned MAX_REGION_COLORS = 16;
+    std::vector<scored_color_t> region_colors;
+    region_colors.reserve(MAX_REGION_COLORS);
     unsigned char* const dither_ptr = dither_image.GetData();
-    std::vector<std::uint8_t> dst_nes(w * h);
+    dst_nes.assign(w * h, 0);
 
     auto const at_dst_nes = [&](int x, int y) -> std::uint8_t&
     {
@@ -140,620 +400,827 @@ void model_t::update()
         return rgb_t{ src_ptr[i+0], src_ptr[i+1], src_ptr[i+2] };
     };
 
-    auto const set_dst = [&](unsigned x, unsigned y, rgb_t color)
+    dither_mask_t const dither_mask = { dither_ptr, dw, dh, iscale };
+
+    // The knobs of the whole image come first, then those of each ROI.
+    // Attribute mode ignores ROIs, as every pixel of a 16x16 area has to
+    // come from the whole image's sub-palette of that area:
+    unsigned const roi_count = nes_attributes ? 0 : std::min<std::size_t>(rois.size(), MAX_ROIS);
+    std::vector<knob_set_t> knob_sets;
+    knob_sets.reserve(1 + roi_count);
+    knob_sets.emplace_back(color_knobs);
+    for(unsigned r = 0; r < roi_count; r += 1)
+        knob_sets.emplace_back(rois[r].color_knobs);
+
+    // Which knob set each output pixel uses. Later ROIs win:
+    std::vector<std::uint8_t> roi_map;
+    if(roi_count)
     {
-        unsigned i = (x+y*w)*3;
-        dst_ptr[i+0] = color.r;
-        dst_ptr[i+1] = color.g;
-        dst_ptr[i+2] = color.b;
-    };
+        roi_map.assign(w * h, 0);
+        for(unsigned r = 0; r < roi_count; r += 1)
+        {
+            roi_t const& roi = rois[r];
+            for(int py = std::max(roi.y, 0); py < std::min(roi.y + roi.h, h); py += 1)
+            for(int px = std::max(roi.x, 0); px < std::min(roi.x + roi.w, w); px += 1)
+                if(roi.contains(px, py))
+                    roi_map[px + py*w] = r + 1;
+        }
+    }
 
-    auto const get_dither = [&](unsigned x, unsigned y) -> rgb_t
+    auto const knobs_at = [&](int px, int py) -> knob_set_t const&
     {
-        unsigned i = ((x % dw)+(y % dh)*dw)*3;
-        return rgb_t{ dither_ptr[i+0], dither_ptr[i+1], dither_ptr[i+2] };
+        return knob_sets[roi_map.empty() ? 0 : roi_map[px + py*w]];
     };
 
-    auto const get_dither_lerp = [&](unsigned x, unsigned y) -> rgb_t
+    auto const dither_offset = [&](auto style, int px, int py) -> dither_offset_t
     {
-        float fx = float(x) / (iscale);
-        float fy = float(y) / (iscale);
+        constexpr dither_style_t STYLE = decltype(style)::value;
 
-        float dx = std::fmod(fx, 1.0f);
-        float dy = std::fmod(fy, 1.0f);
-
-        x = std::floor(fx);
-        y = std::floor(fy);
-
-        rgb_t nw = get_dither(x+0, y+0);
-        rgb_t ne = get_dither(x+1, y+0);
-        rgb_t sw = get_dither(x+0, y+1);
-        rgb_t se = get_dither(x+1, y+1);
-
-        rgb_t n, s;
+        if constexpr(STYLE == DITHER_NONE)
+            return {};
+        else if constexpr(STYLE <= LAST_DIFFUSION)
+        {
+            qerr_t const& e = qerrs[px + py*w];
+            return { e.r * dscale, e.g * dscale, e.b * dscale };
+        }
+        else
+        {
+            rgb_t d = dither_mask.lerp(px, py);
+            float s = (40 - dither_scale) / 40.0f;
+            return { std::round(float(int(d.r) - 128) * s),
+                     std::round(float(int(d.g) - 128) * s),
+                     std::round(float(int(d.b) - 128) * s) };
+        }
+    };
 
-        n.r = nw.r*(1.0f - dx) + ne.r*dx;
-        n.g = nw.g*(1.0f - dx) + ne.g*dx;
-        n.b = nw.b*(1.0f - dx) + ne.b*dx;
+    // The error of mapping source color 'src' to map color 'i' of knob 'k':
+    auto const candidate_q = [&](auto style, knob_set_t const& set, unsigned k, unsigned i,
+                                 rgb_t src, dither_offset_t const& offset) -> qerr_t
+    {
+        return set.candidate_q<decltype(style)::value != DITHER_NONE>(k, i, src, offset);
+    };
 
-        s.r = sw.r*(1.0f - dx) + se.r*dx;
-        s.g = sw.g*(1.0f - dx) + se.g*dx;
-        s.b = sw.b*(1.0f - dx) + se.b*dx;
+    // In attribute mode, each 16x16 area may only use the background knob
+    // plus the three knobs of its sub-palette:
+    unsigned const aw = (w + 15) / 16; // attribute width
+    unsigned const ah = (h + 15) / 16; // attribute height
+    std::array<std::uint16_t, NUM_SUBPALETTES> group_knobs;
+    for(unsigned g = 0; g < group_knobs.size(); g += 1)
+        group_knobs[g] = 1 | (0b111 << (1 + g*3));
 
-        rgb_t a;
-        a.r = n.r*(1.0f - dy) + s.r*dy;
-        a.g = n.g*(1.0f - dy) + s.g*dy;
-        a.b = n.b*(1.0f - dy) + s.b*dy;
+    if(nes_attributes)
+        attributes.assign(aw * ah, 0);
+    else
+        attributes.clear();
 
-        return a;
+    auto const allowed_knobs = [&](int px, int py) -> std::uint16_t
+    {
+        if(!nes_attributes)
+            return 0xFFFF;
+        return group_knobs[attributes[px / 16 + (py / 16) * aw]];
     };
 
-    for(int py = 0; py < h; py += 1)
-    for(int px = 0; px < w; px += 1)
+    // Gives each 16x16 area the sub-palette with the least error over its source pixels:
+    auto const solve_attributes = [&](auto style)
     {
-        region_scores.clear();
-        region_scores.resize(color_knobs.size());
-
-        region_q.clear();
-        region_q.resize(color_knobs.size());
-
-        region_q_count.clear();
-        region_q_count.resize(color_knobs.size());
-
-        for(int sy = py * rh; sy < std::min<int>(py * rh + rh, bh); sy += 1)
-        for(int sx = px * rw; sx < std::min<int>(px * rw + rw, bw); sx += 1)
+        stage_timer_t const timer(times, STAGE_ATTRIBUTES);
+        thread_pool_t::global().parallel_for(0, aw * ah, [&](unsigned a)
         {
-            color_scores.clear();
-            color_scores.resize(color_knobs.size() * MAP_SIZE, INFINITY);
-
-            float score = INFINITY;
-            unsigned best_knob = 0;
-            qerr_t best_q = {};
+            int const ax = a % aw;
+            int const ay = a / aw;
+            std::array<float, NUM_SUBPALETTES> errors = {};
 
-            for(unsigned k = 0; k < color_knobs.size(); k += 1)
+            for(int py = ay * 16; py < std::min<int>(ay * 16 + 16, h); py += 1)
+            for(int px = ax * 16; px < std::min<int>(ax * 16 + 16, w); px += 1)
             {
-                auto const& knob = color_knobs[k];
-
-                if(knob.nes_color >= 64)
-                    continue;
+                dither_offset_t const offset = dither_offset(style, px, py);
+                knob_set_t const& set = knobs_at(px, py);
 
-                for(unsigned i = 0; i < knob.map_colors.size(); i += 1)
+                for(int sy = py * rh; sy < std::min<int>(py * rh + rh, bh); sy += 1)
+                for(int sx = px * rw; sx < std::min<int>(px * rw + rw, bw); sx += 1)
                 {
-                    if(!knob.map_enable[i])
-                        continue;
+                    rgb_t const src = get_src(sx, sy);
+                    std::array<float, 1 + NUM_SUBPALETTES * 3> knob_dists;
+                    knob_dists.fill(INFINITY);
 
-                    qerr_t q = qerr(knob.map_colors[i], get_src(sx, sy));
+                    for(unsigned k = 0; k < knob_dists.size(); k += 1)
+                    {
+                        auto const& knob = set.knobs[k];
 
-                    q.r *= knob.greedf();
-                    q.g *= knob.greedf();
-                    q.b *= knob.greedf();
+                        if(knob.nes_color >= 64)
+                            continue;
 
-                    if(dither_style)
-                    {
-                        if(dither_style <= LAST_DIFFUSION)
-                        {
-                            q.r += qerrs[px + py*w].r * dscale;
-                            q.g += qerrs[px + py*w].g * dscale;
-                            q.b += qerrs[px + py*w].b * dscale;
-                        }
-                        else if(dither_image.IsOk())
-                        {
-                            rgb_t d = get_dither_lerp(px, py);
-                            float s = (40 - dither_scale) / 40.0f;
-                            q.r += std::round(float(int(d.r) - 128) * s);
-                            q.g += std::round(float(int(d.g) - 128) * s);
-                            q.b += std::round(float(int(d.b) - 128) * s);
-                        }
+                        for(unsigned i = 0; i < knob.map_colors.size(); i += 1)
+                            if(knob.map_enable[i])
+                                knob_dists[k] = std::min(knob_dists[k], distance(candidate_q(style, set, k, i, src, offset)));
                     }
 
-                    float const dist = distance(q);
-
-                    float new_score = std::min<float>(score, dist);
-                    if(new_score < score)
+                    for(unsigned g = 0; g < errors.size(); g += 1)
                     {
-                        score = new_score;
-                        best_knob = k;
-                        best_q = q;
+                        float dist = knob_dists[0];
+                        for(unsigned k = 1 + g*3; k < 4 + g*3; k += 1)
+                            dist = std::min(dist, knob_dists[k]);
+                        // Unusable groups still need a finite, comparable error:
+                        errors[g] += std::min(dist, 1000.0f);
                     }
                 }
             }
 
-            region_scores[best_knob] += color_knobs[best_knob].bleedf() / std::max<float>(score, 1);
-            region_q[best_knob].r += best_q.r;
-            region_q[best_knob].g += best_q.g;
-            region_q[best_knob].b += best_q.b;
-            region_q_count[best_knob] += 1;
-        }
+            attributes[a] = std::ranges::min_element(errors) - errors.begin();
+        });
+    };
 
-        auto it = std::ranges::max_element(region_scores.begin(), region_scores.end());
-        unsigned const best_index = it - region_scores.begin();
-        color_knob_t const& best_knob = color_knobs[best_index];
+    // Output pixels from (x0, y0) up to, but not including, (x1, y1):
+    struct window_t
+    {
+        int x0 = 0;
+        int y0 = 0;
+        int x1 = 0;
+        int y1 = 0;
 
-        if(best_knob.nes_color < 64)
-        {
-            at_dst_nes(px, py) = best_knob.nes_color;
+        bool empty() const { return x0 >= x1 || y0 >= y1; }
+        bool contains(int x, int y) const { return x >= x0 && x < x1 && y >= y0 && y < y1; }
+    };
+    window_t const whole = { 0, 0, w, h };
 
-            if(dither_style)
-            {
-                // Calculate the average error:
-                qerr_t q = region_q[best_index];
-                q.r /= region_q_count[best_index];
-                q.g /= region_q_count[best_index];
-                q.b /= region_q_count[best_index];
-
-                if(std::abs(q.r) < dither_cutoff * 8)
-                    q.r = 0;
-                if(std::abs(q.g) < dither_cutoff * 8)
-                    q.g = 0;
-                if(std::abs(q.b) < dither_cutoff * 8)
-                    q.b = 0;
-
-                auto const distribute = [&](int x, int y, float scale)
-                {
-                    x += px;
-                    y += py;
-                    if(x < 0 || x >= w || y < 0 || y >= h)
-                        return;
-                    qerrs[x + y*w].r += q.r * scale;
-                    qerrs[x + y*w].g += q.g * scale;
-                    qerrs[x + y*w].b += q.b * scale;
-                };
+    // Quantizes the output pixels within 'window'. Error is only carried
+    // within the window, so smaller windows need a margin to settle:
+    auto const quantize = [&](auto style, window_t const& window)
+    {
+        constexpr dither_style_t STYLE = decltype(style)::value;
+        constexpr bool DIFFUSE = STYLE != DITHER_NONE && STYLE <= LAST_DIFFUSION;
+        stage_timer_t const timer(times, STAGE_QUANTIZE);
 
-                auto const distribute_chunky = [&](int x, int y, float scale)
-                {
-                    for(int i = 0; i < 2; i += 1)
-                    for(int j = 0; j < 2; j += 1)
-                        distribute(x*2 + i, y*2 + j, scale * 0.25);
-                };
+        std::fill(qerrs.begin(), qerrs.end(), qerr_t{});
 
-                // Diffuse the error:
-                switch(dither_style)
-                {
-                default:
-                    break;
-                case DITHER_WAVES:
-                    distribute(0, 1, 0.75);
-                    distribute(1, 1, 0.25);
-                    break;
-                case DITHER_FLOYD:
-                    distribute( 1, 0, 7.0 / 16.0);
-                    distribute(-1, 1, 3.0 / 16.0);
-                    distribute( 0, 1, 5.0 / 16.0);
-                    distribute( 0, 2, 1.0 / 16.0);
-                    break;
-                case DITHER_HORIZONTAL:
-                    if(py & 1)
-                    {
-                        distribute(0, 1, 0.75);
-                        distribute(1, 1, 0.25);
-                    }
-                    else
-                    {
-                        distribute(1, 0, 0.25);
-                        distribute(2, 0, 0.75);
-                    }
-                    break;
-                case DITHER_VAN_GOGH:
-                    distribute_chunky( 1, 0, 7.0 / 16.0);
-                    distribute_chunky(-1, 1, 3.0 / 16.0);
-                    distribute_chunky( 0, 1, 5.0 / 16.0);
-                    distribute_chunky( 0, 2, 1.0 / 16.0);
-                    break;
-                }
-            }
-        }
-    }
+        bool serpentine = false;
+        if constexpr(STYLE == DITHER_CUSTOM_DIFFUSION)
+            serpentine = custom_diffusion.serpentine;
+        else if constexpr(DIFFUSE)
+            serpentine = style_kernel<STYLE>().serpentine;
 
-    // Cellular automata:
-    for(int i = 0; i < 1; i += 1)
-    {
-        if(cull_zags)
+        for(int py = window.y0; py < window.y1; py += 1)
+        for(int x = window.x0; x < window.x1; x += 1)
         {
-            for(int py = 0; py < h - 1; py += 1)
-            for(int px = 0; px < w - 2; px += 1)
-            {
-                std::uint8_t tl = at_dst_nes(px+0, py+0);
-                std::uint8_t tc = at_dst_nes(px+1, py+0);
-                std::uint8_t tr = at_dst_nes(px+2, py+0);
-                std::uint8_t bl = at_dst_nes(px+0, py+1);
-                std::uint8_t bc = at_dst_nes(px+1, py+1);
-                std::uint8_t br = at_dst_nes(px+2, py+1);
-
-                if(tc == bc)
-                    continue;
+            // Serpentine kernels run odd rows backwards:
+            bool const reverse = serpentine && (py & 1);
+            int const px = reverse ? window.x0 + window.x1 - 1 - x : x;
 
-                int eq = 0;
-                eq += tl == bc;
-                eq += bl == tc;
-                eq += tr == bc;
-                eq += br == tc;
+            region_scores.clear();
+            region_scores.resize(color_knobs.size());
 
-                eq += tl != tc;
-                eq += bl != bc;
-                eq += tr != tc;
-                eq += br != bc;
-
-                if(eq < 7)
-                    continue;
+            if constexpr(DIFFUSE)
+            {
+                region_q.clear();
+                region_q.resize(color_knobs.size());
 
-                std::swap(at_dst_nes(px+1, py+0), at_dst_nes(px+1, py+1));
+                region_q_count.clear();
+                region_q_count.resize(color_knobs.size());
             }
-        }
 
-        if(cull_dots)
-        {
-            fc::vector_map<std::uint8_t, int> c_map;
-            std::vector<std::uint8_t> new_nes = dst_nes;
+            region_colors.clear();
+            std::uint16_t const allowed = allowed_knobs(px, py);
+            dither_offset_t const offset = dither_offset(style, px, py);
+            knob_set_t const& set = knobs_at(px, py);
 
-            for(int py = 0; py < h; py += 1)
-            for(int px = 0; px < w; px += 1)
+            for(int sy = py * rh; sy < std::min<int>(py * rh + rh, bh); sy += 1)
+            for(int sx = px * rw; sx < std::min<int>(px * rw + rw, bw); sx += 1)
             {
-                c_map.clear();
-                std::uint8_t color = at_dst_nes(px, py);
-
-                auto const get_neighbor = [&](int x, int y) -> std::uint8_t
+                // Every candidate's error depends only on the source color and
+                // the output pixel, so repeated colors reuse their first score.
+                // Scores still accumulate per pixel, in order, to keep results exact.
+                rgb_t const src = get_src(sx, sy);
+                auto const seen = std::ranges::find(region_colors, src, &scored_color_t::color);
+                if(seen != region_colors.end())
                 {
-                    x += px;
-                    y += py;
-                    if(x < 0 || y < 0 || x >= w || y >= h)
-                        return 0xFF;
-                    return at_dst_nes(x, y);
-                };
+                    region_scores[seen->knob] += set.bleeds[seen->knob] / std::max<float>(seen->score, 1);
+                    if constexpr(DIFFUSE)
+                    {
+                        region_q[seen->knob].r += seen->q.r;
+                        region_q[seen->knob].g += seen->q.g;
+                        region_q[seen->knob].b += seen->q.b;
+                        region_q_count[seen->knob] += 1;
+                    }
+                    continue;
+                }
+
+                auto const [score, best_knob, best_q] = set.nearest<STYLE != DITHER_NONE>(allowed, src, offset);
 
-                auto const check_neighbor = [&](int x, int y, int weight)
+                region_scores[best_knob] += set.bleeds[best_knob] / std::max<float>(score, 1);
+                if constexpr(DIFFUSE)
                 {
-                    auto n = get_neighbor(x, y);
-                    if(n < 64)
-                        c_map[n] += weight;
-                };
+                    region_q[best_knob].r += best_q.r;
+                    region_q[best_knob].g += best_q.g;
+                    region_q[best_knob].b += best_q.b;
+                    region_q_count[best_knob] += 1;
+                }
+
+                if(region_colors.size() < MAX_REGION_COLORS)
+                    region_colors.push_back({ src, best_knob, score, best_q });
+            }
 
-                check_neighbor(-1, -1, 1);
-                check_neighbor( 1, -1, 1);
-                check_neighbor(-1,  1, 1);
-                check_neighbor( 1,  1, 1);
+            auto it = std::ranges::max_element(region_scores.begin(), region_scores.end());
+            unsigned const best_index = it - region_scores.begin();
+            color_knob_t const& best_knob = set.knobs[best_index];
 
-                check_neighbor(-1,  0, 16);
-                check_neighbor( 1,  0, 16);
-                check_neighbor( 0, -1, 8);
-                check_neighbor( 0,  1, 8);
+            if(best_knob.nes_color < 64)
+            {
+                at_dst_nes(px, py) = best_knob.nes_color;
 
-                if(c_map[color] == 0)
+                if constexpr(DIFFUSE)
                 {
-                    auto it = std::ranges::max_element(c_map.container.begin(), c_map.container.end(), 
-                                                       [&](auto const& a, auto const& b) { return a.second < b.second; });
-                    if(it->second >= 32)
-                        color = it->first;
+                    // Calculate the average error:
+                    qerr_t q = region_q[best_index];
+                    q.r /= region_q_count[best_index];
+                    q.g /= region_q_count[best_index];
+                    q.b /= region_q_count[best_index];
+
+                    if(std::abs(q.r) < dither_cutoff * 8)
+                        q.r = 0;
+                    if(std::abs(q.g) < dither_cutoff * 8)
+                        q.g = 0;
+                    if(std::abs(q.b) < dither_cutoff * 8)
+                        q.b = 0;
+
+                    // Diffuse the error:
+                    if constexpr(STYLE == DITHER_CUSTOM_DIFFUSION)
+                        custom_diffuser(qerrs.data(), px, py, reverse, q);
+                    else
+                        diffuse<style_kernel<STYLE>()>(qerrs.data(), w, h, px, py, reverse, q);
                 }
-
-                new_nes[px + py * w] = color;
             }
-
-            std::swap(dst_nes, new_nes);
         }
+    };
+
+    // Whether the cached result came from the same source and dither settings,
+    // so that only what changed since needs redoing:
+    auto const cache_matches = [&](auto style) -> bool
+    {
+        constexpr dither_style_t STYLE = decltype(style)::value;
+
+        if(!same_source || cache->style != STYLE || cache->quantized.size() != dst_nes.size())
+            return false;
 
-        if(cull_pipes)
+        if constexpr(STYLE != DITHER_NONE)
         {
-            fc::vector_map<std::uint8_t, int> c_map;
-            std::vector<std::uint8_t> new_nes = dst_nes;
+            if(cache->settings.dither_scale != dither_scale || cache->settings.dither_cutoff != dither_cutoff)
+                return false;
+        }
 
-            for(int py = 0; py < h-1; py += 1)
-            for(int px = 0; px < w; px += 1)
-            {
-                std::uint8_t color = at_dst_nes(px, py);
+        if constexpr(STYLE >= FIRST_MASK)
+            return cache->dither_image.GetData() == dither_image.GetData();
+        else if constexpr(STYLE == DITHER_CUSTOM_DIFFUSION)
+            return cache->settings.custom_diffusion == custom_diffusion;
+        else
+            return true;
+    };
 
-                if(color != at_dst_nes(px, py+1))
-                    continue;
+    // The output pixels of every ROI that changed since the cached call:
+    auto const changed_rois = [&]() -> window_t
+    {
+        window_t changed = {};
 
-                c_map.clear();
+        auto const add = [&](roi_t const& roi)
+        {
+            window_t const r = { std::max(roi.x, 0), std::max(roi.y, 0),
+                                 std::min(roi.x + roi.w, w), std::min(roi.y + roi.h, h) };
+            if(r.empty())
+                return;
+            if(changed.empty())
+                changed = r;
+            else
+                changed = { std::min(changed.x0, r.x0), std::min(changed.y0, r.y0),
+                            std::max(changed.x1, r.x1), std::max(changed.y1, r.y1) };
+        };
+
+        std::vector<roi_t> const& before = cache->settings.rois;
+        unsigned const before_count = std::min<std::size_t>(before.size(), MAX_ROIS);
+        for(unsigned r = 0; r < std::max(before_count, roi_count); r += 1)
+        {
+            if(r < before_count && r < roi_count && before[r] == rois[r])
+                continue;
+            if(r < before_count)
+                add(before[r]);
+            if(r < roi_count)
+                add(rois[r]);
+        }
 
-                auto const get_neighbor = [&](int x, int y) -> std::uint8_t
-                {
-                    x += px;
-                    y += py;
-                    if(x < 0 || y < 0 || x >= w || y >= h)
-                        return 0xFF;
-                    return at_dst_nes(x, y);
-                };
+        return changed;
+    };
 
-                auto const check_neighbor = [&](int x, int y, int weight)
-                {
-                    auto n = get_neighbor(x, y);
-                    if(n < 64)
-                        c_map[n] += weight;
-                };
+    // Fills dst_nes like quantize() does without diffusion or attributes, while
+    // keeping the best two knobs of every source pixel in 'cache'. When a single
+    // knob of the whole image changed since the last call, only that knob gets
+    // scored again, and when ROIs changed, only their pixels are redone:
+    auto const quantize_cached = [&](auto style)
+    {
+        using candidate_t = convert_cache_t::candidate_t;
+        constexpr std::uint8_t NO_KNOB = convert_cache_t::NO_KNOB;
+        stage_timer_t const timer(times, STAGE_QUANTIZE);
 
-                check_neighbor(-1, -1, 1);
-                check_neighbor( 1, -1, 1);
-                check_neighbor(-1,  2, 1);
-                check_neighbor( 1,  2, 1);
+        // Whether score 'a' of knob 'ka' wins over score 'b' of knob 'kb'.
+        // Lower knobs win ties, as in quantize():
+        auto const beats = [](float a, unsigned ka, float b, unsigned kb)
+        {
+            return a < b || (a == b && a < INFINITY && ka < kb);
+        };
 
-                check_neighbor(-1,  0, 16);
-                check_neighbor( 1,  0, 16);
-                check_neighbor(-1,  1, 16);
-                check_neighbor( 1,  1, 16);
-                check_neighbor( 0, -1, 8);
-                check_neighbor( 0,  2, 8);
+        // The best distance among knob k's colors, or INFINITY if the knob is off:
+        auto const knob_score = [&](knob_set_t const& set, unsigned k, rgb_t src, dither_offset_t const& offset) -> float
+        {
+            auto const& knob = set.knobs[k];
+            float score = INFINITY;
+            if(knob.nes_color < 64)
+                for(unsigned i = 0; i < knob.map_colors.size(); i += 1)
+                    if(knob.map_enable[i])
+                        score = std::min(score, distance(candidate_q(style, set, k, i, src, offset)));
+            return score;
+        };
 
-                if(c_map[color] == 0)
+        auto const score_all = [&](knob_set_t const& set, rgb_t src, dither_offset_t const& offset) -> candidate_t
+        {
+            candidate_t c;
+            for(unsigned k = 0; k < color_knobs.size(); k += 1)
+            {
+                float const score = knob_score(set, k, src, offset);
+                if(score < c.score)
                 {
-                    auto it = std::ranges::max_element(c_map.container.begin(), c_map.container.end(), 
-                                                       [&](auto const& a, auto const& b) { return a.second < b.second; });
-                    if(it->second >= 64)
-                        color = it->first;
+                    c.second_score = c.score;
+                    c.second = c.knob;
+                    c.score = score;
+                    c.knob = k;
                 }
+                else if(score < c.second_score)
+                {
+                    c.second_score = score;
+                    c.second = k;
+                }
+            }
+            return c;
+        };
 
-                new_nes[px + py * w] = color;
-                new_nes[px + (py+1) * w] = color;
+        // Knob 'e' now scores 'score'. Falls back to scoring every knob
+        // when the new runner-up can't be known:
+        auto const rescore = [&](candidate_t& c, unsigned e, float score,
+                                 knob_set_t const& set, rgb_t src, dither_offset_t const& offset)
+        {
+            if(c.knob == e)
+            {
+                if(beats(score, e, c.second_score, c.second))
+                    c.score = score;
+                else
+                    c = score_all(set, src, offset);
+            }
+            else if(c.second == e)
+            {
+                if(beats(score, e, c.score, c.knob))
+                {
+                    c.second = c.knob;
+                    c.second_score = c.score;
+                    c.knob = e;
+                    c.score = score;
+                }
+                else if(score <= c.second_score)
+                    c.second_score = score;
+                else
+                    c = score_all(set, src, offset);
             }
+            else if(beats(score, e, c.score, c.knob))
+            {
+                c.second = c.knob;
+                c.second_score = c.score;
+                c.knob = e;
+                c.score = score;
+            }
+            else if(beats(score, e, c.second_score, c.second))
+            {
+                c.second = e;
+                c.second_score = score;
+            }
+        };
 
-            std::swap(dst_nes, new_nes);
-        }
+        // See what changed since the cached call:
+        bool reuse = cache_matches(style) && cache->candidates.size() == std::size_t(bw) * bh;
 
-        std::array<std::uint8_t, 4> matched;
-        std::vector<int> a_x, a_y, b_x, b_y;
+        unsigned edited = NO_KNOB;
+        bool scoring_changed = false;
+        bool bleed_changed = false;
+        for(unsigned k = 0; k < color_knobs.size() && reuse; k += 1)
+        {
+            color_knob_t const& before = cache->settings.color_knobs[k];
+            color_knob_t const& after = color_knobs[k];
+            if(before == after)
+                continue;
+            if(edited != NO_KNOB)
+                reuse = false;
+            edited = k;
+            scoring_changed = (before.nes_color < 64) != (after.nes_color < 64)
+                              || before.map_colors != after.map_colors
+                              || before.map_enable != after.map_enable
+                              || before.greed != after.greed;
+            bleed_changed = before.bleed != after.bleed;
+        }
 
-        if(clean_lines)
+        // Pixels in here are scored from scratch:
+        window_t redo = whole;
+        if(reuse)
         {
-            for(int py = 0; py < h; py += 1)
-            for(int px = 0; px < w; px += 1)
+            redo = changed_rois();
+            // Keep the two kinds of edits apart:
+            if(!redo.empty() && edited != NO_KNOB)
             {
-                auto const pattern_match = [&](int pw, int ph, bool flip_x, bool flip_y, char const* pattern)
-                {
-                    for(int my = 0; my <= int(flip_y); my += 1)
-                    for(int mx = 0; mx <= int(flip_x); mx += 1)
-                    {
-                        a_x.clear();
-                        a_y.clear();
-                        b_x.clear();
-                        b_y.clear();
-                        matched.fill(0xFF);
-
-                        for(int iy = 0; iy < ph; iy += 1)
-                        for(int ix = 0; ix < pw; ix += 1)
-                        {
-                            int x, y;
-
-                            if(mx)
-                                x = px + pw - ix - 1;
-                            else
-                                x = px + ix;
+                reuse = false;
+                redo = whole;
+            }
+        }
 
-                            if(my)
-                                y = py + ph - iy - 1;
-                            else
-                                y = py + iy;
+        if(!reuse)
+        {
+            cache->candidates.assign(std::size_t(bw) * bh, {});
+            cache->region_knobs.assign(w * h, 0);
+            cache->region_masks.assign(w * h, 0);
+        }
 
-                            if(x >= w)
-                                goto next_iter;
-                            if(y >= h)
-                                goto next_iter;
+        bool const edit = scoring_changed || bleed_changed;
+        if(!redo.empty() || edit)
+        {
+            thread_pool_t::global().parallel_for(0, h, [&](unsigned py)
+            {
+                // Within a region, repeated colors score the same:
+                struct seen_t
+                {
+                    rgb_t color;
+                    candidate_t c;
+                };
+                std::vector<seen_t> seen;
+                seen.reserve(MAX_REGION_COLORS);
 
-                            std::uint8_t p = pattern[ix + iy*pw];
-                            if(p == 'A')
-                            {
-                                a_x.push_back(x);
-                                a_y.push_back(y);
-                                p = 0;
-                            }
-                            else if(p == 'B')
-                            {
-                                b_x.push_back(x);
-                                b_y.push_back(y);
-                                p = 0;
-                            }
-                            else
-                                p -= '0';
-                            std::uint8_t const c = at_dst_nes(x, y);
+                for(int px = 0; px < w; px += 1)
+                {
+                    unsigned const region = px + py*w;
+                    knob_set_t const& set = knobs_at(px, py);
+                    bool const full = redo.contains(px, py);
 
-                            if(p < matched.size())
-                            {
-                                if(matched[p] >= 64)
-                                    matched[p] = c;
-                                else if(matched[p] != c)
-                                    goto next_iter;
-                            }
-                        }
+                    // Edits to the whole image's knobs don't reach into ROIs:
+                    if(!full && (!edit || &set != &knob_sets[0]))
+                        continue;
 
-                        if(matched[0] >= 64)
-                            goto next_iter;
+                    bool dirty = full || (bleed_changed && (cache->region_masks[region] & (1 << edited)));
 
-                        for(unsigned i = 1; i < matched.size(); i += 1)
-                            if(matched[0] == matched[i])
-                                goto next_iter;
+                    if(full || scoring_changed)
+                    {
+                        dither_offset_t const offset = dither_offset(style, px, py);
+                        seen.clear();
 
-                        if(matched[1] < 64)
+                        for(int sy = py * rh; sy < std::min<int>(py * rh + rh, bh); sy += 1)
+                        for(int sx = px * rw; sx < std::min<int>(px * rw + rw, bw); sx += 1)
                         {
-                            for(int i = 0; i < a_x.size(); i += 1)
-                            {
-                                assert(at_dst_nes(a_x[i], a_y[i]) != matched[1]);
-                                at_dst_nes(a_x[i], a_y[i]) = matched[1];
-                            }
-                        }
+                            rgb_t const src = get_src(sx, sy);
+                            candidate_t& c = cache->candidates[sx + sy*bw];
+                            candidate_t const old = c;
 
-                        if(matched[2] < 64)
-                        {
-                            for(int i = 0; i < b_x.size(); i += 1)
+                            auto const it = std::ranges::find(seen, src, &seen_t::color);
+                            if(full)
+                                c = it != seen.end() ? it->c : score_all(set, src, offset);
+                            else
                             {
-                                assert(at_dst_nes(b_x[i], b_y[i]) != matched[2]);
-                                at_dst_nes(b_x[i], b_y[i]) = matched[2];
+                                // Only the score of the edited knob is remembered here:
+                                float const score = it != seen.end() ? it->c.score : knob_score(set, edited, src, offset);
+                                rescore(c, edited, score, set, src, offset);
+                                if(it == seen.end() && seen.size() < MAX_REGION_COLORS)
+                                    seen.push_back({ src, { score } });
+                                dirty |= c.knob != old.knob || c.score != old.score;
+                                continue;
                             }
+
+                            if(it == seen.end() && seen.size() < MAX_REGION_COLORS)
+                                seen.push_back({ src, c });
                         }
+                    }
 
-                    next_iter:;
+                    if(!dirty)
+                        continue;
+
+                    // Pick the region's knob from its pixels, in the same order as quantize():
+                    std::array<float, std::tuple_size_v<decltype(color_knobs)>> region_scores = {};
+                    std::uint16_t mask = 0;
+                    for(int sy = py * rh; sy < std::min<int>(py * rh + rh, bh); sy += 1)
+                    for(int sx = px * rw; sx < std::min<int>(px * rw + rw, bw); sx += 1)
+                    {
+                        candidate_t const& c = cache->candidates[sx + sy*bw];
+                        unsigned const k = c.knob == NO_KNOB ? 0 : c.knob;
+                        region_scores[k] += set.bleeds[k] / std::max<float>(c.score, 1);
+                        mask |= 1 << k;
                     }
-                };
 
-                pattern_match(
-                    4, 4, true, true,
-                    ".022"
-                    "1A02"
-                    "11A0"
-                    ".11.");
-
-                pattern_match(
-                    3, 4, true, false,
-                    "111"
-                    "0A1"
-                    "200"
-                    "222");
-
-                pattern_match(
-                    4, 3, false, true,
-                    "1022"
-                    "1A02"
-                    "1102");
-
-                pattern_match(
-                    4, 4, true, false,
-                    "1111"
-                    "00A1"
-                    "2B00"
-                    "2222");
-
-                pattern_match(
-                    4, 4, false, true,
-                    "1022"
-                    "10B2"
-                    "1A02"
-                    "1102");
-            }
+                    cache->region_knobs[region] = std::ranges::max_element(region_scores) - region_scores.begin();
+                    cache->region_masks[region] = mask;
+                }
+            });
         }
-    }
-
-    for(int py = 0; py < h; py += 1)
-    for(int px = 0; px < w; px += 1)
-        set_dst(px, py, nes_colors[at_dst_nes(px, py)]);
 
-    if(output_image.IsOk())
-        output_bitmap = wxBitmap(output_image);
-    else
-        std::fprintf(stderr, "Unable to bitmap output image.\n");
-}
+        for(int py = 0; py < h; py += 1)
+        for(int px = 0; px < w; px += 1)
+        {
+            color_knob_t const& knob = knobs_at(px, py).knobs[cache->region_knobs[px + py*w]];
+            if(knob.nes_color < 64)
+                at_dst_nes(px, py) = knob.nes_color;
+        }
+    };
 
-void model_t::auto_color(unsigned count, bool map)
-{
-    color_knobs = {};
-    if(count == 0)
-        return;
-    if(!base_image.IsOk())
-        return;
+    // Fills dst_nes like quantize() does with diffusion but no attributes.
+    // When only ROIs changed since the cached call, just they are redone,
+    // plus a margin for the error they pass on. The result then differs a
+    // little from a full pass, as error from outside starts over at the margin:
+    auto const quantize_patched = [&](auto style)
+    {
+        window_t const changed = cache_matches(style) && cache->settings.color_knobs == color_knobs
+                                 ? changed_rois() : whole;
 
-    count = std::min<unsigned>(count, color_knobs.size());
+        if(changed.x0 == 0 && changed.y0 == 0 && changed.x1 == w && changed.y1 == h)
+        {
+            quantize(style, whole);
+            return;
+        }
 
-    unsigned char* const src_ptr = base_image.GetData();
+        dst_nes = cache->quantized;
+        if(changed.empty())
+            return;
 
-    unsigned bw = base_image.GetWidth();  // base width
-    unsigned bh = base_image.GetHeight(); // base height
+        // Error moves down and to either side, never up. Error arriving
+        // from outside the patch warms up in a margin that is thrown away:
+        constexpr int MARGIN = ROI_PATCH_MARGIN;
+        window_t const patch = { std::max(changed.x0 - MARGIN, 0), changed.y0,
+                                 std::min(changed.x1 + MARGIN, w), std::min(changed.y1 + MARGIN, h) };
+        window_t const run = { std::max(patch.x0 - MARGIN, 0), std::max(patch.y0 - MARGIN, 0),
+                               std::min(patch.x1 + MARGIN, w), patch.y1 };
 
-    auto const get_src = [&](unsigned x, unsigned y) -> rgb_t
-    {
-        unsigned i = (x+y*bw)*3;
-        return rgb_t{ src_ptr[i+0], src_ptr[i+1], src_ptr[i+2] };
-    };
+        for(int py = run.y0; py < run.y1; py += 1)
+            std::fill_n(&at_dst_nes(run.x0, py), run.x1 - run.x0, 0);
 
-    struct bucket_t
-    {
-        int range;
-        std::uint8_t rgb_t::*channel;
-        std::vector<rgb_t> colors;
+        quantize(style, run);
 
-        auto operator<=>(bucket_t const& o) const { return range <=> o.range; }
+        for(int py = run.y0; py < run.y1; py += 1)
+        for(int px = run.x0; px < run.x1; px += 1)
+            if(!patch.contains(px, py))
+                at_dst_nes(px, py) = cache->quantized[px + py*w];
     };
 
-    std::vector<bucket_t> buckets;
-
-    auto const set_bucket_range = [](bucket_t& bucket)
+    // Each dither family gets its own copy of the loops above, picked once here.
+    // Mask dithers only differ by their image, so they share one:
+    auto const with_style = [&](auto const& fn)
     {
-        if(bucket.colors.empty())
+        switch(dither_style)
         {
-            bucket.range = 0;
-            bucket.channel = 0;
-            return;
+        case DITHER_NONE:       fn(std::integral_constant<dither_style_t, DITHER_NONE>()); break;
+        case DITHER_WAVES:      fn(std::integral_constant<dither_style_t, DITHER_WAVES>()); break;
+        case DITHER_FLOYD:      fn(std::integral_constant<dither_style_t, DITHER_FLOYD>()); break;
+        case DITHER_HORIZONTAL: fn(std::integral_constant<dither_style_t, DITHER_HORIZONTAL>()); break;
+        case DITHER_VAN_GOGH:   fn(std::integral_constant<dither_style_t, DITHER_VAN_GOGH>()); break;
+        case DITHER_ATKINSON:   fn(std::integral_constant<dither_style_t, DITHER_ATKINSON>()); break;
+        case DITHER_JJN:        fn(std::integral_constant<dither_style_t, DITHER_JJN>()); break;
+        case DITHER_STUCKI:     fn(std::integral_constant<dither_style_t, DITHER_STUCKI>()); break;
+        case DITHER_SIERRA:     fn(std::integral_constant<dither_style_t, DITHER_SIERRA>()); break;
+        case DITHER_CUSTOM_DIFFUSION:
+            fn(std::integral_constant<dither_style_t, DITHER_CUSTOM_DIFFUSION>());
+            break;
+        default:
+            if(dither_image.IsOk())
+                fn(std::integral_constant<dither_style_t, FIRST_MASK>());
+            else
+                fn(std::integral_constant<dither_style_t, DITHER_NONE>());
+            break;
         }
+    };
+
+    with_style([&](auto style)
+    {
+        constexpr dither_style_t STYLE = decltype(style)::value;
 
-        rgb_t min = { 255, 255, 255 };
-        rgb_t max = { 0, 0, 0 };
-        for(rgb_t const& rgb : bucket.colors)
+        if(cache && !nes_attributes)
         {
-            min.r = std::min(min.r, rgb.r);
-            min.g = std::min(min.g, rgb.g);
-            min.b = std::min(min.b, rgb.b);
+            if constexpr(STYLE == DITHER_NONE || STYLE >= FIRST_MASK)
+                quantize_cached(style);
+            else
+            {
+                cache->candidates = {};
+                quantize_patched(style);
+            }
 
-            max.r = std::max(max.r, rgb.r);
-            max.g = std::max(max.g, rgb.g);
-            max.b = std::max(max.b, rgb.b);
+            cache->style = STYLE;
+            cache->quantized = dst_nes;
+            return;
         }
 
-        rgb_t const dist = { max.r - min.r, max.g - min.g, max.b - min.b };
-
-        if(dist.r >= dist.g && dist.r >= dist.b)
+        if(cache)
         {
-            bucket.range = dist.r;
-            bucket.channel = &rgb_t::r;
+            cache->style = NUM_DITHER;
+            cache->candidates = {};
+            cache->region_knobs = {};
+            cache->region_masks = {};
+            cache->quantized = {};
         }
-        else if(dist.g >= dist.r && dist.g >= dist.b)
+
+        if(nes_attributes)
         {
-            bucket.range = dist.g;
-            bucket.channel = &rgb_t::g;
+            solve_attributes(style);
+            quantize(style, whole);
+
+            // Diffused error changes which sub-palette fits best,
+            // so pick again using the first pass's error and redo it:
+            if(refine_attributes && dither_style && dither_style <= LAST_DIFFUSION)
+            {
+                solve_attributes(style);
+                quantize(style, whole);
+            }
         }
         else
+            quantize(style, whole);
+    });
+
+    if(cache)
+    {
+        cache->base_image = base_image;
+        cache->dither_image = dither_image;
+        cache->settings = *this;
+    }
+
+    // Cellular automata:
+    if(cull_zags)
+    {
+        stage_timer_t const timer(times, STAGE_CULL_ZAGS);
+        ::cull_zags(dst_nes, w, h);
+    }
+    if(cull_dots)
+    {
+        stage_timer_t const timer(times, STAGE_CULL_DOTS);
+        ::cull_dots(dst_nes, w, h);
+    }
+    if(cull_pipes)
+    {
+        stage_timer_t const timer(times, STAGE_CULL_PIPES);
+        ::cull_pipes(dst_nes, w, h);
+    }
+    if(clean_lines)
+    {
+        stage_timer_t const timer(times, STAGE_CLEAN_LINES);
+        ::clean_lines(dst_nes, w, h);
+    }
+
+    // The cleanup passes can pull in colors from neighboring sub-palettes:
+    if(nes_attributes)
+    {
+        stage_timer_t const timer(times, STAGE_ENFORCE);
+        enforce_attributes(dst_nes.data(), w, h, subpalettes(), attributes.data());
+    }
+
+    if(optimize_ms > 0)
+    {
+        stage_timer_t const timer(times, STAGE_OPTIMIZE);
+
+        // Each knob stands for its first mapped color:
+        std::vector<optimize_color_t> colors(color_knobs.size());
+        for(unsigned k = 0; k < color_knobs.size(); k += 1)
         {
-            bucket.range = dist.b;
-            bucket.channel = &rgb_t::b;
+            auto const& knob = color_knobs[k];
+            for(unsigned i = 0; i < knob.map_colors.size(); i += 1)
+            {
+                if(knob.map_enable[i])
+                {
+                    colors[k] = { knob.nes_color, knob.map_colors[i] };
+                    break;
+                }
+            }
         }
-    };
 
-    auto& initial = buckets.emplace_back();
-    for(unsigned y = 0; y < bh; y += 1)
-    for(unsigned x = 0; x < bw; x += 1)
-        initial.colors.push_back(get_src(x, y));
-    set_bucket_range(initial);
+        std::vector<std::uint16_t> allowed;
+        if(nes_attributes)
+            for(std::uint8_t attribute : attributes)
+                allowed.push_back(group_knobs[attribute]);
 
-    while(buckets.size() < count)
-    {
-        buckets.reserve(buckets.size() + 1);
-        auto m = std::max_element(buckets.begin(), buckets.end());
+        // The colors above are the whole image's, so ROI pixels are left
+        // alone, standing for what their own knobs map them to:
+        std::vector<optimize_color_t> frozen;
+        if(!roi_map.empty())
+        {
+            frozen.resize(w * h);
+            for(unsigned i = 0; i < roi_map.size(); i += 1)
+            {
+                if(!roi_map[i])
+                    continue;
 
-        std::sort(m->colors.begin(), m->colors.end(), [&](rgb_t const& a, rgb_t const& b)
-            { return a.*(m->channel) < b.*(m->channel); });
+                frozen[i] = { dst_nes[i], nes_colors[dst_nes[i] & 63] };
+                for(auto const& knob : rois[roi_map[i] - 1].color_knobs)
+                {
+                    if(knob.nes_color != dst_nes[i] || !knob.any_enabled())
+                        continue;
+                    for(unsigned m = 0; m < knob.map_colors.size(); m += 1)
+                    {
+                        if(knob.map_enable[m])
+                        {
+                            frozen[i].color = knob.map_colors[m];
+                            break;
+                        }
+                    }
+                    break;
+                }
+            }
+        }
 
-        auto& new_bucket = buckets.emplace_back();
-        new_bucket.colors.assign(m->colors.begin() + m->colors.size() / 2, m->colors.end());
-        m->colors.resize(m->colors.size() / 2);
-        set_bucket_range(*m);
-        set_bucket_range(new_bucket);
+        optimize_dither(dst_nes.data(), w, h, output_target().data(), colors,
+                        nes_attributes ? allowed.data() : nullptr,
+                        frozen.empty() ? nullptr : frozen.data(),
+                        std::chrono::milliseconds(optimize_ms));
     }
 
-    // Now assign colors:
-    for(unsigned i = 0; i < buckets.size(); i += 1)
+    if(tile_budget > 0)
+    {
+        stage_timer_t const timer(times, STAGE_TILES);
+        reduce_tiles(dst_nes.data(), w, h, subpalettes(), nes_attributes ? attributes.data() : nullptr, tile_budget);
+    }
+
+    if(quality)
     {
-        auto const& bucket = buckets[i];
+        stage_timer_t const timer(times, STAGE_QUALITY);
+        std::array<std::uint8_t, 16> knob_colors;
+        for(unsigned k = 0; k < knob_colors.size(); k += 1)
+            knob_colors[k] = color_knobs[k].nes_color;
+        measure_quality(dst_nes.data(), output_target().data(), w, h, knob_colors, *quality);
+    }
+}
 
-        qerr_t avg = {};
-        for(rgb_t const& rgb : bucket.colors)
+std::vector<std::uint8_t> model_t::palette() const
+{
+    std::vector<std::uint8_t> result;
+    std::array<bool, 64> used = {};
+
+    // Knob order comes first, so downstream tools can rely on it:
+    for(color_knob_t const& knob : color_knobs)
+    {
+        if(knob.nes_color < 64 && !used[knob.nes_color])
         {
-            avg.r += rgb.r;
-            avg.g += rgb.g;
-            avg.b += rgb.b;
+            used[knob.nes_color] = true;
+            result.push_back(knob.nes_color);
         }
+    }
 
-        if(bucket.colors.size())
+    // Then anything the output uses that no knob accounts for:
+    for(std::uint8_t color : dst_nes)
+    {
+        if(color < 64 && !used[color])
         {
-            avg.r /= bucket.colors.size();
-            avg.g /= bucket.colors.size();
-            avg.b /= bucket.colors.size();
+            used[color] = true;
+            result.push_back(color);
         }
+    }
+
+    return result;
+}
+
+subpalettes_t settings_t::subpalettes() const
+{
+    subpalettes_t result;
+    std::uint8_t const bg = color_knobs[0].nes_color < 64 ? color_knobs[0].nes_color : 0x0F;
+
+    for(unsigned p = 0; p < result.size(); p += 1)
+    {
+        result[p][0] = bg;
+        for(unsigned i = 1; i < result[p].size(); i += 1)
+            result[p][i] = color_knobs[1 + p*3 + (i-1)].nes_color;
+    }
+
+    return result;
+}
+
+void model_t::auto_color(unsigned count, bool map)
+{
+    color_knobs = {};
+    if(!base_image.IsOk())
+        return;
+
+    std::size_t const pixels = std::size_t(base_image.GetWidth()) * base_image.GetHeight();
+    auto_color(make_histogram(base_image.GetData(), pixels), count, map);
+}
+
+void settings_t::auto_color(color_histogram_t const& histogram, unsigned count, bool map)
+{
+    color_knobs = {};
+    if(count == 0 || histogram.empty())
+        return;
+
+    count = std::min<unsigned>(count, color_knobs.size());
+    std::vector<rgb_t> const averages = median_cut(histogram, count);
+
+    // Now assign colors:
+    for(unsigned i = 0; i < averages.size(); i += 1)
+    {
+        rgb_t const avg = averages[i];
 
         unsigned best_color = 0xFF;
         float best_dist = ~0u;
         for(unsigned c = 0; c < 64; c += 1)
         {
-
-            qerr_t d = avg;
-            d.r -= nes_colors[c].r;
-            d.g -= nes_colors[c].g;
-            d.b -= nes_colors[c].b;
-            float dist = distance(d);
+            float dist = distance(avg, nes_colors[c]);
 
             for(unsigned j = 0; j < i; j += 1)
                 if(nes_colors[color_knobs[j].nes_color] == nes_colors[c])
@@ -769,7 +1236,7 @@ void model_t::auto_color(unsigned count, bool map)
 
         color_knobs[i].nes_color = best_color;
         if(map)
-            color_knobs[i].map_colors[0] = rgb_t{ avg.r, avg.g, avg.b };
+            color_knobs[i].map_colors[0] = avg;
         else
             color_knobs[i].map_colors[0] = nes_colors[best_color];
         color_knobs[i].map_enable[0] = true;
@@ -15,6 +15,11 @@
 #include <wx/wx.h>
 
 #include "nes_colors.hpp"
+#include "chr.hpp"
+#include "diffusion.hpp"
+#include "histogram.hpp"
+#include "profile.hpp"
+#include "quality.hpp"
 
 using color_triad_t = std::array<std::uint8_t, 3>;
 using color_quad_t = std::array<std::uint8_t, 4>;
@@ -29,6 +34,7 @@ inline std::string color_string(std::uint8_t color)
 }
 
 constexpr unsigned MAP_SIZE = 4;
+constexpr int MAX_SIZE = 512; // Largest converted width or height.
 
 struct color_knob_t
 {
@@ -75,56 +81,335 @@ enum dither_style_t
     DITHER_FLOYD,
     DITHER_HORIZONTAL,
     DITHER_VAN_GOGH,
+    DITHER_ATKINSON,
+    DITHER_JJN,
+    DITHER_STUCKI,
+    DITHER_SIERRA,
+    DITHER_CUSTOM_DIFFUSION,
     DITHER_Z1,
     DITHER_CZ2,
     DITHER_BRIX,
     DITHER_CUSTOM,
     NUM_DITHER,
-    LAST_DIFFUSION = DITHER_VAN_GOGH,
+    LAST_DIFFUSION = DITHER_CUSTOM_DIFFUSION,
     FIRST_MASK = DITHER_Z1,
     NUM_MASK_DITHERS = NUM_DITHER - FIRST_MASK,
 };
 
-struct model_t
+// A tiled dither image, stretched by 'scale' and sampled between its pixels.
+struct dither_mask_t
 {
-    model_t();
+    unsigned char const* data = nullptr;
+    unsigned w = 0;
+    unsigned h = 0;
+    float scale = 1.0f;
+
+    rgb_t at(unsigned x, unsigned y) const
+    {
+        unsigned i = ((x % w)+(y % h)*w)*3;
+        return rgb_t{ data[i+0], data[i+1], data[i+2] };
+    }
+
+    rgb_t lerp(unsigned x, unsigned y) const
+    {
+        float fx = float(x) / (scale);
+        float fy = float(y) / (scale);
+
+        float dx = std::fmod(fx, 1.0f);
+        float dy = std::fmod(fy, 1.0f);
+
+        x = std::floor(fx);
+        y = std::floor(fy);
+
+        rgb_t nw = at(x+0, y+0);
+        rgb_t ne = at(x+1, y+0);
+        rgb_t sw = at(x+0, y+1);
+        rgb_t se = at(x+1, y+1);
+
+        rgb_t n, s;
+
+        n.r = nw.r*(1.0f - dx) + ne.r*dx;
+        n.g = nw.g*(1.0f - dx) + ne.g*dx;
+        n.b = nw.b*(1.0f - dx) + ne.b*dx;
+
+        s.r = sw.r*(1.0f - dx) + se.r*dx;
+        s.g = sw.g*(1.0f - dx) + se.g*dx;
+        s.b = sw.b*(1.0f - dx) + se.b*dx;
+
+        rgb_t a;
+        a.r = n.r*(1.0f - dy) + s.r*dy;
+        a.g = n.g*(1.0f - dy) + s.g*dy;
+        a.b = n.b*(1.0f - dy) + s.b*dy;
+
+        return a;
+    }
+};
+
+// Part of the output that uses its own knobs, like a face or a logo that
+// needs different colors than the rest of the image.
+struct roi_t
+{
+    int x = 0;
+    int y = 0;
+    int w = 0;
+    int h = 0;
+    std::vector<bool> mask; // Which pixels of the rectangle are painted, row by row. Empty for all.
+    std::array<color_knob_t, 16> color_knobs = {};
+
+    bool contains(int px, int py) const
+    {
+        if(px < x || px >= x + w || py < y || py >= y + h)
+            return false;
+        return mask.empty() || mask[(px - x) + (py - y) * w];
+    }
+
+    bool operator==(roi_t const&) const = default;
+};
+
+constexpr unsigned MAX_ROIS = 255; // Any past this are ignored.
+
+// When only ROIs change under diffusion, a cached convert() redoes the box
+// around them widened by this much to either side and below. Pixels outside
+// the box keep what the cached call quantized them to.
+constexpr int ROI_PATCH_MARGIN = 8;
+
+// What dithering adds to the error of every candidate of an output pixel.
+struct dither_offset_t
+{
+    float r, g, b;
+};
+
+// A set of knobs, with the factors that stay constant through a conversion.
+struct knob_set_t
+{
+    static constexpr unsigned SIZE = 16;
+
+    color_knob_t const* knobs = nullptr;
+    std::array<float, SIZE> greeds = {};
+    std::array<float, SIZE> bleeds = {};
+
+    knob_set_t() = default;
+    explicit knob_set_t(std::array<color_knob_t, SIZE> const& knobs);
+
+    // The error of mapping 'src' to map color 'i' of knob 'k', which
+    // includes 'offset' if DITHERED:
+    template<bool DITHERED>
+    qerr_t candidate_q(unsigned k, unsigned i, rgb_t src, dither_offset_t const& offset) const
+    {
+        qerr_t q = qerr(knobs[k].map_colors[i], src);
+
+        q.r *= greeds[k];
+        q.g *= greeds[k];
+        q.b *= greeds[k];
+
+        if constexpr(DITHERED)
+        {
+            q.r += offset.r;
+            q.g += offset.g;
+            q.b += offset.b;
+        }
+
+        return q;
+    }
+
+    struct match_t
+    {
+        float score = INFINITY;
+        unsigned knob = 0;
+        qerr_t q = {};
+    };
+
+    // The candidate of the 'allowed' knobs nearest to 'src'. Earlier knobs win ties.
+    template<bool DITHERED>
+    match_t nearest(std::uint16_t allowed, rgb_t src, dither_offset_t const& offset) const
+    {
+        match_t best;
+
+        for(unsigned k = 0; k < SIZE; k += 1)
+        {
+            auto const& knob = knobs[k];
+
+            if(knob.nes_color >= 64 || !(allowed & (1 << k)))
+                continue;
+
+            for(unsigned i = 0; i < knob.map_colors.size(); i += 1)
+            {
+                if(!knob.map_enable[i])
+                    continue;
+
+                qerr_t const q = candidate_q<DITHERED>(k, i, src, offset);
+                float const dist = distance(q);
+
+                float new_score = std::min<float>(best.score, dist);
+                if(new_score < best.score)
+                {
+                    best.score = new_score;
+                    best.knob = k;
+                    best.q = q;
+                }
+            }
+        }
 
+        return best;
+    }
+};
+
+struct convert_cache_t;
+
+// Everything that decides how an image is converted.
+struct settings_t
+{
     int w = 256;
     int h = 256;
 
-    bool display = false;
     bool cull_dots = false;
     bool cull_pipes = false;
     bool cull_zags = false;
     bool clean_lines = false;
+    bool nes_attributes = false;    // Limit each 16x16 area to one sub-palette.
+    bool refine_attributes = false; // Re-pick sub-palettes after a diffused pass.
+    int tile_budget = 0; // Merge similar 8x8 tiles down to this many. 0 is unlimited.
+    int optimize_ms = 0; // Time spent reducing the error after dithering. 0 is off.
 
     dither_style_t dither_style = DITHER_NONE;
     int dither_scale = 0;
     int dither_cutoff = 0;
+    custom_diffusion_t custom_diffusion; // Used by DITHER_CUSTOM_DIFFUSION.
 
-    std::array<wxBitmap, 65> color_bitmaps = {}; 
     std::array<color_knob_t, 16> color_knobs = {};
+    std::vector<roi_t> rois; // Later ones win where they overlap. Ignored in attribute mode.
 
-    wxStatusBar* status_bar = nullptr;
+    // Converts 'base_image' into 'dst_nes', one NES color per pixel, and fills
+    // 'attributes' in attribute mode. Touches no GUI state, so it may run on
+    // any thread.
+    // A 'cache' kept across calls lets edits to a single knob skip most of the work.
+    // If 'times' isn't null, it gets how long each stage took, and if
+    // 'quality' isn't null, it gets how close the output came to the source.
+    void convert(wxImage const& base_image, wxImage const& dither_image,
+                 std::vector<std::uint8_t>& dst_nes, std::vector<std::uint8_t>& attributes,
+                 convert_cache_t* cache = nullptr, stage_times_t* times = nullptr,
+                 quality_t* quality = nullptr) const;
+
+    // Knob 0 is the background color, and each following group of three
+    // knobs forms one of the four background sub-palettes.
+    subpalettes_t subpalettes() const;
+
+    void auto_color(color_histogram_t const& histogram, unsigned count, bool map);
 
+    bool operator==(settings_t const&) const = default;
+};
+
+// What convert() remembers from its last call. Without diffusion or
+// attributes, each output pixel only depends on its own region, so keeping
+// the best two knobs of every source pixel lets a single knob edit re-score
+// just the pixels that knob can win or lose. Edits to ROIs only redo the
+// ROIs, with diffusion too.
+struct convert_cache_t
+{
+    static constexpr std::uint8_t NO_KNOB = 0xFF;
+
+    struct candidate_t
+    {
+        float score = INFINITY;
+        float second_score = INFINITY;
+        std::uint8_t knob = NO_KNOB;
+        std::uint8_t second = NO_KNOB;
+    };
+
+    // What the results below came from:
     wxImage base_image;
-    wxBitmap base_bitmap;
+    wxImage dither_image;
+    settings_t settings;
+    dither_style_t style = NUM_DITHER; // NUM_DITHER if nothing is kept.
+    std::vector<std::uint8_t> quantized; // The output before cleanup passes.
 
-    wxImage picker_image;
-    wxBitmap picker_bitmap;
+    std::vector<unsigned char> scaled;      // The source at region size, if it had to be resampled.
+    std::vector<rgb_t> target;              // The source at output size, once something needed it.
+    std::vector<candidate_t> candidates;    // Per source pixel, without diffusion.
+    std::vector<std::uint8_t> region_knobs; // The knob picked by each output pixel.
+    std::vector<std::uint16_t> region_masks; // Which knobs are best somewhere in each region.
+};
+
+// The dither images that come with the program, by mask style. DITHER_CUSTOM's is left empty.
+std::array<wxImage, NUM_MASK_DITHERS> builtin_dither_images();
+
+class history_t;
+class result_cache_t;
+class session_recorder_t;
+
+struct model_t : settings_t
+{
+    model_t();
+    ~model_t();
+
+    bool display = false;
+
+    std::array<wxBitmap, 65> color_bitmaps = {}; 
+
+    wxStatusBar* status_bar = nullptr;
+
+    wxImage base_image; // Set with set_base_image().
 
     std::array<wxImage, NUM_MASK_DITHERS> dither_images;
 
     std::filesystem::path output_image_path;
-    wxImage output_image;
-    wxBitmap output_bitmap;
+    std::vector<std::uint8_t> dst_nes; // NES color of each output pixel
+    std::vector<std::uint8_t> attributes; // Sub-palette of each 16x16 area, in attribute mode
+    stage_times_t stage_times; // Of the last update(), and of the images and bitmaps built since.
+    quality_t quality; // Of the last update(). Set 'quality.want_error_map' for a heatmap.
 
     std::string save_path;
+    int png_level = 6; // zlib compression level used when saving
+    bool save_indexed = true;
+    bool chr_flip = false; // Merge flipped tiles when exporting CHR.
 
     void update();
     void update_bitmaps();
 
+    // Go back or forward through the settings of past updates, and update.
+    // Return false if there is nothing to go to.
+    bool undo();
+    bool redo();
+    bool can_undo() const;
+    bool can_redo() const;
+
+    // Replaces the source image. Call update() afterwards.
+    void set_base_image(wxImage const& image);
+
+    // These are built on first use after whatever they show changes:
+    wxImage const& picker();       // The source at picker size.
+    wxBitmap const& picker_view(); // Bitmap of picker().
+    wxImage const& output();       // The converted image in RGB.
+    wxBitmap const& view();        // Bitmap of output() if 'display' is set, else of the scaled source.
+
+    // The dither image of the current mask dither style.
+    wxImage const& dither_image() const;
+
+    // The NES colors of the output, ordered by knob.
+    std::vector<std::uint8_t> palette() const;
+
+    using settings_t::auto_color;
     void auto_color(unsigned count, bool map);
+
+    // Histograms of the images used for shared palettes.
+    histogram_cache_t histogram_cache;
+
+private:
+    // Shows 'stage_times' and 'quality' in the status bar.
+    void report_times();
+
+    convert_cache_t convert_cache;
+    std::unique_ptr<history_t> history;
+    std::unique_ptr<result_cache_t> result_cache;
+
+    // Set when the PIXELER_RECORD environment variable names a session file.
+    std::unique_ptr<session_recorder_t> recorder;
+
+    wxBitmap base_bitmap;
+    wxImage picker_image;
+    wxBitmap picker_bitmap;
+    wxImage output_image;
+    wxBitmap output_bitmap;
 };
 
 #endif
@@ -1,6 +1,7 @@
 #ifndef NES_COLORS_HPP
 #define NES_COLORS_HPP
 
+#include <algorithm>
 #include <array>
 #include <cmath>
 
@@ -0,0 +1,232 @@
+#include "optimize.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+
+#include "thread_pool.hpp"
+
+namespace
+{
+
+constexpr int TILE = 8;
+
+// The blur that stands in for the eye, as 3x3 weights:
+constexpr std::array<float, 9> BLUR = {{
+    1.0f / 16.0f, 2.0f / 16.0f, 1.0f / 16.0f,
+    2.0f / 16.0f, 4.0f / 16.0f, 2.0f / 16.0f,
+    1.0f / 16.0f, 2.0f / 16.0f, 1.0f / 16.0f,
+}};
+
+struct color3_t
+{
+    float r, g, b;
+};
+
+} // namespace
+
+unsigned optimize_dither(std::uint8_t* nes, unsigned w, unsigned h, rgb_t const* target,
+                         std::vector<optimize_color_t> const& colors, std::uint16_t const* allowed,
+                         optimize_color_t const* frozen, std::chrono::steady_clock::duration budget)
+{
+    auto const deadline = std::chrono::steady_clock::now() + budget;
+    unsigned const count = std::min<std::size_t>(colors.size(), 16);
+    unsigned const aw = (w + 15) / 16;
+
+    std::uint16_t usable = 0;
+    for(unsigned c = 0; c < count; c += 1)
+        if(colors[c].nes_color < 64)
+            usable |= 1 << c;
+
+    auto const allowed_mask = [&](int x, int y) -> std::uint16_t
+    {
+        if(!allowed)
+            return usable;
+        return usable & allowed[x / 16 + (y / 16) * aw];
+    };
+
+    auto const is_frozen = [&](unsigned i) -> bool
+    {
+        return frozen && frozen[i].nes_color < 64;
+    };
+
+    // Track which entry each pixel uses, preferring the one that best
+    // explains the source when several share its NES color. Pixels whose
+    // color has no allowed entry start as KEEP, standing for the closest
+    // entry of their color, or for the color itself. Frozen pixels stay KEEP:
+    constexpr std::uint8_t KEEP = 0xFF;
+    std::vector<std::uint8_t> pick(w * h, KEEP);
+    std::vector<rgb_t> shown(w * h);
+    for(unsigned y = 0; y < h; y += 1)
+    for(unsigned x = 0; x < w; x += 1)
+    {
+        std::uint16_t const mask = allowed_mask(x, y);
+        unsigned const i = x + y*w;
+        if(is_frozen(i))
+        {
+            shown[i] = frozen[i].color;
+            continue;
+        }
+
+        float best_dist = INFINITY;
+        bool best_allowed = false;
+        shown[i] = nes_colors[nes[i] & 63];
+        for(unsigned c = 0; c < count; c += 1)
+        {
+            if(colors[c].nes_color != nes[i])
+                continue;
+            bool const is_allowed = mask & (1 << c);
+            float const dist = distance(colors[c].color, target[i]);
+            if((is_allowed && !best_allowed) || (is_allowed == best_allowed && dist < best_dist))
+            {
+                best_dist = dist;
+                best_allowed = is_allowed;
+                shown[i] = colors[c].color;
+                if(is_allowed)
+                    pick[i] = c;
+            }
+        }
+    }
+
+    // The blurred output minus the blurred target:
+    std::vector<color3_t> residual(w * h);
+    for(int y = 0; y < int(h); y += 1)
+    for(int x = 0; x < int(w); x += 1)
+    {
+        color3_t sum = {};
+        for(int j = -1; j <= 1; j += 1)
+        for(int i = -1; i <= 1; i += 1)
+        {
+            int const nx = x + i;
+            int const ny = y + j;
+            if(nx < 0 || nx >= int(w) || ny < 0 || ny >= int(h))
+                continue;
+            float const weight = BLUR[(i + 1) + (j + 1) * 3];
+            rgb_t const out = shown[nx + ny*w];
+            rgb_t const src = target[nx + ny*w];
+            sum.r += weight * (int(out.r) - int(src.r));
+            sum.g += weight * (int(out.g) - int(src.g));
+            sum.b += weight * (int(out.b) - int(src.b));
+        }
+        residual[x + y*w] = sum;
+    }
+
+    // Changing a pixel only touches the residual of its neighbors, and reads
+    // theirs, so tiles two apart never interact and can run in parallel:
+    unsigned const tw = (w + TILE - 1) / TILE;
+    unsigned const th = (h + TILE - 1) / TILE;
+    std::atomic<unsigned> changes = 0;
+    std::atomic<bool> out_of_time = false;
+
+    auto const optimize_tile = [&](unsigned tx, unsigned ty) -> unsigned
+    {
+        unsigned tile_changes = 0;
+        for(int y = ty * TILE; y < std::min<int>(ty * TILE + TILE, h); y += 1)
+        for(int x = tx * TILE; x < std::min<int>(tx * TILE + TILE, w); x += 1)
+        {
+            unsigned const i = x + y*w;
+            if(is_frozen(i))
+                continue;
+
+            std::uint16_t const mask = allowed_mask(x, y);
+            rgb_t const current = shown[i];
+
+            float best_delta = -0.01f; // Ignore rounding noise.
+            int best = -1;
+
+            for(unsigned c = 0; c < count; c += 1)
+            {
+                if(c == pick[i] || !(mask & (1 << c)))
+                    continue;
+
+                color3_t const d = { float(int(colors[c].color.r) - int(current.r)),
+                                     float(int(colors[c].color.g) - int(current.g)),
+                                     float(int(colors[c].color.b) - int(current.b)) };
+                float const dd = d.r*d.r + d.g*d.g + d.b*d.b;
+
+                // How the squared residual changes around the pixel:
+                float delta = 0.0f;
+                for(int j = -1; j <= 1; j += 1)
+                for(int k = -1; k <= 1; k += 1)
+                {
+                    int const nx = x + k;
+                    int const ny = y + j;
+                    if(nx < 0 || nx >= int(w) || ny < 0 || ny >= int(h))
+                        continue;
+                    float const weight = BLUR[(k + 1) + (j + 1) * 3];
+                    color3_t const& r = residual[nx + ny*w];
+                    delta += weight * (2.0f * (r.r*d.r + r.g*d.g + r.b*d.b) + weight * dd);
+                }
+
+                if(delta < best_delta)
+                {
+                    best_delta = delta;
+                    best = c;
+                }
+            }
+
+            if(best < 0)
+                continue;
+
+            rgb_t const next = colors[best].color;
+            color3_t const d = { float(int(next.r) - int(current.r)),
+                                 float(int(next.g) - int(current.g)),
+                                 float(int(next.b) - int(current.b)) };
+            for(int j = -1; j <= 1; j += 1)
+            for(int k = -1; k <= 1; k += 1)
+            {
+                int const nx = x + k;
+                int const ny = y + j;
+                if(nx < 0 || nx >= int(w) || ny < 0 || ny >= int(h))
+                    continue;
+                float const weight = BLUR[(k + 1) + (j + 1) * 3];
+                color3_t& r = residual[nx + ny*w];
+                r.r += weight * d.r;
+                r.g += weight * d.g;
+                r.b += weight * d.b;
+            }
+
+            pick[i] = best;
+            shown[i] = next;
+            tile_changes += 1;
+        }
+        return tile_changes;
+    };
+
+    // Sweep until nothing changes. Each sweep runs the four tile parities in turn:
+    while(!out_of_time)
+    {
+        unsigned const before = changes;
+        for(unsigned phase = 0; phase < 4 && !out_of_time; phase += 1)
+        {
+            unsigned const px = phase & 1;
+            unsigned const py = phase >> 1;
+            unsigned const cols = (tw - px + 1) / 2;
+            unsigned const rows = (th - py + 1) / 2;
+
+            thread_pool_t::global().parallel_for(0, cols * rows, [&](unsigned t)
+            {
+                if(out_of_time)
+                    return;
+                if(std::chrono::steady_clock::now() > deadline)
+                {
+                    out_of_time = true;
+                    return;
+                }
+                changes += optimize_tile(px + (t % cols) * 2, py + (t / cols) * 2);
+            });
+        }
+
+        if(changes == before)
+            break;
+    }
+
+    // Pixels the sweeps never changed either kept their color or picked an
+    // entry of it, so this only writes back the changes:
+    for(unsigned i = 0; i < w * h; i += 1)
+        if(pick[i] != KEEP)
+            nes[i] = colors[pick[i]].nes_color;
+
+    return changes;
+}
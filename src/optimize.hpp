@@ -0,0 +1,30 @@
+#ifndef OPTIMIZE_HPP
+#define OPTIMIZE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "nes_colors.hpp"
+
+struct optimize_color_t
+{
+    std::uint8_t nes_color = 0xFF; // 0xFF leaves the entry unused.
+    rgb_t color;                   // What the color stands for in the source.
+};
+
+// Starting from 'nes', repeatedly changes pixels to whichever color most
+// lowers the error between the blurred output and the blurred 'target',
+// until nothing improves or 'budget' runs out. Colors are compared through
+// their 'color', so RGB mappings are respected.
+// 'colors' holds up to 16 entries. If 'allowed' isn't null, the pixels of
+// each 16x16 area may only change to the entries whose bits are set in its
+// mask. Pixels that are never changed keep their color.
+// If 'frozen' isn't null, it holds an entry per pixel, and the pixels whose
+// entry is used are left alone while standing for its 'color' in the blur.
+// 8x8 tiles are spread across the thread pool. Returns the number of changes.
+unsigned optimize_dither(std::uint8_t* nes, unsigned w, unsigned h, rgb_t const* target,
+                         std::vector<optimize_color_t> const& colors, std::uint16_t const* allowed,
+                         optimize_color_t const* frozen, std::chrono::steady_clock::duration budget);
+
+#endif
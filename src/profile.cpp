@@ -0,0 +1,98 @@
+#include "profile.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+class trace_t
+{
+public:
+    trace_t()
+    {
+        if(char const* env = std::getenv("PIXELER_TRACE"))
+            path = env;
+    }
+
+    ~trace_t() { write(); }
+
+    bool enabled() const { return !path.empty(); }
+
+    void add(stage_t stage, std::chrono::steady_clock::time_point start,
+             std::chrono::steady_clock::time_point end)
+    {
+        using us_t = std::chrono::duration<double, std::micro>;
+        event_t const event =
+        {
+            stage,
+            us_t(start.time_since_epoch()).count(),
+            us_t(end - start).count(),
+            std::hash<std::thread::id>()(std::this_thread::get_id()) % 100000,
+        };
+
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back(event);
+    }
+
+private:
+    struct event_t
+    {
+        stage_t stage;
+        double ts;  // Microseconds on the steady clock.
+        double dur; // Microseconds.
+        std::size_t tid;
+    };
+
+    void write()
+    {
+        if(!enabled())
+            return;
+
+        FILE* fp = std::fopen(path.c_str(), "w");
+        if(!fp)
+        {
+            std::fprintf(stderr, "Unable to write trace %s\n", path.c_str());
+            return;
+        }
+
+        std::fprintf(fp, "{\"traceEvents\":[\n");
+        for(std::size_t i = 0; i < events.size(); i += 1)
+        {
+            event_t const& e = events[i];
+            std::fprintf(fp, "{\"name\":\"%s\",\"cat\":\"pixeler\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%zu}%s\n",
+                         stage_names[e.stage], e.ts, e.dur, e.tid, i + 1 < events.size() ? "," : "");
+        }
+        std::fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+        std::fclose(fp);
+    }
+
+    std::string path;
+    std::mutex mutex;
+    std::vector<event_t> events;
+};
+
+trace_t& global_trace()
+{
+    static trace_t trace;
+    return trace;
+}
+
+} // namespace
+
+bool tracing()
+{
+    static bool const enabled = global_trace().enabled();
+    return enabled;
+}
+
+void trace_stage(stage_t stage, std::chrono::steady_clock::time_point start,
+                 std::chrono::steady_clock::time_point end)
+{
+    global_trace().add(stage, start, end);
+}
@@ -0,0 +1,114 @@
+#ifndef PROFILE_HPP
+#define PROFILE_HPP
+
+#include <array>
+#include <chrono>
+
+// The parts of an update that get timed. Those of settings_t::convert()
+// come first.
+enum stage_t
+{
+    STAGE_RESAMPLE,
+    STAGE_ATTRIBUTES,
+    STAGE_QUANTIZE, // Scoring and diffusion, which take turns per pixel.
+    STAGE_CULL_ZAGS,
+    STAGE_CULL_DOTS,
+    STAGE_CULL_PIPES,
+    STAGE_CLEAN_LINES,
+    STAGE_ENFORCE,
+    STAGE_OPTIMIZE,
+    STAGE_TILES,
+    STAGE_QUALITY, // Error metrics, when asked for.
+    NUM_CONVERT_STAGES,
+    STAGE_PICKER = NUM_CONVERT_STAGES,
+    STAGE_VIEW_RESAMPLE,
+    STAGE_WRITE_OUT, // NES colors to RGB.
+    STAGE_BITMAP,
+    NUM_STAGES,
+};
+
+inline constexpr char const* stage_names[NUM_STAGES] =
+{
+    "resample",
+    "attributes",
+    "quantize",
+    "cull_zags",
+    "cull_dots",
+    "cull_pipes",
+    "clean_lines",
+    "enforce",
+    "optimize",
+    "tiles",
+    "quality",
+    "picker",
+    "view_resample",
+    "write_out",
+    "bitmap",
+};
+
+// Milliseconds spent in each stage. Stages that didn't run stay at 0.
+struct stage_times_t
+{
+    std::array<double, NUM_STAGES> ms = {};
+
+    double total_ms() const
+    {
+        double total = 0.0;
+        for(double t : ms)
+            total += t;
+        return total;
+    }
+};
+
+// Whether stages are being recorded for a trace, which happens when the
+// PIXELER_TRACE environment variable names a file to write it to.
+// The file is Chrome's trace event JSON, which Perfetto also reads, and
+// is written when the program exits.
+bool tracing();
+
+// Records a stage that ran from 'start' to 'end' into the trace.
+void trace_stage(stage_t stage, std::chrono::steady_clock::time_point start,
+                 std::chrono::steady_clock::time_point end);
+
+// Adds the time until stop() or destruction to a stage, and to the trace
+// when tracing. Does nothing else if 'times' is null.
+class stage_timer_t
+{
+public:
+    stage_timer_t(stage_times_t* times, stage_t stage)
+    : times(times)
+    , stage(stage)
+    , active(times || tracing())
+    {
+        if(active)
+            start = std::chrono::steady_clock::now();
+    }
+
+    stage_timer_t(stage_timer_t const&) = delete;
+    stage_timer_t& operator=(stage_timer_t const&) = delete;
+
+    ~stage_timer_t() { stop(); }
+
+    void stop()
+    {
+        if(!active)
+            return;
+        active = false;
+        auto const end = std::chrono::steady_clock::now();
+        if(times)
+        {
+            std::chrono::duration<double, std::milli> const elapsed = end - start;
+            times->ms[stage] += elapsed.count();
+        }
+        if(tracing())
+            trace_stage(stage, start, end);
+    }
+
+private:
+    stage_times_t* times;
+    stage_t stage;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif
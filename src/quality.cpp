@@ -0,0 +1,98 @@
+#include "quality.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+void measure_quality(std::uint8_t const* nes, rgb_t const* target, int w, int h,
+                     std::array<std::uint8_t, 16> const& knob_colors, quality_t& quality)
+{
+    std::size_t const size = std::size_t(w) * h;
+
+    quality.mean_error = 0.0;
+    quality.max_error = 0.0;
+    quality.psnr = 0.0;
+    quality.ssim = 0.0;
+    quality.knob_usage = {};
+    quality.other_usage = 0;
+    if(quality.want_error_map)
+        quality.error_map.assign(size, 0.0f);
+    else
+        quality.error_map = {};
+
+    if(size == 0)
+        return;
+
+    // Luma, for the structural score:
+    std::vector<float> out_y(size);
+    std::vector<float> src_y(size);
+
+    std::array<unsigned, 64> color_usage = {};
+    double error_sum = 0.0;
+    double squared_sum = 0.0;
+    for(std::size_t i = 0; i < size; i += 1)
+    {
+        std::uint8_t const color = std::min<std::uint8_t>(nes[i], 63);
+        color_usage[color] += 1;
+
+        rgb_t const out = nes_colors[color];
+        qerr_t const q = qerr(target[i], out);
+        double const squared = q.r*q.r + q.g*q.g + q.b*q.b;
+        double const error = std::sqrt(squared);
+
+        error_sum += error;
+        squared_sum += squared;
+        quality.max_error = std::max(quality.max_error, error);
+        if(quality.want_error_map)
+            quality.error_map[i] = error;
+
+        out_y[i] = 0.299f * out.r + 0.587f * out.g + 0.114f * out.b;
+        src_y[i] = 0.299f * target[i].r + 0.587f * target[i].g + 0.114f * target[i].b;
+    }
+
+    quality.mean_error = error_sum / size;
+    double const mse = squared_sum / (size * 3);
+    quality.psnr = mse > 0.0 ? 10.0 * std::log10(255.0 * 255.0 / mse) : INFINITY;
+
+    for(unsigned k = 0; k < knob_colors.size(); k += 1)
+    {
+        if(knob_colors[k] >= 64)
+            continue;
+        quality.knob_usage[k] = color_usage[knob_colors[k]];
+        color_usage[knob_colors[k]] = 0;
+    }
+    for(unsigned count : color_usage)
+        quality.other_usage += count;
+
+    // SSIM over 8x8 blocks, the ones at the edges being smaller:
+    constexpr double C1 = (0.01 * 255) * (0.01 * 255);
+    constexpr double C2 = (0.03 * 255) * (0.03 * 255);
+    double ssim_sum = 0.0;
+    unsigned blocks = 0;
+    for(int by = 0; by < h; by += 8)
+    for(int bx = 0; bx < w; bx += 8)
+    {
+        double sx = 0.0, sy = 0.0, sxx = 0.0, syy = 0.0, sxy = 0.0;
+        int n = 0;
+        for(int y = by; y < std::min(by + 8, h); y += 1)
+        for(int x = bx; x < std::min(bx + 8, w); x += 1)
+        {
+            double const a = src_y[x + y*w];
+            double const b = out_y[x + y*w];
+            sx += a;
+            sy += b;
+            sxx += a * a;
+            syy += b * b;
+            sxy += a * b;
+            n += 1;
+        }
+
+        double const mx = sx / n;
+        double const my = sy / n;
+        double const vx = std::max(sxx / n - mx * mx, 0.0);
+        double const vy = std::max(syy / n - my * my, 0.0);
+        double const cov = sxy / n - mx * my;
+        ssim_sum += ((2 * mx * my + C1) * (2 * cov + C2)) / ((mx * mx + my * my + C1) * (vx + vy + C2));
+        blocks += 1;
+    }
+    quality.ssim = ssim_sum / blocks;
+}
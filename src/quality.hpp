@@ -0,0 +1,34 @@
+#ifndef QUALITY_HPP
+#define QUALITY_HPP
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "nes_colors.hpp"
+
+// How close a conversion came to its source, measured against the source
+// averaged down to the output size.
+struct quality_t
+{
+    double mean_error = 0.0; // Mean RGB distance of a pixel, from 0 to 441.
+    double max_error = 0.0;
+    double psnr = 0.0;       // In dB over all three channels, or INFINITY if exact.
+    double ssim = 0.0;       // Mean structural similarity of 8x8 luma blocks, 1 if exact.
+
+    // Output pixels in each knob's NES color. Knobs sharing a color are
+    // counted under the first one, and 'other_usage' takes the rest:
+    std::array<unsigned, 16> knob_usage = {};
+    unsigned other_usage = 0;
+
+    // Set to also get the RGB distance of every output pixel in 'error_map':
+    bool want_error_map = false;
+    std::vector<float> error_map;
+};
+
+// Fills 'quality' by comparing the NES colors of 'nes' with 'target', both
+// 'w' by 'h'. 'knob_colors' are the NES colors of the knobs, in order.
+void measure_quality(std::uint8_t const* nes, rgb_t const* target, int w, int h,
+                     std::array<std::uint8_t, 16> const& knob_colors, quality_t& quality);
+
+#endif
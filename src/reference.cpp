@@ -0,0 +1,917 @@
+#include "reference.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cmath>
+
+#include "flat/flat_map.hpp"
+
+#include "chr.hpp"
+#include "nes_colors.hpp"
+
+namespace
+{
+
+// Area-average resampling, one destination pixel at a time, independent
+// of resample_box(). Along each axis, source pixel s spans [s*dst, s*dst + dst)
+// and destination pixel d spans [d*src, d*src + src), so coverage is exact
+// and each pixel is the rounded weighted mean of the ones it covers.
+void ref_resample(unsigned char const* src, unsigned sw, unsigned sh,
+                  unsigned char* dst, unsigned dw, unsigned dh)
+{
+    auto const coverage = [](std::uint64_t s, std::uint64_t d, std::uint64_t src_size, std::uint64_t dst_size)
+    {
+        std::uint64_t const lo = std::max(s * dst_size, d * src_size);
+        std::uint64_t const hi = std::min(s * dst_size + dst_size, d * src_size + src_size);
+        return hi > lo ? hi - lo : 0;
+    };
+
+    std::uint64_t const area = std::uint64_t(sw) * sh;
+
+    for(unsigned dy = 0; dy < dh; dy += 1)
+    for(unsigned dx = 0; dx < dw; dx += 1)
+    {
+        unsigned const x0 = std::uint64_t(dx) * sw / dw;
+        unsigned const y0 = std::uint64_t(dy) * sh / dh;
+        unsigned const x1 = (std::uint64_t(dx + 1) * sw + dw - 1) / dw;
+        unsigned const y1 = (std::uint64_t(dy + 1) * sh + dh - 1) / dh;
+
+        std::array<std::uint64_t, 3> sums = {};
+        for(unsigned sy = y0; sy < y1; sy += 1)
+        for(unsigned sx = x0; sx < x1; sx += 1)
+        {
+            std::uint64_t const weight = coverage(sx, dx, sw, dw) * coverage(sy, dy, sh, dh);
+            for(unsigned c = 0; c < 3; c += 1)
+                sums[c] += src[(sx + sy * std::size_t(sw)) * 3 + c] * weight;
+        }
+
+        for(unsigned c = 0; c < 3; c += 1)
+            dst[(dx + dy * std::size_t(dw)) * 3 + c] = (sums[c] * 2 + area) / (area * 2);
+    }
+}
+
+// A diffusion kernel with its chunky blocks spread out:
+struct ref_kernel_t
+{
+    std::vector<diffusion_tap_t> taps;
+    bool serpentine = false;
+};
+
+template<std::size_t N>
+ref_kernel_t ref_kernel(diffusion_kernel_t<N> const& kernel)
+{
+    ref_kernel_t result;
+    result.serpentine = kernel.serpentine;
+    unsigned const C = kernel.chunky;
+    for(diffusion_tap_t const& tap : kernel.taps)
+    for(unsigned i = 0; i < C; i += 1)
+    for(unsigned j = 0; j < C; j += 1)
+        result.taps.push_back({ tap.x*int(C) + int(i), tap.y*int(C) + int(j), tap.weight / (C * C), tap.rows });
+    return result;
+}
+
+ref_kernel_t style_ref_kernel(settings_t const& settings)
+{
+    switch(settings.dither_style)
+    {
+    case DITHER_WAVES:      return ref_kernel(WAVES_KERNEL);
+    case DITHER_FLOYD:      return ref_kernel(FLOYD_KERNEL);
+    case DITHER_HORIZONTAL: return ref_kernel(HORIZONTAL_KERNEL);
+    case DITHER_VAN_GOGH:   return ref_kernel(VAN_GOGH_KERNEL);
+    case DITHER_ATKINSON:   return ref_kernel(ATKINSON_KERNEL);
+    case DITHER_JJN:        return ref_kernel(JJN_KERNEL);
+    case DITHER_STUCKI:     return ref_kernel(STUCKI_KERNEL);
+    case DITHER_SIERRA:     return ref_kernel(SIERRA_KERNEL);
+    case DITHER_CUSTOM_DIFFUSION:
+        return { settings.custom_diffusion.taps, settings.custom_diffusion.serpentine };
+    default:
+        return {};
+    }
+}
+
+void ref_cull_zags(std::vector<std::uint8_t>& nes, int w, int h)
+{
+    auto const at = [&](int x, int y) -> std::uint8_t&
+    {
+        return nes[x + y*w];
+    };
+
+    for(int py = 0; py < h - 1; py += 1)
+    for(int px = 0; px < w - 2; px += 1)
+    {
+        std::uint8_t tl = at(px+0, py+0);
+        std::uint8_t tc = at(px+1, py+0);
+        std::uint8_t tr = at(px+2, py+0);
+        std::uint8_t bl = at(px+0, py+1);
+        std::uint8_t bc = at(px+1, py+1);
+        std::uint8_t br = at(px+2, py+1);
+
+        if(tc == bc)
+            continue;
+
+        int eq = 0;
+        eq += tl == bc;
+        eq += bl == tc;
+        eq += tr == bc;
+        eq += br == tc;
+
+        eq += tl != tc;
+        eq += bl != bc;
+        eq += tr != tc;
+        eq += br != bc;
+
+        if(eq < 7)
+            continue;
+
+        std::swap(at(px+1, py+0), at(px+1, py+1));
+    }
+}
+
+void ref_cull_dots(std::vector<std::uint8_t>& nes, int w, int h)
+{
+    auto const at = [&](int x, int y) -> std::uint8_t&
+    {
+        return nes[x + y*w];
+    };
+
+    fc::vector_map<std::uint8_t, int> c_map;
+    std::vector<std::uint8_t> new_nes = nes;
+
+    for(int py = 0; py < h; py += 1)
+    for(int px = 0; px < w; px += 1)
+    {
+        c_map.clear();
+        std::uint8_t color = at(px, py);
+
+        auto const get_neighbor = [&](int x, int y) -> std::uint8_t
+        {
+            x += px;
+            y += py;
+            if(x < 0 || y < 0 || x >= w || y >= h)
+                return 0xFF;
+            return at(x, y);
+        };
+
+        auto const check_neighbor = [&](int x, int y, int weight)
+        {
+            auto n = get_neighbor(x, y);
+            if(n < 64)
+                c_map[n] += weight;
+        };
+
+        check_neighbor(-1, -1, 1);
+        check_neighbor( 1, -1, 1);
+        check_neighbor(-1,  1, 1);
+        check_neighbor( 1,  1, 1);
+
+        check_neighbor(-1,  0, 16);
+        check_neighbor( 1,  0, 16);
+        check_neighbor( 0, -1, 8);
+        check_neighbor( 0,  1, 8);
+
+        if(c_map[color] == 0)
+        {
+            auto it = std::ranges::max_element(c_map.container.begin(), c_map.container.end(), 
+                                               [&](auto const& a, auto const& b) { return a.second < b.second; });
+            if(it->second >= 32)
+                color = it->first;
+        }
+
+        new_nes[px + py * w] = color;
+    }
+
+    std::swap(nes, new_nes);
+}
+
+void ref_cull_pipes(std::vector<std::uint8_t>& nes, int w, int h)
+{
+    auto const at = [&](int x, int y) -> std::uint8_t&
+    {
+        return nes[x + y*w];
+    };
+
+    fc::vector_map<std::uint8_t, int> c_map;
+    std::vector<std::uint8_t> new_nes = nes;
+
+    for(int py = 0; py < h-1; py += 1)
+    for(int px = 0; px < w; px += 1)
+    {
+        std::uint8_t color = at(px, py);
+
+        if(color != at(px, py+1))
+            continue;
+
+        c_map.clear();
+
+        auto const get_neighbor = [&](int x, int y) -> std::uint8_t
+        {
+            x += px;
+            y += py;
+            if(x < 0 || y < 0 || x >= w || y >= h)
+                return 0xFF;
+            return at(x, y);
+        };
+
+        auto const check_neighbor = [&](int x, int y, int weight)
+        {
+            auto n = get_neighbor(x, y);
+            if(n < 64)
+                c_map[n] += weight;
+        };
+
+        check_neighbor(-1, -1, 1);
+        check_neighbor( 1, -1, 1);
+        check_neighbor(-1,  2, 1);
+        check_neighbor( 1,  2, 1);
+
+        check_neighbor(-1,  0, 16);
+        check_neighbor( 1,  0, 16);
+        check_neighbor(-1,  1, 16);
+        check_neighbor( 1,  1, 16);
+        check_neighbor( 0, -1, 8);
+        check_neighbor( 0,  2, 8);
+
+        if(c_map[color] == 0)
+        {
+            auto it = std::ranges::max_element(c_map.container.begin(), c_map.container.end(), 
+                                               [&](auto const& a, auto const& b) { return a.second < b.second; });
+            if(it->second >= 64)
+                color = it->first;
+        }
+
+        new_nes[px + py * w] = color;
+        new_nes[px + (py+1) * w] = color;
+    }
+
+    std::swap(nes, new_nes);
+}
+
+void ref_clean_lines(std::vector<std::uint8_t>& nes, int w, int h)
+{
+    auto const at = [&](int x, int y) -> std::uint8_t&
+    {
+        return nes[x + y*w];
+    };
+
+    std::array<std::uint8_t, 4> matched;
+    std::vector<int> a_x, a_y, b_x, b_y;
+
+    for(int py = 0; py < h; py += 1)
+    for(int px = 0; px < w; px += 1)
+    {
+        auto const pattern_match = [&](int pw, int ph, bool flip_x, bool flip_y, char const* pattern)
+        {
+            for(int my = 0; my <= int(flip_y); my += 1)
+            for(int mx = 0; mx <= int(flip_x); mx += 1)
+            {
+                a_x.clear();
+                a_y.clear();
+                b_x.clear();
+                b_y.clear();
+                matched.fill(0xFF);
+
+                for(int iy = 0; iy < ph; iy += 1)
+                for(int ix = 0; ix < pw; ix += 1)
+                {
+                    int x, y;
+
+                    if(mx)
+                        x = px + pw - ix - 1;
+                    else
+                        x = px + ix;
+
+                    if(my)
+                        y = py + ph - iy - 1;
+                    else
+                        y = py + iy;
+
+                    if(x >= w)
+                        goto next_iter;
+                    if(y >= h)
+                        goto next_iter;
+
+                    std::uint8_t p = pattern[ix + iy*pw];
+                    if(p == 'A')
+                    {
+                        a_x.push_back(x);
+                        a_y.push_back(y);
+                        p = 0;
+                    }
+                    else if(p == 'B')
+                    {
+                        b_x.push_back(x);
+                        b_y.push_back(y);
+                        p = 0;
+                    }
+                    else
+                        p -= '0';
+                    std::uint8_t const c = at(x, y);
+
+                    if(p < matched.size())
+                    {
+                        if(matched[p] >= 64)
+                            matched[p] = c;
+                        else if(matched[p] != c)
+                            goto next_iter;
+                    }
+                }
+
+                if(matched[0] >= 64)
+                    goto next_iter;
+
+                for(unsigned i = 1; i < matched.size(); i += 1)
+                    if(matched[0] == matched[i])
+                        goto next_iter;
+
+                if(matched[1] < 64)
+                {
+                    for(int i = 0; i < a_x.size(); i += 1)
+                    {
+                        assert(at(a_x[i], a_y[i]) != matched[1]);
+                        at(a_x[i], a_y[i]) = matched[1];
+                    }
+                }
+
+                if(matched[2] < 64)
+                {
+                    for(int i = 0; i < b_x.size(); i += 1)
+                    {
+                        assert(at(b_x[i], b_y[i]) != matched[2]);
+                        at(b_x[i], b_y[i]) = matched[2];
+                    }
+                }
+
+            next_iter:;
+            }
+        };
+
+        pattern_match(
+            4, 4, true, true,
+            ".022"
+            "1A02"
+            "11A0"
+            ".11.");
+
+        pattern_match(
+            3, 4, true, false,
+            "111"
+            "0A1"
+            "200"
+            "222");
+
+        pattern_match(
+            4, 3, false, true,
+            "1022"
+            "1A02"
+            "1102");
+
+        pattern_match(
+            4, 4, true, false,
+            "1111"
+            "00A1"
+            "2B00"
+            "2222");
+
+        pattern_match(
+            4, 4, false, true,
+            "1022"
+            "10B2"
+            "1A02"
+            "1102");
+    }
+}
+
+// The 2-bit value of 'color' in the sub-palette 'pal': the first entry
+// holding it, or else the closest entry.
+unsigned ref_value(std::array<std::uint8_t, 4> const& pal, std::uint8_t color)
+{
+    for(unsigned i = 0; i < pal.size(); i += 1)
+        if(pal[i] == color)
+            return i;
+
+    unsigned best = 0;
+    float best_dist = INFINITY;
+    for(unsigned i = 0; i < pal.size(); i += 1)
+    {
+        if(pal[i] >= 64)
+            continue;
+        float const dist = distance(nes_colors[color], nes_colors[pal[i]]);
+        if(dist < best_dist)
+        {
+            best_dist = dist;
+            best = i;
+        }
+    }
+    return best;
+}
+
+void ref_enforce_attributes(std::vector<std::uint8_t>& nes, int w, int h,
+                            subpalettes_t const& subpalettes, std::vector<std::uint8_t> const& attributes)
+{
+    for(int py = 0; py < h; py += 1)
+    for(int px = 0; px < w; px += 1)
+    {
+        auto const& pal = subpalettes[attributes[px / 16 + (py / 16) * ((w + 15) / 16)]];
+        std::uint8_t& color = nes[px + py*w];
+        color = pal[ref_value(pal, color & 63)];
+    }
+}
+
+// The sub-palette of each 16x16 area is the first one holding the most of its pixels.
+std::vector<std::uint8_t> ref_pick_attributes(std::vector<std::uint8_t> const& nes, int w, int h,
+                                              subpalettes_t const& subpalettes)
+{
+    int const bw = (w + 15) / 16;
+    int const bh = (h + 15) / 16;
+    std::vector<std::uint8_t> blocks(bw * bh);
+
+    for(int by = 0; by < bh; by += 1)
+    for(int bx = 0; bx < bw; bx += 1)
+    {
+        unsigned best_covered = 0;
+        for(unsigned p = 0; p < subpalettes.size(); p += 1)
+        {
+            unsigned covered = 0;
+            for(int py = by * 16; py < std::min(by * 16 + 16, h); py += 1)
+            for(int px = bx * 16; px < std::min(bx * 16 + 16, w); px += 1)
+            {
+                std::uint8_t const color = nes[px + py*w] & 63;
+                covered += std::find(subpalettes[p].begin(), subpalettes[p].end(), color) != subpalettes[p].end();
+            }
+
+            if(covered > best_covered)
+            {
+                best_covered = covered;
+                blocks[bx + by * bw] = p;
+            }
+        }
+    }
+
+    return blocks;
+}
+
+// Tile merging by brute force, with the sub-palette of each 16x16 area in
+// 'blocks'. Each step compares every pair of tiles and merges the one whose
+// nearest tile is cheapest, by differing bits times use count. Ties go to
+// the tile seen first, and then to its nearest tile seen first.
+void ref_merge_tiles(std::vector<std::uint8_t>& nes, int w, int h, subpalettes_t const& subpalettes,
+                     std::vector<std::uint8_t> const& blocks, unsigned budget)
+{
+    int const tiles_w = (w + 7) / 8;
+    int const tiles_h = (h + 7) / 8;
+
+    auto const pal_at = [&](int tx, int ty) -> std::array<std::uint8_t, 4> const&
+    {
+        return subpalettes[blocks[tx / 2 + (ty / 2) * ((w + 15) / 16)]];
+    };
+
+    // The value of each pixel of a tile. Those past the image edge are 0:
+    using tile_t = std::array<std::uint8_t, 64>;
+    auto const tile_at = [&](int tx, int ty)
+    {
+        tile_t tile = {};
+        for(int y = 0; y < 8; y += 1)
+        for(int x = 0; x < 8; x += 1)
+            if(tx*8 + x < w && ty*8 + y < h)
+                tile[x + y*8] = ref_value(pal_at(tx, ty), nes[tx*8 + x + (ty*8 + y)*w] & 63);
+        return tile;
+    };
+
+    // Each unique tile, in the order first seen, and the tile positions using it:
+    struct group_t
+    {
+        tile_t tile;
+        std::vector<int> uses;
+        bool alive = true;
+    };
+
+    std::vector<group_t> groups;
+    std::vector<unsigned> original(tiles_w * tiles_h);
+    for(int ty = 0; ty < tiles_h; ty += 1)
+    for(int tx = 0; tx < tiles_w; tx += 1)
+    {
+        tile_t const tile = tile_at(tx, ty);
+        unsigned g = 0;
+        while(g < groups.size() && groups[g].tile != tile)
+            g += 1;
+        if(g == groups.size())
+            groups.push_back({ tile });
+        groups[g].uses.push_back(tx + ty * tiles_w);
+        original[tx + ty * tiles_w] = g;
+    }
+    std::vector<unsigned> merged = original;
+
+    // Whether every pixel of 'to' packs back to the same value wherever 'from' is used:
+    auto const fits = [&](group_t const& from, group_t const& to)
+    {
+        for(int use : from.uses)
+        {
+            int const tx = use % tiles_w;
+            int const ty = use / tiles_w;
+            auto const& pal = pal_at(tx, ty);
+            for(int y = 0; y < 8; y += 1)
+            for(int x = 0; x < 8; x += 1)
+            {
+                unsigned const value = to.tile[x + y*8];
+                if(tx*8 + x >= w || ty*8 + y >= h)
+                {
+                    if(value)
+                        return false;
+                }
+                else if(pal[value] >= 64 || ref_value(pal, pal[value]) != value)
+                    return false;
+            }
+        }
+        return true;
+    };
+
+    auto const dist = [](group_t const& a, group_t const& b)
+    {
+        unsigned d = 0;
+        for(unsigned i = 0; i < 64; i += 1)
+            d += std::popcount(unsigned(a.tile[i] ^ b.tile[i]));
+        return d;
+    };
+
+    unsigned alive = groups.size();
+    while(alive > budget)
+    {
+        unsigned best_from = ~0u;
+        unsigned best_to = ~0u;
+        std::uint64_t best_cost = 0;
+        for(unsigned a = 0; a < groups.size(); a += 1)
+        {
+            if(!groups[a].alive)
+                continue;
+
+            unsigned to = ~0u;
+            unsigned to_dist = 0;
+            for(unsigned b = 0; b < groups.size(); b += 1)
+            {
+                if(b == a || !groups[b].alive || !fits(groups[a], groups[b]))
+                    continue;
+                unsigned const d = dist(groups[a], groups[b]);
+                if(to == ~0u || d < to_dist)
+                {
+                    to = b;
+                    to_dist = d;
+                }
+            }
+
+            std::uint64_t const cost = std::uint64_t(groups[a].uses.size()) * to_dist;
+            if(to != ~0u && (best_from == ~0u || cost < best_cost))
+            {
+                best_from = a;
+                best_to = to;
+                best_cost = cost;
+            }
+        }
+
+        if(best_from == ~0u)
+            break;
+
+        group_t& from = groups[best_from];
+        group_t& to = groups[best_to];
+        for(int use : from.uses)
+            merged[use] = best_to;
+        to.uses.insert(to.uses.end(), from.uses.begin(), from.uses.end());
+        from.uses.clear();
+        from.alive = false;
+        alive -= 1;
+    }
+
+    // Write the merged tiles back:
+    for(int ty = 0; ty < tiles_h; ty += 1)
+    for(int tx = 0; tx < tiles_w; tx += 1)
+    {
+        unsigned const use = tx + ty * tiles_w;
+        if(merged[use] == original[use])
+            continue;
+
+        auto const& pal = pal_at(tx, ty);
+        for(int y = 0; y < 8 && ty*8 + y < h; y += 1)
+        for(int x = 0; x < 8 && tx*8 + x < w; x += 1)
+        {
+            std::uint8_t const color = pal[groups[merged[use]].tile[x + y*8]];
+            nes[tx*8 + x + (ty*8 + y)*w] = color < 64 ? color : pal[0];
+        }
+    }
+}
+
+} // namespace
+
+void reference_convert(settings_t const& settings, wxImage const& base_image, wxImage const& dither_image,
+                       std::vector<std::uint8_t>& dst_nes, std::vector<std::uint8_t>& attributes)
+{
+    int const w = settings.w;
+    int const h = settings.h;
+
+    // The style actually used. Mask styles without an image don't dither:
+    dither_style_t style = settings.dither_style;
+    if(style >= FIRST_MASK && !dither_image.IsOk())
+        style = DITHER_NONE;
+    bool const diffuse = style != DITHER_NONE && style <= LAST_DIFFUSION;
+    bool const mask = style >= FIRST_MASK;
+
+    // Each output pixel covers a region of rw by rh source pixels:
+    unsigned bw = base_image.GetWidth();
+    unsigned bh = base_image.GetHeight();
+    unsigned const rw = std::max<unsigned>(1, bw / w);
+    unsigned const rh = std::max<unsigned>(1, bh / h);
+
+    std::vector<unsigned char> scaled;
+    unsigned char const* src_ptr = base_image.GetData();
+    if(bw != rw * w || bh != rh * h)
+    {
+        scaled.resize(std::size_t(rw * w) * (rh * h) * 3);
+        ref_resample(src_ptr, bw, bh, scaled.data(), rw * w, rh * h);
+        src_ptr = scaled.data();
+        bw = rw * w;
+        bh = rh * h;
+    }
+
+    auto const get_src = [&](int x, int y) -> rgb_t
+    {
+        unsigned i = (x + y*bw) * 3;
+        return rgb_t{ src_ptr[i+0], src_ptr[i+1], src_ptr[i+2] };
+    };
+
+    // Dithering by mask:
+    unsigned const dw = dither_image.IsOk() ? dither_image.GetWidth() : 0;
+    unsigned const dh = dither_image.IsOk() ? dither_image.GetHeight() : 0;
+    unsigned char const* const dither_ptr = dither_image.IsOk() ? dither_image.GetData() : nullptr;
+    float const iscale = (settings.dither_cutoff + 8) / 8.0f;
+
+    auto const get_dither = [&](unsigned x, unsigned y) -> rgb_t
+    {
+        unsigned i = ((x % dw) + (y % dh)*dw) * 3;
+        return rgb_t{ dither_ptr[i+0], dither_ptr[i+1], dither_ptr[i+2] };
+    };
+
+    auto const get_dither_lerp = [&](unsigned x, unsigned y) -> rgb_t
+    {
+        float fx = float(x) / iscale;
+        float fy = float(y) / iscale;
+
+        float dx = std::fmod(fx, 1.0f);
+        float dy = std::fmod(fy, 1.0f);
+
+        x = std::floor(fx);
+        y = std::floor(fy);
+
+        rgb_t nw = get_dither(x+0, y+0);
+        rgb_t ne = get_dither(x+1, y+0);
+        rgb_t sw = get_dither(x+0, y+1);
+        rgb_t se = get_dither(x+1, y+1);
+
+        rgb_t n, s, a;
+        n.r = nw.r*(1.0f - dx) + ne.r*dx;
+        n.g = nw.g*(1.0f - dx) + ne.g*dx;
+        n.b = nw.b*(1.0f - dx) + ne.b*dx;
+        s.r = sw.r*(1.0f - dx) + se.r*dx;
+        s.g = sw.g*(1.0f - dx) + se.g*dx;
+        s.b = sw.b*(1.0f - dx) + se.b*dx;
+        a.r = n.r*(1.0f - dy) + s.r*dy;
+        a.g = n.g*(1.0f - dy) + s.g*dy;
+        a.b = n.b*(1.0f - dy) + s.b*dy;
+        return a;
+    };
+
+    // Dithering by error diffusion:
+    ref_kernel_t const kernel = style_ref_kernel(settings);
+    std::vector<qerr_t> qerrs(w * h);
+    float const dscale = 1.0f / std::pow(1.11f, settings.dither_scale);
+
+    // The knobs of each output pixel. Later ROIs win, but attribute mode ignores them:
+    unsigned const roi_count = settings.nes_attributes ? 0 : std::min<std::size_t>(settings.rois.size(), MAX_ROIS);
+    auto const knobs_at = [&](int px, int py) -> std::array<color_knob_t, 16> const&
+    {
+        for(int r = roi_count - 1; r >= 0; r -= 1)
+            if(settings.rois[r].contains(px, py))
+                return settings.rois[r].color_knobs;
+        return settings.color_knobs;
+    };
+
+    // The error of mapping 'src' to map color 'i' of knob 'k' at output pixel (px, py):
+    auto const candidate_q = [&](int px, int py, color_knob_t const& knob, unsigned i, rgb_t src) -> qerr_t
+    {
+        qerr_t q = qerr(knob.map_colors[i], src);
+
+        q.r *= knob.greedf();
+        q.g *= knob.greedf();
+        q.b *= knob.greedf();
+
+        if(diffuse)
+        {
+            qerr_t const& e = qerrs[px + py*w];
+            q.r += e.r * dscale;
+            q.g += e.g * dscale;
+            q.b += e.b * dscale;
+        }
+        else if(mask)
+        {
+            rgb_t d = get_dither_lerp(px, py);
+            float s = (40 - settings.dither_scale) / 40.0f;
+            q.r += std::round(float(int(d.r) - 128) * s);
+            q.g += std::round(float(int(d.g) - 128) * s);
+            q.b += std::round(float(int(d.b) - 128) * s);
+        }
+
+        return q;
+    };
+
+    // Attributes limit each 16x16 area to the background and one sub-palette:
+    unsigned const aw = (w + 15) / 16;
+    unsigned const ah = (h + 15) / 16;
+    if(settings.nes_attributes)
+        attributes.assign(aw * ah, 0);
+    else
+        attributes.clear();
+
+    auto const group_knobs = [](unsigned g) -> std::uint16_t
+    {
+        return 1 | (0b111 << (1 + g*3));
+    };
+
+    auto const solve_attributes = [&]
+    {
+        for(unsigned ay = 0; ay < ah; ay += 1)
+        for(unsigned ax = 0; ax < aw; ax += 1)
+        {
+            std::array<float, NUM_SUBPALETTES> errors = {};
+
+            for(int py = ay * 16; py < std::min<int>(ay * 16 + 16, h); py += 1)
+            for(int px = ax * 16; px < std::min<int>(ax * 16 + 16, w); px += 1)
+            {
+                auto const& knobs = knobs_at(px, py);
+
+                for(int sy = py * rh; sy < int(py * rh + rh); sy += 1)
+                for(int sx = px * rw; sx < int(px * rw + rw); sx += 1)
+                {
+                    rgb_t const src = get_src(sx, sy);
+                    std::array<float, 1 + NUM_SUBPALETTES * 3> knob_dists;
+                    knob_dists.fill(INFINITY);
+
+                    for(unsigned k = 0; k < knob_dists.size(); k += 1)
+                    {
+                        if(knobs[k].nes_color >= 64)
+                            continue;
+                        for(unsigned i = 0; i < MAP_SIZE; i += 1)
+                            if(knobs[k].map_enable[i])
+                                knob_dists[k] = std::min(knob_dists[k], distance(candidate_q(px, py, knobs[k], i, src)));
+                    }
+
+                    for(unsigned g = 0; g < errors.size(); g += 1)
+                    {
+                        float dist = knob_dists[0];
+                        for(unsigned k = 1 + g*3; k < 4 + g*3; k += 1)
+                            dist = std::min(dist, knob_dists[k]);
+                        errors[g] += std::min(dist, 1000.0f);
+                    }
+                }
+            }
+
+            attributes[ax + ay*aw] = std::ranges::min_element(errors) - errors.begin();
+        }
+    };
+
+    // Pixels whose knob is off keep what they had:
+    dst_nes.assign(w * h, 0);
+
+    auto const quantize = [&]
+    {
+        std::fill(qerrs.begin(), qerrs.end(), qerr_t{});
+
+        for(int py = 0; py < h; py += 1)
+        for(int x = 0; x < w; x += 1)
+        {
+            bool const reverse = diffuse && kernel.serpentine && (py & 1);
+            int const px = reverse ? w - 1 - x : x;
+
+            auto const& knobs = knobs_at(px, py);
+            std::uint16_t const allowed = settings.nes_attributes ? group_knobs(attributes[px / 16 + (py / 16) * aw]) : 0xFFFF;
+
+            // Each source pixel votes for its nearest knob:
+            std::array<float, 16> scores = {};
+            std::array<qerr_t, 16> q_sums = {};
+            std::array<int, 16> q_counts = {};
+
+            for(int sy = py * rh; sy < int(py * rh + rh); sy += 1)
+            for(int sx = px * rw; sx < int(px * rw + rw); sx += 1)
+            {
+                rgb_t const src = get_src(sx, sy);
+                float score = INFINITY;
+                unsigned best = 0;
+                qerr_t best_q = {};
+
+                for(unsigned k = 0; k < knobs.size(); k += 1)
+                {
+                    if(knobs[k].nes_color >= 64 || !(allowed & (1 << k)))
+                        continue;
+
+                    for(unsigned i = 0; i < MAP_SIZE; i += 1)
+                    {
+                        if(!knobs[k].map_enable[i])
+                            continue;
+                        qerr_t const q = candidate_q(px, py, knobs[k], i, src);
+                        float const dist = distance(q);
+                        if(dist < score)
+                        {
+                            score = dist;
+                            best = k;
+                            best_q = q;
+                        }
+                    }
+                }
+
+                scores[best] += knobs[best].bleedf() / std::max<float>(score, 1);
+                q_sums[best].r += best_q.r;
+                q_sums[best].g += best_q.g;
+                q_sums[best].b += best_q.b;
+                q_counts[best] += 1;
+            }
+
+            unsigned const best = std::ranges::max_element(scores) - scores.begin();
+            if(knobs[best].nes_color >= 64)
+                continue;
+            dst_nes[px + py*w] = knobs[best].nes_color;
+
+            if(!diffuse)
+                continue;
+
+            // Spread the average error of the winning knob:
+            qerr_t q = q_sums[best];
+            q.r /= q_counts[best];
+            q.g /= q_counts[best];
+            q.b /= q_counts[best];
+
+            int const cutoff = settings.dither_cutoff * 8;
+            if(std::abs(q.r) < cutoff)
+                q.r = 0;
+            if(std::abs(q.g) < cutoff)
+                q.g = 0;
+            if(std::abs(q.b) < cutoff)
+                q.b = 0;
+
+            for(diffusion_tap_t const& t : kernel.taps)
+            {
+                if((t.rows == EVEN_ROWS && (py & 1)) || (t.rows == ODD_ROWS && !(py & 1)))
+                    continue;
+                int const tx = px + (reverse ? -t.x : t.x);
+                int const ty = py + t.y;
+                if(tx < 0 || tx >= w || ty < 0 || ty >= h)
+                    continue;
+                qerrs[tx + ty*w].r += q.r * t.weight;
+                qerrs[tx + ty*w].g += q.g * t.weight;
+                qerrs[tx + ty*w].b += q.b * t.weight;
+            }
+        }
+    };
+
+    if(settings.nes_attributes)
+    {
+        solve_attributes();
+        quantize();
+
+        if(settings.refine_attributes && diffuse)
+        {
+            solve_attributes();
+            quantize();
+        }
+    }
+    else
+        quantize();
+
+    if(settings.cull_zags)
+        ref_cull_zags(dst_nes, w, h);
+    if(settings.cull_dots)
+        ref_cull_dots(dst_nes, w, h);
+    if(settings.cull_pipes)
+        ref_cull_pipes(dst_nes, w, h);
+    if(settings.clean_lines)
+        ref_clean_lines(dst_nes, w, h);
+
+    subpalettes_t const subpalettes = settings.subpalettes();
+
+    if(settings.nes_attributes)
+        ref_enforce_attributes(dst_nes, w, h, subpalettes, attributes);
+
+    if(settings.tile_budget > 0 && settings.nes_attributes)
+        ref_merge_tiles(dst_nes, w, h, subpalettes, attributes, settings.tile_budget);
+    else if(settings.tile_budget > 0)
+    {
+        // Merging can change which sub-palettes get picked,
+        // so go again while it does, up to the same 4 rounds:
+        std::vector<std::uint8_t> blocks = ref_pick_attributes(dst_nes, w, h, subpalettes);
+        for(unsigned round = 0; round < 4; round += 1)
+        {
+            ref_merge_tiles(dst_nes, w, h, subpalettes, blocks, settings.tile_budget);
+            std::vector<std::uint8_t> picked = ref_pick_attributes(dst_nes, w, h, subpalettes);
+            if(picked == blocks)
+                break;
+            blocks = std::move(picked);
+        }
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef REFERENCE_HPP
+#define REFERENCE_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "model.hpp"
+
+// A plain, single-threaded copy of settings_t::convert(), kept as simple
+// as possible so that faster versions can be checked against it. It has
+// no caching, threading or specialization, and shouldn't get any.
+// Leaves out the time-limited optimize pass, which isn't reproducible.
+void reference_convert(settings_t const& settings, wxImage const& base_image, wxImage const& dither_image,
+                       std::vector<std::uint8_t>& dst_nes, std::vector<std::uint8_t>& attributes);
+
+#endif
@@ -0,0 +1,104 @@
+#include "resample.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+namespace
+{
+
+// Which source indices each destination index covers, and by how much.
+// Along an axis, source index s spans [s*dst, s*dst + dst) and destination
+// index d spans [d*src, d*src + src), so weights are exact integers that
+// sum to 'src' for each destination index.
+struct box_weights_t
+{
+    std::vector<unsigned> first;       // First source index of each destination index.
+    std::vector<unsigned> offset;      // Where each destination index's weights start.
+    std::vector<std::uint32_t> weights;
+};
+
+box_weights_t box_weights(unsigned src, unsigned dst)
+{
+    box_weights_t result;
+
+    for(unsigned d = 0; d < dst; d += 1)
+    {
+        std::uint64_t const lo = std::uint64_t(d) * src;
+        std::uint64_t const hi = lo + src;
+        unsigned const first = lo / dst;
+        unsigned const end = (hi + dst - 1) / dst;
+
+        result.first.push_back(first);
+        result.offset.push_back(result.weights.size());
+        for(std::uint64_t s = first; s < end; s += 1)
+            result.weights.push_back(std::min(hi, s * dst + dst) - std::max(lo, s * dst));
+    }
+    result.offset.push_back(result.weights.size());
+
+    return result;
+}
+
+} // namespace
+
+void resample_box(unsigned char const* src, unsigned sw, unsigned sh,
+                  unsigned char* dst, unsigned dw, unsigned dh)
+{
+    if(!sw || !sh || !dw || !dh)
+        return;
+
+    if(sw == dw && sh == dh)
+    {
+        std::memcpy(dst, src, std::size_t(sw) * sh * 3);
+        return;
+    }
+
+    box_weights_t const xw = box_weights(sw, dw);
+    box_weights_t const yw = box_weights(sh, dh);
+    unsigned const row = sw * 3;
+    std::uint64_t const area = std::uint64_t(sw) * sh;
+
+    // Bands of rows keep each task big next to its scheduling cost:
+    constexpr unsigned BAND = 16;
+    thread_pool_t::global().parallel_for(0, (dh + BAND - 1) / BAND, [&](unsigned band)
+    {
+        std::vector<std::uint32_t> sums(row);
+
+        for(unsigned dy = band * BAND; dy < std::min(dh, band * BAND + BAND); dy += 1)
+        {
+            // Blend the covered source rows. This is the bulk of the work,
+            // and is kept as a flat loop so that it vectorizes:
+            std::uint32_t* const __restrict s = sums.data();
+            std::fill_n(s, row, 0);
+            for(unsigned i = yw.offset[dy]; i < yw.offset[dy + 1]; i += 1)
+            {
+                std::uint32_t const weight = yw.weights[i];
+                unsigned char const* const __restrict line = src + std::size_t(yw.first[dy] + i - yw.offset[dy]) * row;
+                for(unsigned x = 0; x < row; x += 1)
+                    s[x] += line[x] * weight;
+            }
+
+            // Then blend across the row, rounding the exact mean:
+            unsigned char* const out = dst + std::size_t(dy) * dw * 3;
+            for(unsigned dx = 0; dx < dw; dx += 1)
+            {
+                std::uint64_t r = 0, g = 0, b = 0;
+                std::uint32_t const* c = s + xw.first[dx] * 3;
+                for(unsigned i = xw.offset[dx]; i < xw.offset[dx + 1]; i += 1, c += 3)
+                {
+                    std::uint64_t const weight = xw.weights[i];
+                    r += c[0] * weight;
+                    g += c[1] * weight;
+                    b += c[2] * weight;
+                }
+
+                out[dx*3 + 0] = (r * 2 + area) / (area * 2);
+                out[dx*3 + 1] = (g * 2 + area) / (area * 2);
+                out[dx*3 + 2] = (b * 2 + area) / (area * 2);
+            }
+        }
+    });
+}
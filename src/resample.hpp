@@ -0,0 +1,12 @@
+#ifndef RESAMPLE_HPP
+#define RESAMPLE_HPP
+
+// Area-average resampling of packed 8-bit RGB. Each destination pixel is
+// the average of the source area it covers, with partially covered source
+// pixels weighted by their coverage and the mean rounded exactly, in
+// integers. Works for shrinking and enlarging.
+// Rows are spread across the global thread pool.
+void resample_box(unsigned char const* src, unsigned sw, unsigned sh,
+                  unsigned char* dst, unsigned dw, unsigned dh);
+
+#endif
@@ -0,0 +1,347 @@
+#include "session.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "image_io.hpp"
+
+namespace
+{
+
+std::string knob_string(color_knob_t const& knob)
+{
+    unsigned enable = 0;
+    for(unsigned i = 0; i < MAP_SIZE; i += 1)
+        enable |= knob.map_enable[i] << i;
+
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%d,%d,%d,%u", knob.nes_color, knob.greed, knob.bleed, enable);
+    std::string result = buf;
+    for(rgb_t const& color : knob.map_colors)
+    {
+        std::snprintf(buf, sizeof(buf), ",%02X%02X%02X", color.r, color.g, color.b);
+        result += buf;
+    }
+    return result;
+}
+
+bool parse_knob(std::string const& value, color_knob_t& knob)
+{
+    std::vector<std::string> parts;
+    std::istringstream ss(value);
+    for(std::string part; std::getline(ss, part, ',');)
+        parts.push_back(part);
+    if(parts.size() != 4 + MAP_SIZE)
+        return false;
+
+    knob.nes_color = std::atoi(parts[0].c_str());
+    knob.greed = std::atoi(parts[1].c_str());
+    knob.bleed = std::atoi(parts[2].c_str());
+    unsigned const enable = std::atoi(parts[3].c_str());
+    for(unsigned i = 0; i < MAP_SIZE; i += 1)
+    {
+        unsigned long const rgb = std::strtoul(parts[4 + i].c_str(), nullptr, 16);
+        knob.map_colors[i] = { std::uint8_t(rgb >> 16), std::uint8_t(rgb >> 8), std::uint8_t(rgb) };
+        knob.map_enable[i] = enable & (1 << i);
+    }
+    return true;
+}
+
+std::string diffusion_string(custom_diffusion_t const& kernel)
+{
+    std::string result = kernel.serpentine ? "1" : "0";
+    for(diffusion_tap_t const& tap : kernel.taps)
+    {
+        char buf[64];
+        std::snprintf(buf, sizeof(buf), ";%d,%d,%.9g,%d", tap.x, tap.y, tap.weight, int(tap.rows));
+        result += buf;
+    }
+    return result;
+}
+
+bool parse_diffusion(std::string const& value, custom_diffusion_t& kernel)
+{
+    std::istringstream ss(value);
+    std::string part;
+    if(!std::getline(ss, part, ';'))
+        return false;
+    kernel.serpentine = part == "1";
+    kernel.taps.clear();
+    while(std::getline(ss, part, ';'))
+    {
+        diffusion_tap_t tap = {};
+        int rows = 0;
+        if(std::sscanf(part.c_str(), "%d,%d,%f,%d", &tap.x, &tap.y, &tap.weight, &rows) != 4)
+            return false;
+        tap.rows = diffusion_rows_t(rows);
+        kernel.taps.push_back(tap);
+    }
+    return true;
+}
+
+std::string roi_string(roi_t const& roi)
+{
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%d,%d,%d,%d,", roi.x, roi.y, roi.w, roi.h);
+    std::string result = buf;
+    if(roi.mask.empty())
+        result += '-';
+    for(bool b : roi.mask)
+        result += b ? '1' : '0';
+    return result;
+}
+
+bool parse_roi(std::string const& value, roi_t& roi)
+{
+    int offset = 0;
+    if(std::sscanf(value.c_str(), "%d,%d,%d,%d,%n", &roi.x, &roi.y, &roi.w, &roi.h, &offset) != 4 || !offset)
+        return false;
+    std::string const bits = value.substr(offset);
+    roi.mask.clear();
+    if(bits != "-")
+    {
+        if(bits.size() != std::size_t(roi.w) * roi.h)
+            return false;
+        for(char c : bits)
+            roi.mask.push_back(c == '1');
+    }
+    roi.color_knobs = {}; // Its knobs follow.
+    return true;
+}
+
+// The settings that changed since 'from', or all of them if it's null:
+std::string settings_delta(settings_t const* from, settings_t const& to)
+{
+    std::string result;
+
+    auto const add = [&](char const* key, std::string const& value)
+    {
+        result += ' ';
+        result += key;
+        result += '=';
+        result += value;
+    };
+
+#define FIELD(name) \
+    if(!from || from->name != to.name) \
+        add(#name, std::to_string(int(to.name)));
+    FIELD(w)
+    FIELD(h)
+    FIELD(cull_dots)
+    FIELD(cull_pipes)
+    FIELD(cull_zags)
+    FIELD(clean_lines)
+    FIELD(nes_attributes)
+    FIELD(refine_attributes)
+    FIELD(tile_budget)
+    FIELD(optimize_ms)
+    FIELD(dither_style)
+    FIELD(dither_scale)
+    FIELD(dither_cutoff)
+#undef FIELD
+
+    if(!from || from->custom_diffusion != to.custom_diffusion)
+        add("diffusion", diffusion_string(to.custom_diffusion));
+
+    for(unsigned k = 0; k < to.color_knobs.size(); k += 1)
+        if(!from || from->color_knobs[k] != to.color_knobs[k])
+            add(("knob" + std::to_string(k)).c_str(), knob_string(to.color_knobs[k]));
+
+    if(!from || from->rois.size() != to.rois.size())
+        add("rois", std::to_string(to.rois.size()));
+
+    // An ROI that changed at all is written whole:
+    for(unsigned r = 0; r < to.rois.size(); r += 1)
+    {
+        if(from && r < from->rois.size() && from->rois[r] == to.rois[r])
+            continue;
+        std::string const name = "roi" + std::to_string(r);
+        add(name.c_str(), roi_string(to.rois[r]));
+        for(unsigned k = 0; k < to.rois[r].color_knobs.size(); k += 1)
+            if(to.rois[r].color_knobs[k] != color_knob_t{})
+                add((name + ".knob" + std::to_string(k)).c_str(), knob_string(to.rois[r].color_knobs[k]));
+    }
+
+    return result;
+}
+
+bool apply_setting(std::string const& key, std::string const& value, settings_t& settings)
+{
+    int const i = std::atoi(value.c_str());
+
+#define FIELD(name, type) \
+    if(key == #name) \
+    { \
+        settings.name = type(i); \
+        return true; \
+    }
+    FIELD(w, int)
+    FIELD(h, int)
+    FIELD(cull_dots, bool)
+    FIELD(cull_pipes, bool)
+    FIELD(cull_zags, bool)
+    FIELD(clean_lines, bool)
+    FIELD(nes_attributes, bool)
+    FIELD(refine_attributes, bool)
+    FIELD(tile_budget, int)
+    FIELD(optimize_ms, int)
+    FIELD(dither_style, dither_style_t)
+    FIELD(dither_scale, int)
+    FIELD(dither_cutoff, int)
+#undef FIELD
+
+    if(key == "diffusion")
+        return parse_diffusion(value, settings.custom_diffusion);
+
+    if(key == "rois")
+    {
+        settings.rois.resize(std::min<unsigned>(i, MAX_ROIS));
+        return true;
+    }
+
+    unsigned index = 0;
+    int consumed = 0;
+    if(std::sscanf(key.c_str(), "knob%u%n", &index, &consumed) == 1 && consumed == int(key.size()))
+        return index < settings.color_knobs.size() && parse_knob(value, settings.color_knobs[index]);
+
+    unsigned knob = 0;
+    if(std::sscanf(key.c_str(), "roi%u.knob%u%n", &index, &knob, &consumed) == 2 && consumed == int(key.size()))
+        return index < settings.rois.size() && knob < 16 && parse_knob(value, settings.rois[index].color_knobs[knob]);
+
+    if(std::sscanf(key.c_str(), "roi%u%n", &index, &consumed) == 1 && consumed == int(key.size()))
+        return index < settings.rois.size() && parse_roi(value, settings.rois[index]);
+
+    return false;
+}
+
+} // namespace
+
+session_recorder_t::session_recorder_t(std::string const& path)
+: path(path)
+, fp(std::fopen(path.c_str(), "w"))
+, start(std::chrono::steady_clock::now())
+{
+    if(!fp)
+    {
+        std::fprintf(stderr, "Unable to record a session to %s\n", path.c_str());
+        return;
+    }
+    std::fprintf(fp, "# Pixeler session\n");
+}
+
+session_recorder_t::~session_recorder_t()
+{
+    if(fp)
+        std::fclose(fp);
+}
+
+void session_recorder_t::begin()
+{
+    event = std::chrono::steady_clock::now();
+}
+
+void session_recorder_t::record(settings_t const& settings, wxImage const& source, wxImage const& custom_dither)
+{
+    if(!fp)
+        return;
+
+    std::chrono::duration<double, std::milli> const update_time = std::chrono::steady_clock::now() - event;
+
+    // Images are saved beside the session, with the file names relative to it:
+    auto const save_image = [&](char const* kind, wxImage const& image)
+    {
+        images += 1;
+        std::string const image_path = path + "." + std::to_string(images) + ".png";
+        if(!save_png(image_path, image, 1))
+        {
+            std::fprintf(stderr, "Unable to save %s\n", image_path.c_str());
+            return;
+        }
+        std::fprintf(fp, "%s %s\n", kind, std::filesystem::path(image_path).filename().string().c_str());
+    };
+
+    if(source.GetData() != last_source.GetData())
+    {
+        last_source = source;
+        save_image("source", source);
+    }
+
+    if(custom_dither.IsOk() && custom_dither.GetData() != last_dither.GetData())
+    {
+        last_dither = custom_dither;
+        save_image("dither", custom_dither);
+    }
+
+    std::chrono::duration<double, std::milli> const time = event - start;
+    std::fprintf(fp, "update %.3f %.3f%s\n", time.count(), update_time.count(),
+                 settings_delta(first ? nullptr : &last, settings).c_str());
+    std::fflush(fp);
+
+    last = settings;
+    first = false;
+}
+
+bool load_session(std::string const& path, std::vector<session_event_t>& events, std::string& error)
+{
+    std::ifstream file(path);
+    if(!file)
+    {
+        error = "Unable to open " + path;
+        return false;
+    }
+
+    std::filesystem::path const dir = std::filesystem::path(path).parent_path();
+    settings_t settings;
+    wxImage source;
+    wxImage custom_dither;
+
+    std::string line;
+    for(unsigned line_number = 1; std::getline(file, line); line_number += 1)
+    {
+        std::istringstream ss(line);
+        std::string kind;
+        if(!(ss >> kind) || kind[0] == '#')
+            continue;
+
+        auto const fail = [&](std::string const& what)
+        {
+            error = path + ":" + std::to_string(line_number) + ": " + what;
+            return false;
+        };
+
+        if(kind == "source" || kind == "dither")
+        {
+            std::string name;
+            ss >> name;
+            // As recorded, without any reduction:
+            wxImage const image = load_image((dir / name).string(), ~0u, ~0u);
+            if(!image.IsOk())
+                return fail("Unable to open " + name);
+            (kind == "source" ? source : custom_dither) = image;
+        }
+        else if(kind == "update")
+        {
+            session_event_t event;
+            if(!(ss >> event.time_ms >> event.recorded_ms))
+                return fail("Bad update");
+
+            for(std::string token; ss >> token;)
+            {
+                std::size_t const eq = token.find('=');
+                if(eq == std::string::npos || !apply_setting(token.substr(0, eq), token.substr(eq + 1), settings))
+                    return fail("Bad setting " + token);
+            }
+
+            event.settings = settings;
+            event.source = source;
+            event.custom_dither = custom_dither;
+            events.push_back(std::move(event));
+        }
+        else
+            return fail("Unknown line " + kind);
+    }
+
+    return true;
+}
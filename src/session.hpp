@@ -0,0 +1,72 @@
+#ifndef SESSION_HPP
+#define SESSION_HPP
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <wx/wx.h>
+
+#include "model.hpp"
+
+// Sessions are text files of one line per update, holding the time and
+// the settings that changed since the last one:
+//
+//     # Pixeler session
+//     source session.txt.1.png
+//     update 0.000 12.3 w=256 h=240 dither_style=2 knob0=15,0,0,1,000000,...
+//     update 803.125 4.1 knob3=22,-3,0,1,FF8000,...
+//
+// The numbers after 'update' are milliseconds since recording started,
+// and the wall time the update took when it was recorded. Source images and
+// custom dither images are saved next to the session and named by
+// 'source' and 'dither' lines.
+
+// Writes the updates of a model_t to a session file as they happen.
+class session_recorder_t
+{
+public:
+    explicit session_recorder_t(std::string const& path);
+    ~session_recorder_t();
+
+    session_recorder_t(session_recorder_t const&) = delete;
+    session_recorder_t& operator=(session_recorder_t const&) = delete;
+
+    bool ok() const { return fp; }
+
+    // Call at the start of each update.
+    void begin();
+
+    // Call when the update is done, which is timed from begin().
+    // 'custom_dither' is the DITHER_CUSTOM image.
+    void record(settings_t const& settings, wxImage const& source, wxImage const& custom_dither);
+
+private:
+    std::string path;
+    FILE* fp = nullptr;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point event;
+    unsigned images = 0;
+    settings_t last;
+    bool first = true;
+    // Kept so that their data can't be freed and reused by other images:
+    wxImage last_source;
+    wxImage last_dither;
+};
+
+struct session_event_t
+{
+    double time_ms;     // Since recording started.
+    double recorded_ms; // The wall time of the update when recorded.
+    settings_t settings;
+    wxImage source;
+    wxImage custom_dither;
+};
+
+// Reads a session written by session_recorder_t. Events share the image
+// objects of earlier events until a new image was recorded.
+// Returns false and describes the problem in 'error' on failure.
+bool load_session(std::string const& path, std::vector<session_event_t>& events, std::string& error);
+
+#endif
@@ -0,0 +1,54 @@
+#include "thread_pool.hpp"
+
+thread_pool_t::thread_pool_t(unsigned threads)
+{
+    threads = std::max(1u, threads);
+    for(unsigned i = 0; i < threads; i += 1)
+        workers.emplace_back(&thread_pool_t::run, this);
+}
+
+thread_pool_t::~thread_pool_t()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_all();
+
+    for(std::thread& worker : workers)
+        worker.join();
+}
+
+thread_pool_t& thread_pool_t::global()
+{
+    static thread_pool_t pool;
+    return pool;
+}
+
+void thread_pool_t::push(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    cv.notify_one();
+}
+
+void thread_pool_t::run()
+{
+    while(true)
+    {
+        std::function<void()> job;
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]{ return stopping || !jobs.empty(); });
+            if(jobs.empty())
+                return;
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        job();
+    }
+}
@@ -0,0 +1,106 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class thread_pool_t
+{
+public:
+    explicit thread_pool_t(unsigned threads = std::thread::hardware_concurrency());
+    ~thread_pool_t();
+
+    thread_pool_t(thread_pool_t const&) = delete;
+    thread_pool_t& operator=(thread_pool_t const&) = delete;
+
+    // The pool shared by the whole program.
+    static thread_pool_t& global();
+
+    unsigned size() const { return workers.size(); }
+
+    template<typename Fn>
+    auto submit(Fn&& fn) -> std::future<decltype(fn())>
+    {
+        using result_t = decltype(fn());
+        auto task = std::make_shared<std::packaged_task<result_t()>>(std::forward<Fn>(fn));
+        std::future<result_t> future = task->get_future();
+        push([task]{ (*task)(); });
+        return future;
+    }
+
+    // Calls 'fn(i)' for each i in [begin, end) across the pool and waits.
+    // The calling thread helps out, so this is safe to nest.
+    template<typename Fn>
+    void parallel_for(unsigned begin, unsigned end, Fn const& fn)
+    {
+        if(begin >= end)
+            return;
+
+        struct state_t
+        {
+            std::atomic<unsigned> next;
+            std::atomic<unsigned> remaining;
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::exception_ptr error;
+        };
+
+        auto state = std::make_shared<state_t>();
+        state->next = begin;
+        state->remaining = end - begin;
+
+        // Only ever run while the caller is waiting, so 'fn' is still alive.
+        auto const work = [state, end, &fn]
+        {
+            for(unsigned i; (i = state->next++) < end;)
+            {
+                try
+                {
+                    fn(i);
+                }
+                catch(...)
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    if(!state->error)
+                        state->error = std::current_exception();
+                }
+
+                if(--state->remaining == 0)
+                {
+                    std::lock_guard<std::mutex> lock(state->mutex);
+                    state->cv.notify_all();
+                }
+            }
+        };
+
+        unsigned const helpers = std::min<unsigned>(size(), end - begin - 1);
+        for(unsigned i = 0; i < helpers; i += 1)
+            push(work);
+        work();
+
+        std::unique_lock<std::mutex> lock(state->mutex);
+        state->cv.wait(lock, [&]{ return state->remaining == 0; });
+        if(state->error)
+            std::rethrow_exception(state->error);
+    }
+
+private:
+    void push(std::function<void()> job);
+    void run();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+};
+
+#endif
@@ -0,0 +1,216 @@
+#include "tune.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <vector>
+
+#include "resample.hpp"
+#include "thread_pool.hpp"
+
+namespace
+{
+
+// Lower is better for every metric:
+double tune_score(quality_t const& quality, tune_metric_t metric)
+{
+    switch(metric)
+    {
+    case TUNE_PSNR: return -quality.psnr;
+    case TUNE_SSIM: return -quality.ssim;
+    default:        return quality.mean_error;
+    }
+}
+
+// A setting searched over, and its range:
+struct tune_param_t
+{
+    int settings_t::* field; // Null for a knob's greed.
+    unsigned knob;
+    int min, max;
+
+    int& at(settings_t& settings) const
+    {
+        return field ? settings.*field : settings.color_knobs[knob].greed;
+    }
+};
+
+} // namespace
+
+tune_result_t auto_tune(settings_t const& start, wxImage const& base_image, wxImage const& dither_image,
+                        tune_metric_t metric, progress_fn_t const& progress)
+{
+    tune_result_t result;
+    result.settings = start;
+    if(!base_image.IsOk() || start.w <= 0 || start.h <= 0)
+        return result;
+
+    settings_t best = start;
+    best.optimize_ms = 0;
+
+    // Sources much larger than the output are searched averaged down to two
+    // pixels per output pixel each way, for a fraction of the work. As the
+    // region size changes how pixels score, the best settings found along
+    // the way are scored again at the real size before one is picked:
+    unsigned const bw = base_image.GetWidth();
+    unsigned const bh = base_image.GetHeight();
+    wxImage reduced;
+    if(bw / start.w > 2 || bh / start.h > 2)
+    {
+        unsigned const sw = std::min<unsigned>(bw, start.w * 2);
+        unsigned const sh = std::min<unsigned>(bh, start.h * 2);
+        reduced = wxImage(sw, sh);
+        resample_box(base_image.GetData(), bw, bh, reduced.GetData(), sw, sh);
+    }
+    wxImage const& source = reduced.IsOk() ? reduced : base_image;
+
+    // Ranges match the controls:
+    std::vector<tune_param_t> params;
+    if(start.dither_style != DITHER_NONE)
+    {
+        params.push_back({ &settings_t::dither_scale, 0, 0, 40 });
+        params.push_back({ &settings_t::dither_cutoff, 0, 0, 48 });
+    }
+    for(unsigned k = 0; k < start.color_knobs.size(); k += 1)
+        if(start.color_knobs[k].nes_color < 64)
+            params.push_back({ nullptr, k, -20, 20 });
+
+    // Caches are handed to whichever worker needs one. Besides keeping the
+    // prepared source, an evaluation whose knobs differ in one from its
+    // cache's last only re-scores that knob, when the style allows it.
+    // wxImage reference counts aren't thread safe, so each cache gets images
+    // of its own to keep:
+    struct slot_t
+    {
+        convert_cache_t cache;
+        wxImage source;
+        wxImage dither_image;
+    };
+    std::vector<slot_t> slots(thread_pool_t::global().size() + 1);
+    std::vector<slot_t*> free_slots;
+    for(slot_t& slot : slots)
+    {
+        slot.source = source.Copy();
+        if(dither_image.IsOk())
+            slot.dither_image = dither_image.Copy();
+        free_slots.push_back(&slot);
+    }
+    std::mutex mutex;
+
+    std::atomic<unsigned> evaluations = 0;
+    auto const evaluate = [&](settings_t const& settings, quality_t& quality)
+    {
+        slot_t* slot;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+
+        std::vector<std::uint8_t> dst_nes;
+        std::vector<std::uint8_t> attributes;
+        settings.convert(slot->source, slot->dither_image, dst_nes, attributes, &slot->cache, nullptr, &quality);
+        evaluations += 1;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        free_slots.push_back(slot);
+    };
+
+    quality_t best_quality;
+    evaluate(best, best_quality);
+    double best_score = tune_score(best_quality, metric);
+    std::vector<settings_t> candidates = { best };
+
+    // Each pass tries a coarse grid over every parameter, then the values
+    // around the best of it. Passes repeat while anything improves:
+    constexpr unsigned MAX_PASSES = 2;
+    constexpr int COARSE_STEP = 5;
+    unsigned const steps = MAX_PASSES * params.size() * 2;
+    unsigned step = 0;
+    bool cancelled = false;
+
+    for(unsigned pass = 0; pass < MAX_PASSES && !cancelled; pass += 1)
+    {
+        bool improved = false;
+
+        for(tune_param_t const& param : params)
+        {
+            for(int fine = 0; fine < 2 && !cancelled; fine += 1)
+            {
+                int const current = param.at(best);
+                std::vector<int> values;
+                if(fine)
+                {
+                    for(int v = current - COARSE_STEP + 1; v < current + COARSE_STEP; v += 1)
+                        if(v != current && v >= param.min && v <= param.max)
+                            values.push_back(v);
+                }
+                else
+                {
+                    for(int v = param.min; v <= param.max; v += COARSE_STEP)
+                        if(v != current)
+                            values.push_back(v);
+                }
+
+                std::vector<quality_t> qualities(values.size());
+                thread_pool_t::global().parallel_for(0, values.size(), [&](unsigned i)
+                {
+                    settings_t settings = best;
+                    param.at(settings) = values[i];
+                    evaluate(settings, qualities[i]);
+                });
+
+                // Ties go to the current value, then to the lower one:
+                for(unsigned i = 0; i < values.size(); i += 1)
+                {
+                    double const score = tune_score(qualities[i], metric);
+                    if(score < best_score)
+                    {
+                        best_score = score;
+                        best_quality = std::move(qualities[i]);
+                        param.at(best) = values[i];
+                        improved = true;
+                    }
+                }
+
+                step += 1;
+                if(progress && !progress(float(step) / steps))
+                    cancelled = true;
+            }
+
+            if(!(candidates.back() == best))
+                candidates.push_back(best);
+        }
+
+        if(!improved)
+            break;
+    }
+
+    if(reduced.IsOk())
+    {
+        // Without caches, the workers share the images without copying them:
+        std::vector<quality_t> qualities(candidates.size());
+        thread_pool_t::global().parallel_for(0, candidates.size(), [&](unsigned i)
+        {
+            std::vector<std::uint8_t> dst_nes;
+            std::vector<std::uint8_t> attributes;
+            candidates[i].convert(base_image, dither_image, dst_nes, attributes, nullptr, nullptr, &qualities[i]);
+            evaluations += 1;
+        });
+
+        // Ties go to the earliest, which is the closest to 'start':
+        unsigned pick = 0;
+        for(unsigned i = 1; i < candidates.size(); i += 1)
+            if(tune_score(qualities[i], metric) < tune_score(qualities[pick], metric))
+                pick = i;
+        best = candidates[pick];
+        best_quality = std::move(qualities[pick]);
+    }
+
+    best.optimize_ms = start.optimize_ms;
+    result.settings = best;
+    result.quality = std::move(best_quality);
+    result.evaluations = evaluations;
+    return result;
+}
@@ -0,0 +1,47 @@
+#ifndef TUNE_HPP
+#define TUNE_HPP
+
+#include <wx/wx.h>
+
+#include "image_io.hpp"
+#include "model.hpp"
+#include "quality.hpp"
+
+// What auto_tune() minimizes.
+enum tune_metric_t
+{
+    TUNE_MEAN_ERROR,
+    TUNE_PSNR,
+    TUNE_SSIM,
+    NUM_TUNE_METRICS,
+};
+
+inline constexpr char const* tune_metric_names[NUM_TUNE_METRICS] =
+{
+    "Mean error",
+    "PSNR",
+    "SSIM",
+};
+
+struct tune_result_t
+{
+    settings_t settings; // The best found.
+    quality_t quality;   // Of 'settings', as measured while searching.
+    unsigned evaluations = 0;
+};
+
+// Searches dither_scale, dither_cutoff and the greed of each used knob for
+// the settings that score best by 'metric', one parameter at a time. The
+// values tried for a parameter are converted in parallel on the global
+// thread pool, each worker keeping a convert_cache_t so that the source is
+// only prepared once. Large sources are searched at twice the output size,
+// and the best settings of each step are then compared at the real size.
+// Everything else stays as in 'start', though optimize_ms is left off while
+// searching, as its result depends on timing.
+// The images are shared with the workers, so they must not be shared with
+// anything else, as wxImage reference counts aren't thread safe.
+// Cancelling through 'progress' returns the best found so far.
+tune_result_t auto_tune(settings_t const& start, wxImage const& base_image, wxImage const& dither_image,
+                        tune_metric_t metric, progress_fn_t const& progress = {});
+
+#endif
@@ -0,0 +1,68 @@
+#include "variants.hpp"
+
+#include <algorithm>
+
+#include "resample.hpp"
+#include "thread_pool.hpp"
+
+variant_renderer_t::variant_renderer_t(std::vector<variant_t> new_variants, wxImage const& base_image,
+                                       std::array<wxImage, NUM_MASK_DITHERS> const& new_dither_images)
+: variants(std::move(new_variants))
+, results(variants.size())
+{
+    if(variants.empty() || !base_image.IsOk())
+        return;
+
+    // Scale the source to what convert() compares, so that none of the
+    // variants has to:
+    int const w = variants[0].settings.w;
+    int const h = variants[0].settings.h;
+    unsigned const bw = base_image.GetWidth();
+    unsigned const bh = base_image.GetHeight();
+    unsigned const rw = std::max<unsigned>(1, bw / w);
+    unsigned const rh = std::max<unsigned>(1, bh / h);
+    if(bw != rw * w || bh != rh * h)
+    {
+        source = wxImage(rw * w, rh * h);
+        resample_box(base_image.GetData(), bw, bh, source.GetData(), rw * w, rh * h);
+    }
+    else
+        source = base_image.Copy();
+
+    for(unsigned i = 0; i < dither_images.size(); i += 1)
+        if(new_dither_images[i].IsOk())
+            dither_images[i] = new_dither_images[i].Copy();
+
+    for(unsigned i = 0; i < variants.size(); i += 1)
+    {
+        jobs.push_back(thread_pool_t::global().submit([this, i]
+        {
+            if(cancel)
+                return;
+
+            settings_t const& settings = variants[i].settings;
+            wxImage const& dither_image = dither_images[std::max(settings.dither_style, FIRST_MASK) - FIRST_MASK];
+            result_t& result = results[i];
+            settings.convert(source, dither_image, result.nes, result.attributes, nullptr, nullptr, &result.quality);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.push_back(i);
+            finished += 1;
+        }));
+    }
+}
+
+variant_renderer_t::~variant_renderer_t()
+{
+    cancel = true;
+    for(std::future<void>& job : jobs)
+        job.wait();
+}
+
+std::vector<unsigned> variant_renderer_t::poll()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<unsigned> result;
+    result.swap(ready);
+    return result;
+}
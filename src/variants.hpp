@@ -0,0 +1,71 @@
+#ifndef VARIANTS_HPP
+#define VARIANTS_HPP
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <wx/wx.h>
+
+#include "model.hpp"
+#include "quality.hpp"
+
+struct variant_t
+{
+    std::string label;
+    settings_t settings;
+};
+
+// Converts one image under several settings at once, each on the global
+// thread pool, so that results can be shown as they finish. Variants must
+// share the output size of the first, as the source is scaled once for all.
+class variant_renderer_t
+{
+public:
+    variant_renderer_t(std::vector<variant_t> variants, wxImage const& base_image,
+                       std::array<wxImage, NUM_MASK_DITHERS> const& dither_images);
+
+    // Skips the variants not yet started and waits for the rest.
+    ~variant_renderer_t();
+
+    variant_renderer_t(variant_renderer_t const&) = delete;
+    variant_renderer_t& operator=(variant_renderer_t const&) = delete;
+
+    std::vector<variant_t> const variants;
+
+    // The variants finished since the last call. Their output() and
+    // quality() can be read from then on.
+    std::vector<unsigned> poll();
+
+    bool done() const { return finished == variants.size(); }
+
+    std::vector<std::uint8_t> const& output(unsigned i) const { return results[i].nes; }
+    quality_t const& quality(unsigned i) const { return results[i].quality; }
+
+private:
+    struct result_t
+    {
+        std::vector<std::uint8_t> nes;
+        std::vector<std::uint8_t> attributes;
+        quality_t quality;
+    };
+
+    std::vector<result_t> results;
+
+    // Only read by the workers. These share no reference counts with the
+    // caller's images, as wxImage's aren't thread safe:
+    wxImage source;
+    std::array<wxImage, NUM_MASK_DITHERS> dither_images;
+
+    std::atomic<bool> cancel = false;
+    std::atomic<unsigned> finished = 0;
+    std::mutex mutex;
+    std::vector<unsigned> ready;
+    std::vector<std::future<void>> jobs;
+};
+
+#endif